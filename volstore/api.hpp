@@ -5,6 +5,7 @@
 #include "http.hpp"
 #include "binary.hpp"
 #include "image.hpp"
+#include "uring.hpp"
 
 #include "kreg/service.hpp"
 
@@ -66,11 +67,14 @@ namespace volstore
 			}
 		};
 
-		template < typename TH > class StorageService2
+		//IMAGE selects the storage engine, Image2 or any engine with the same surface such as ImageUring.
+		//
+
+		template < typename TH, template < typename > class IMAGE = Image2 > class StorageService2
 		{
-			Image2<TH> store;
-			HttpStore<Image2<TH>> http;
-			BinaryStore2<Image2<TH>> binary;
+			IMAGE<TH> store;
+			HttpStore<IMAGE<TH>> http;
+			BinaryStore2<IMAGE<TH>> binary;
 			kreg::Service registry;
 
 		public:
@@ -116,5 +120,9 @@ namespace volstore
 				binary.Join();
 			}
 		};
+
+#ifdef VOLSTORE_URING
+		template < typename TH > using StorageServiceUring = StorageService2<TH, ImageUring>;
+#endif
 	}
 }
\ No newline at end of file
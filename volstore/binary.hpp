@@ -11,6 +11,16 @@
 #include <array>
 #include <future>
 #include <bitset>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <cstring>
+#include <chrono>
+#include <unordered_map>
+
+#include "bitmap.hpp"
+#include "codec.hpp"
 
 #include "d8u/util.hpp"
 
@@ -23,8 +33,122 @@ namespace volstore
     using namespace d8u;
     using namespace d8u::util;
 
+    //Query messages of one byte plus whole keys carry a command in the first byte.
+    //
+
+    namespace command
+    {
+        constexpr uint8_t validate = 1;
+        constexpr uint8_t remove = 2;
+        constexpr uint8_t many = 3;     //Keys of one bitmap::frame_t frame, the reply is their bitmap.
+        constexpr uint8_t stored = 4;   //Key and the codec::accepted mask of the client, the reply is codec::reply.
+    }
+
+    //Client side caches only remember that a block exists. A delete leaves this marker so the next query goes to the server.
+    //
+
+    static uint64_t constexpr forgotten = 1;
+
+    //Cache slots are shared by every thread of the client, they're read and written through atomic_ref:
+    //
+
+    inline bool cached(uint64_t* slot)
+    {
+        return std::atomic_ref<uint64_t>(*slot).load(std::memory_order_acquire) != forgotten;
+    }
+
+    inline void mark(uint64_t* slot, uint64_t v)
+    {
+        std::atomic_ref<uint64_t>(*slot).store(v, std::memory_order_release);
+    }
+
+    template <size_t U, typename DB, typename T> void forget(DB& db, const T& ids)
+    {
+        auto limit = ids.size() / U;
+
+        for (size_t i = 0; i < limit; i++)
+        {
+            auto* ptr = db.FindLock(*(tdb::Key32*)((uint8_t*)ids.data() + i * U));
+
+            if (ptr)
+                mark(ptr, forgotten);
+        }
+    }
+
+    //Splits a ManyBitmap batch on a client side cache. Known keys are set in result, the indexes of the rest are returned.
+    //
+
+    template <size_t U, typename DB, typename T> std::vector<size_t> uncached(DB& db, const T& ids, std::vector<uint8_t>& result)
+    {
+        auto limit = ids.size() / U;
+        std::vector<size_t> index;
+
+        for (size_t i = 0; i < limit; i++)
+        {
+            auto [ptr, exists] = db.InsertLock(*(tdb::Key32*)((uint8_t*)ids.data() + i * U), uint64_t(0));
+
+            if (exists && cached(ptr))
+                bitmap::set(result.data(), i);
+            else
+            {
+                mark(ptr, forgotten); //Not known to exist, the server answers for it again next time.
+                index.push_back(i);
+            }
+        }
+
+        return index;
+    }
+
+    //command::many message for count keys of a batch, the keys at index[first] onward.
+    //
+
+    template <size_t U, typename T> std::vector<uint8_t> many_frame(const T& ids, const std::vector<size_t>& index, size_t first, size_t count)
+    {
+        std::vector<uint8_t> message(1 + count * U);
+        message[0] = command::many;
+
+        for (size_t i = 0; i < count; i++)
+            std::memcpy(message.data() + 1 + i * U, (const uint8_t*)ids.data() + index[first + i] * U, U);
+
+        return message;
+    }
+
     template <typename STORE, size_t U = 32, size_t M = 1024 * 1024> class BinaryStore
     {
+        //Map and Allocate replies use the mapping after the handler returns. Each connection holds its last one until
+        //its next request, the segment stays mapped until then. A connection that went away lets go after pin_t seconds.
+        //
+        static size_t constexpr pin_t = 10;
+
+        struct Pin
+        {
+            std::shared_ptr<void> mapping;
+            std::chrono::steady_clock::time_point at;
+        };
+
+        std::mutex pins_lock;
+        std::unordered_map<void*, Pin> pins;
+        std::chrono::steady_clock::time_point swept;
+
+        template <typename MAPPING> gsl::span<uint8_t> Hold(void* pc, MAPPING&& m)
+        {
+            auto mapping = std::make_shared<std::decay_t<MAPPING>>(std::forward<MAPPING>(m));
+            auto result = gsl::span<uint8_t>((uint8_t*)mapping->data(), mapping->size());
+            auto now = std::chrono::steady_clock::now();
+
+            std::lock_guard<std::mutex> lck(pins_lock);
+
+            pins[pc] = Pin { std::move(mapping), now };
+
+            if (now - swept > std::chrono::seconds(pin_t))
+            {
+                std::erase_if(pins, [&](auto& p) { return now - p.second.at > std::chrono::seconds(pin_t); });
+                swept = now;
+            }
+
+            return result;
+        }
+
         bool buffered_writes = true;
         TcpServer<> query;
         TcpServer<> read;
@@ -66,7 +190,36 @@ namespace volstore
                 [&](auto server,auto* pc, auto req, auto body, void *reply)
                 {
                     std::vector<uint8_t> buffer;
-                    if (req.size() == 33)
+                    if (req.size() % U == 1 && req[0] == command::remove)
+                    {
+                        if (req.size() / U > 64)
+                        {
+                            std::cout << "Query Dropping Connection" << std::endl;
+                            pc->Close();
+
+                            return;
+                        }
+
+                        buffer.resize(8);
+                        *((uint64_t*)buffer.data()) = store.DeleteMany<U>(gsl::span<uint8_t>(req.data() + 1, req.size() - 1));
+                    }
+                    else if (req.size() % U == 1 && req[0] == command::many)
+                    {
+                        if (req.size() / U > bitmap::frame_t)
+                        {
+                            std::cout << "Query Dropping Connection" << std::endl;
+                            pc->Close();
+
+                            return;
+                        }
+
+                        buffer = store.ManyBitmap<U>(gsl::span<uint8_t>(req.data() + 1, req.size() - 1));
+                    }
+                    else if (req.size() == U + 2 && req[0] == command::stored)
+                    {
+                        buffer = codec::reply(store, gsl::span<uint8_t>(req.data() + 1, U), req[U + 1]);
+                    }
+                    else if (req.size() == 33)
                     {
                         buffer.resize(1);
                         buffer[0] = (char)store.ValidateStandard(gsl::span<uint8_t>(req.data()+1, (size_t)32));
@@ -103,7 +256,7 @@ namespace volstore
                         return;
                     }
 
-                    auto result = store.Map(req);
+                    auto result = Hold(pc, store.Map(req));
 
                     if (!result.size())
                         result = gsl::span<uint8_t>((uint8_t*)&_null, sizeof(uint32_t));
@@ -144,7 +297,7 @@ namespace volstore
                             written = 0;
                         else
                         {
-                            auto dest = store.Allocate(id, (size_t)size);
+                            auto dest = Hold(pc, store.Allocate(id, (size_t)size));
 
                             pc->Read(dest);
                             written = size;
@@ -205,7 +358,42 @@ namespace volstore
                     d8u::trace("query", req.size());
 
                     d8u::sse_vector buffer;
-                    if (req.size() == 33)
+                    if (req.size() % U == 1 && req[0] == command::remove)
+                    {
+                        if (req.size() / U > 64)
+                        {
+                            std::cout << "Query Dropping Connection" << std::endl;
+                            pc->Close();
+
+                            return;
+                        }
+
+                        buffer.resize(8);
+                        *((uint64_t*)buffer.data()) = store.DeleteMany<U>(gsl::span<uint8_t>(req.data() + 1, req.size() - 1));
+                    }
+                    else if (req.size() % U == 1 && req[0] == command::many)
+                    {
+                        if (req.size() / U > bitmap::frame_t)
+                        {
+                            std::cout << "Query Dropping Connection" << std::endl;
+                            pc->Close();
+
+                            return;
+                        }
+
+                        auto bits = store.ManyBitmap<U>(gsl::span<uint8_t>(req.data() + 1, req.size() - 1));
+
+                        buffer.resize(bits.size());
+                        std::copy(bits.begin(), bits.end(), buffer.begin());
+                    }
+                    else if (req.size() == U + 2 && req[0] == command::stored)
+                    {
+                        auto stored = codec::reply(store, gsl::span<uint8_t>(req.data() + 1, U), req[U + 1]);
+
+                        buffer.resize(stored.size());
+                        std::copy(stored.begin(), stored.end(), buffer.begin());
+                    }
+                    else if (req.size() == 33)
                     {
                         buffer.resize(1);
                         buffer[0] = (char)store.ValidateStandard(gsl::span<uint8_t>(req.data() + 1, (size_t)32));
@@ -321,9 +509,11 @@ namespace volstore
         {
             auto [ptr, exists] = db.InsertLock(*( (tdb::Key32*) id.data() ), uint64_t(0));
 
-            if (exists)
+            if (exists && cached(ptr))
                 return true;
 
+            mark(ptr, 0);
+
             auto [res,body] = query.AsyncWriteWaitT(id);
 
             return (res.size() == 1 ) ? res[0] > 0 : false;
@@ -343,11 +533,13 @@ namespace volstore
             {
                 auto [ptr, exists] = db.InsertLock(*(((tdb::Key32*)ids.data()) + i), uint64_t(0));
 
-                if (exists)
+                if (exists && cached(ptr))
                 {
                     cache_result[i] = 1;
                     cache_count++;
                 }
+                else
+                    mark(ptr, 0);
             }
 
             if (cache_count == limit)
@@ -365,13 +557,76 @@ namespace volstore
             return result | cache_result.to_ullong();
         }
 
+        //Existence of any number of keys as a bitmap, the keys the cache doesn't know go out in frames, see bitmap.hpp.
+        //
+
+        template <size_t U, typename T> std::vector<uint8_t> ManyBitmap(const T& ids)
+        {
+            std::vector<uint8_t> result(bitmap::bytes(ids.size() / U));
+            auto index = uncached<U>(db, ids, result);
+
+            bitmap::frames(index.size(), [&](size_t first, size_t count)
+            {
+                auto [res, body] = query.AsyncWriteWait(many_frame<U>(ids, index, first, count));
+
+                if (res.size() != bitmap::bytes(count))
+                    throw runtime_error("Bad reply");
+
+                bitmap::merge(result, index.data() + first, count, res.data(), res.size());
+            });
+
+            return result;
+        }
+
+        //The block as stored when this build decodes its codec, c names it, see codec::decompress. Otherwise the server
+        //decodes it and c is codec::none.
+        //
+
+        template <typename T> std::vector<uint8_t> ReadStored(const T& id, uint8_t& c)
+        {
+            std::vector<uint8_t> message(34);
+            message[0] = command::stored;
+            std::memcpy(message.data() + 1, id.data(), 32);
+            message[33] = codec::accepted();
+
+            auto [res, body] = query.AsyncWriteWait(std::move(message));
+
+            if (res.size() <= 1)
+                throw std::runtime_error("Block Not Found");
+
+            c = res[0];
+
+            return std::vector<uint8_t>(res.begin() + 1, res.end());
+        }
+
         template <typename T, typename V> bool Validate(const T& id, V v)
         {
-            std::vector<uint8_t> cmd = { 1 };
+            std::vector<uint8_t> cmd = { command::validate };
             auto [res, body] = query.AsyncWriteWait(join_memory(cmd,id));
 
             return (res.size() == 1) ? res[0] > 0 : false;
         }
+
+        template <size_t U, typename T> uint64_t DeleteMany(const T& ids)
+        {
+            if (ids.size() / U > 64)
+                throw runtime_error("The max limit for DeleteMany is 64");
+
+            forget<U>(db, ids);
+
+            std::vector<uint8_t> cmd = { command::remove };
+            auto [res, body] = query.AsyncWriteWait(join_memory(cmd, ids));
+
+            if (res.size() != 8)
+                throw runtime_error("Bad reply");
+
+            return *(uint64_t*)res.data();
+        }
+
+        template <typename T> bool Delete(const T& id)
+        {
+            return DeleteMany<32>(id) & 1;
+        }
     };
 
     template < size_t reconnect_retry = 10 > class BinaryStoreClient2
@@ -502,16 +757,18 @@ namespace volstore
         {
             auto [ptr, exists] = db.InsertLock(*((tdb::Key32*) id.data()), uint64_t(0));
 
-            return exists ? 1 : 0;
+            return (exists && cached(ptr)) ? 1 : 0;
         }
 
         template < typename T > bool _Is1(const T& id)
         {
             auto [ptr, exists] = db.InsertLock(*((tdb::Key32*) id.data()), uint64_t(0));
 
-            if (exists)
+            if (exists && cached(ptr))
                 return true;
 
+            mark(ptr, 0);
+
             Reconnect(query, addr_query, [&]()
             {
                 query.SendT(id);
@@ -580,9 +837,57 @@ namespace volstore
             return _Many2();
         }
 
+        //Existence of any number of keys as a bitmap. The keys the cache doesn't know go out in frames, up to
+        //bitmap::window_t of them in flight, and the in order replies are merged as they arrive.
+        //
+
+        template <size_t U, typename T> std::vector<uint8_t> ManyBitmap(const T& ids)
+        {
+            std::vector<uint8_t> result(bitmap::bytes(ids.size() / U));
+            auto index = uncached<U>(db, ids, result);
+
+            std::deque<std::pair<size_t, size_t>> pending;
+
+            auto receive = [&]()
+            {
+                auto [first, count] = pending.front();
+                pending.pop_front();
+
+                d8u::sse_vector res;
+
+                Reconnect(query, addr_query, [&]()
+                {
+                    res = query.ReceiveMessage();
+                }, true);
+
+                if (res.size() != bitmap::bytes(count))
+                    throw std::runtime_error("Query assert failed");
+
+                bitmap::merge(result, index.data() + first, count, res.data(), res.size());
+            };
+
+            bitmap::frames(index.size(), [&](size_t first, size_t count)
+            {
+                if (pending.size() == bitmap::window_t)
+                    receive();
+
+                Reconnect(query, addr_query, [&]()
+                {
+                    query.SendMessage(many_frame<U>(ids, index, first, count));
+                });
+
+                pending.emplace_back(first, count);
+            });
+
+            while (pending.size())
+                receive();
+
+            return result;
+        }
+
         template <typename T, typename V> bool Validate(const T& id, V v)
         {
-            std::vector<uint8_t> cmd = { 1 };
+            std::vector<uint8_t> cmd = { command::validate };
 
             query.SendMessage(join_memory(cmd, id));
 
@@ -590,6 +895,37 @@ namespace volstore
 
             return (res.size() == 1) ? res[0] > 0 : false;
         }
+
+        template <size_t U, typename T> uint64_t DeleteMany(const T& ids)
+        {
+            if (ids.size() / U > 64)
+                throw runtime_error("The max limit for DeleteMany is 64");
+
+            forget<U>(db, ids);
+
+            std::vector<uint8_t> cmd = { command::remove };
+            d8u::sse_vector res;
+
+            Reconnect(query, addr_query, [&]()
+            {
+                query.SendMessage(join_memory(cmd, ids));
+            });
+
+            Reconnect(query, addr_query, [&]()
+            {
+                res = query.ReceiveMessage();
+            }, true);
+
+            if (res.size() != 8)
+                throw std::runtime_error("Query assert failed");
+
+            return *(uint64_t*)res.data();
+        }
+
+        template <typename T> bool Delete(const T& id)
+        {
+            return DeleteMany<32>(id) & 1;
+        }
     };
 
     class BinaryStoreEventClient
@@ -640,12 +976,14 @@ namespace volstore
         {
             auto [ptr, exists] = db.InsertLock(id, uint64_t(0));
 
-            if (exists)
+            if (exists && cached(ptr))
             {
                 f(true);
                 return;
             }
 
+            mark(ptr, 0);
+
             query.AsyncWriteCallbackT(id,[f = std::move(f)](auto result, auto body)
             {
                 f((result.size() == 1) ? result[0] > 0 : false);
@@ -669,10 +1007,74 @@ namespace volstore
             });
         }
 
+        //Existence of any number of keys, f(bitmap) runs once the last frame has been answered. See bitmap.hpp.
+        //
+
+        template <size_t U, typename T, typename F> void ManyBitmap(const T& ids, F f)
+        {
+            struct State
+            {
+                std::vector<uint8_t> result;
+                std::vector<size_t> index;
+                std::atomic<size_t> pending = 0;
+                std::mutex lock;
+                F f;
+
+                State(F&& _f) : f(std::move(_f)) { }
+            };
+
+            auto state = std::make_shared<State>(std::move(f));
+
+            state->result.resize(bitmap::bytes(ids.size() / U));
+            state->index = uncached<U>(db, ids, state->result);
+
+            if (!state->index.size())
+                return state->f(std::move(state->result));
+
+            state->pending = (state->index.size() + bitmap::frame_t - 1) / bitmap::frame_t;
+
+            bitmap::frames(state->index.size(), [&](size_t first, size_t count)
+            {
+                query.AsyncWriteCallback(many_frame<U>(ids, state->index, first, count), [state, first, count](auto result, auto body)
+                {
+                    {
+                        std::lock_guard<std::mutex> lck(state->lock);
+                        bitmap::merge(state->result, state->index.data() + first, count, result.data(), result.size());
+                    }
+
+                    if (--state->pending == 0)
+                        state->f(std::move(state->result));
+                });
+            });
+        }
+
         template <typename T, typename V> bool Validate(const T& id, V v) const
         {
             std::cout << "TODO NET-VALIDATE!!!" << std::endl;
             return true;//TODO request server to validate block without transport.
         }
+
+        template <size_t U, typename T, typename F> void DeleteMany(const T& ids, F f)
+        {
+            if (ids.size() / U > 64)
+                throw runtime_error("The max limit for DeleteMany is 64");
+
+            forget<U>(db, ids);
+
+            std::vector<uint8_t> cmd = { command::remove };
+
+            query.AsyncWriteCallback(join_memory(cmd, ids), [f = std::move(f)](auto result, auto body)
+            {
+                f((result.size() == 8) ? *(uint64_t*)result.data() : 0);
+            });
+        }
+
+        template <typename T, typename F> void Delete(const T& id, F f)
+        {
+            DeleteMany<32>(id, [f = std::move(f)](uint64_t res)
+            {
+                f((res & 1) != 0);
+            });
+        }
     };
 }
\ No newline at end of file
@@ -0,0 +1,86 @@
+/* Copyright (C) 2020 D8DATAWORKS - All Rights Reserved */
+
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <bitset>
+#include <cstdint>
+
+namespace volstore
+{
+	/*
+		Existence bitmaps for key batches of any size, bit i % 8 of byte i / 8 answers key i.
+
+		On the wire a batch travels as frames of at most frame_t keys, each answered on its own. A large batch is a
+		stream of bounded requests: the server never spends more than one frame of lookups on an event, and the
+		client merges replies as they arrive. Servers refuse larger frames.
+	*/
+
+	namespace bitmap
+	{
+		static size_t constexpr frame_t = 16 * 1024;
+
+		//Frames a client keeps in flight before it waits on a reply.
+		//
+		static size_t constexpr window_t = 8;
+
+		inline size_t bytes(size_t bits)
+		{
+			return (bits + 7) / 8;
+		}
+
+		inline bool get(const uint8_t* b, size_t i)
+		{
+			return (b[i / 8] >> (i % 8)) & 1;
+		}
+
+		inline void set(uint8_t* b, size_t i)
+		{
+			b[i / 8] |= uint8_t(1) << (i % 8);
+		}
+
+		inline size_t count(const std::vector<uint8_t>& b)
+		{
+			size_t result = 0;
+
+			for (auto v : b)
+				result += std::bitset<8>(v).count();
+
+			return result;
+		}
+
+		//f(first, count) for each frame of a batch of keys.
+		//
+
+		template < typename F > void frames(size_t keys, F&& f)
+		{
+			for (size_t first = 0; first < keys; first += frame_t)
+				f(first, std::min(frame_t, keys - first));
+		}
+
+		//Sets the bits of result named by index[i] for every bit i set in a frame reply.
+		//
+
+		inline void merge(std::vector<uint8_t>& result, const size_t* index, size_t count, const uint8_t* reply, size_t reply_size)
+		{
+			count = std::min(count, reply_size * 8);
+
+			for (size_t i = 0; i < count; i++)
+				if (get(reply, i))
+					set(result.data(), index[i]);
+		}
+
+		//Same for a frame of consecutive keys starting at first.
+		//
+
+		inline void merge_at(std::vector<uint8_t>& result, size_t first, size_t count, const uint8_t* reply, size_t reply_size)
+		{
+			count = std::min(count, reply_size * 8);
+
+			for (size_t i = 0; i < count; i++)
+				if (get(reply, i))
+					set(result.data(), first + i);
+		}
+	}
+}
@@ -0,0 +1,271 @@
+/* Copyright (C) 2020 D8DATAWORKS - All Rights Reserved */
+
+#pragma once
+
+#include <vector>
+#include <list>
+#include <deque>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <cstring>
+
+#include "tdb/legacy.hpp"
+
+namespace volstore
+{
+	/*
+		Block read cache, S3-FIFO per shard.
+
+		New blocks enter a small FIFO that holds a tenth of the shard. A block read again before it leaves is
+		promoted to the main FIFO, otherwise only its key is kept in a ghost FIFO. A block that comes back while its
+		key is a ghost goes straight to main. Main evicts like CLOCK: a block read since it last passed the tail
+		is moved back to the head. A scan reads every block once, so it churns through the small FIFO without
+		touching the main one.
+
+		Entries remember the index value they were read at, a lookup only hits when the block is still there.
+		Deleted, rewritten or moved blocks fall out on their own, the engines don't have to invalidate.
+	*/
+
+	template < typename V > class BlockCache
+	{
+		static size_t constexpr shards_t = 64;
+		static size_t constexpr small_percent_t = 10;
+		static uint8_t constexpr max_frequency_t = 3;
+
+		struct Entry
+		{
+			tdb::Key32 key;
+			uint64_t location;
+			std::shared_ptr<const V> value;
+			size_t size;
+			uint8_t frequency;
+			bool main;
+		};
+
+		using Queue = std::list<Entry>;
+
+		struct KeyHash
+		{
+			size_t operator()(const tdb::Key32& k) const
+			{
+				size_t h;
+				std::memcpy(&h, &k, sizeof(h));
+
+				return h;
+			}
+		};
+
+		struct KeyEqual
+		{
+			bool operator()(const tdb::Key32& l, const tdb::Key32& r) const
+			{
+				return !std::memcmp(&l, &r, sizeof(tdb::Key32));
+			}
+		};
+
+		struct alignas(64) Shard
+		{
+			std::mutex lock;
+
+			Queue small;
+			Queue main;
+			size_t small_bytes = 0;
+			size_t main_bytes = 0;
+
+			std::unordered_map<tdb::Key32, typename Queue::iterator, KeyHash, KeyEqual> entries;
+
+			//Ghost keys by their hash, the sequence tells a live ghost from one pushed again later.
+			//
+			std::deque<std::pair<uint64_t, uint64_t>> ghosts;
+			std::unordered_map<uint64_t, uint64_t> ghost_set;
+			uint64_t ghost_sequence = 0;
+		};
+
+		std::unique_ptr<Shard[]> shards;
+		std::atomic<size_t> capacity = 0;
+
+		//Key bytes the index buckets and the filter don't use.
+		//
+
+		static uint64_t Hash(const tdb::Key32& k)
+		{
+			uint64_t h;
+			std::memcpy(&h, (const uint8_t*)&k + 24, sizeof(h));
+
+			return h;
+		}
+
+		Shard& ShardOf(const tdb::Key32& k)
+		{
+			return shards[Hash(k) % shards_t];
+		}
+
+		void Remove(Shard& s, typename Queue::iterator i)
+		{
+			auto& queue = (i->main) ? s.main : s.small;
+			auto& bytes = (i->main) ? s.main_bytes : s.small_bytes;
+
+			bytes -= i->size;
+			s.entries.erase(i->key);
+			queue.erase(i);
+		}
+
+		void Ghost(Shard& s, const tdb::Key32& k)
+		{
+			auto h = Hash(k);
+			auto sequence = ++s.ghost_sequence;
+
+			s.ghosts.emplace_back(h, sequence);
+			s.ghost_set[h] = sequence;
+
+			//As many ghosts as main holds blocks:
+			//
+
+			while (s.ghosts.size() > std::max<size_t>(s.main.size(), 1))
+			{
+				auto [old, seq] = s.ghosts.front();
+				s.ghosts.pop_front();
+
+				auto g = s.ghost_set.find(old);
+
+				if (g != s.ghost_set.end() && g->second == seq)
+					s.ghost_set.erase(g);
+			}
+		}
+
+		void EvictSmall(Shard& s)
+		{
+			auto i = std::prev(s.small.end());
+
+			if (i->frequency)
+			{
+				i->main = true;
+				i->frequency = 0;
+
+				s.small_bytes -= i->size;
+				s.main_bytes += i->size;
+				s.main.splice(s.main.begin(), s.small, i);
+			}
+			else
+			{
+				Ghost(s, i->key);
+				Remove(s, i);
+			}
+		}
+
+		void EvictMain(Shard& s)
+		{
+			while (true)
+			{
+				auto i = std::prev(s.main.end());
+
+				if (!i->frequency)
+				{
+					Remove(s, i);
+					return;
+				}
+
+				i->frequency--;
+				s.main.splice(s.main.begin(), s.main, i);
+			}
+		}
+
+		void Evict(Shard& s, size_t limit)
+		{
+			while (s.small_bytes + s.main_bytes > limit)
+			{
+				if (s.small.size() && (s.small_bytes > limit * small_percent_t / 100 || s.main.empty()))
+					EvictSmall(s);
+				else
+					EvictMain(s);
+			}
+		}
+
+	public:
+
+		BlockCache()
+			: shards(std::make_unique<Shard[]>(shards_t)) { }
+
+		bool Enabled() const { return capacity.load(std::memory_order_relaxed) != 0; }
+
+		//Total bytes of payload held, zero disables the cache and drops what it holds.
+		//
+
+		void Capacity(size_t bytes)
+		{
+			capacity = bytes;
+
+			for (size_t i = 0; i < shards_t; i++)
+			{
+				std::lock_guard<std::mutex> lck(shards[i].lock);
+				Evict(shards[i], bytes / shards_t);
+			}
+		}
+
+		size_t Capacity() const { return capacity; }
+
+		//Null unless the block is cached at location.
+		//
+
+		std::shared_ptr<const V> Find(const tdb::Key32& k, uint64_t location)
+		{
+			if (!Enabled())
+				return nullptr;
+
+			auto& s = ShardOf(k);
+			std::lock_guard<std::mutex> lck(s.lock);
+
+			auto i = s.entries.find(k);
+
+			if (i == s.entries.end())
+				return nullptr;
+
+			auto& e = *i->second;
+
+			if (e.location != location)
+			{
+				Remove(s, i->second);
+				return nullptr;
+			}
+
+			if (e.frequency < max_frequency_t)
+				e.frequency++;
+
+			return e.value;
+		}
+
+		void Insert(const tdb::Key32& k, uint64_t location, const V& value)
+		{
+			size_t limit = capacity.load(std::memory_order_relaxed) / shards_t;
+
+			if (!limit || value.size() > limit)
+				return;
+
+			auto shared = std::make_shared<const V>(value);
+
+			auto& s = ShardOf(k);
+			std::lock_guard<std::mutex> lck(s.lock);
+
+			auto i = s.entries.find(k);
+
+			if (i != s.entries.end())
+				Remove(s, i->second);
+
+			auto g = s.ghost_set.find(Hash(k));
+			bool main = g != s.ghost_set.end();
+
+			if (main)
+				s.ghost_set.erase(g);
+
+			auto& queue = (main) ? s.main : s.small;
+
+			queue.push_front(Entry{ k, location, std::move(shared), value.size(), 0, main });
+			((main) ? s.main_bytes : s.small_bytes) += value.size();
+			s.entries.emplace(k, queue.begin());
+
+			Evict(s, limit);
+		}
+	};
+}
@@ -0,0 +1,207 @@
+/* Copyright (C) 2020 D8DATAWORKS - All Rights Reserved */
+
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstring>
+
+//Codecs are opt in, define VOLSTORE_LZ4 and/or VOLSTORE_ZSTD and link lz4 / zstd (-llz4 -lzstd), the x64 project does both:
+//
+
+#ifdef VOLSTORE_LZ4
+#if !__has_include(<lz4.h>)
+#error "VOLSTORE_LZ4 is defined but lz4.h is missing"
+#endif
+#include <lz4.h>
+#endif
+
+#ifdef VOLSTORE_ZSTD
+#if !__has_include(<zstd.h>)
+#error "VOLSTORE_ZSTD is defined but zstd.h is missing"
+#endif
+#include <zstd.h>
+#endif
+
+namespace volstore
+{
+	/*
+		Per block compression, named by the codec byte of the record header.
+
+		A compressed payload is the uncompressed length followed by one LZ4 block or zstd frame. The record length and
+		checksum cover the stored bytes, so scrub, flatten and repair move compressed records verbatim. A block is only
+		stored compressed when that saves at least an eighth of it, everything else stays raw under codec none.
+	*/
+
+	namespace codec
+	{
+		enum Codec : uint8_t
+		{
+			none = 0,
+			lz4 = 1,	//Fast.
+			zstd = 2	//Dense.
+		};
+
+		static int constexpr zstd_level_t = 3;
+
+		inline bool supported(uint8_t c)
+		{
+			switch (c)
+			{
+			case none: return true;
+#ifdef VOLSTORE_LZ4
+			case lz4: return true;
+#endif
+#ifdef VOLSTORE_ZSTD
+			case zstd: return true;
+#endif
+			default: return false;
+			}
+		}
+
+		//Stored form of the payload, empty when the codec isn't built in or the block doesn't compress well.
+		//
+
+		inline std::vector<uint8_t> compress(uint8_t c, const uint8_t* p, size_t n)
+		{
+			std::vector<uint8_t> result;
+
+			if (c == none || !n || !supported(c) || n > UINT32_MAX)
+				return result;
+
+			uint32_t length = (uint32_t)n;
+			size_t limit = n - n / 8;
+			size_t count = 0;
+
+			result.resize(sizeof(uint32_t) + limit);
+			std::memcpy(result.data(), &length, sizeof(uint32_t));
+
+			auto dest = result.data() + sizeof(uint32_t);
+
+			switch (c)
+			{
+#ifdef VOLSTORE_LZ4
+			case lz4:
+			{
+				int r = LZ4_compress_default((const char*)p, (char*)dest, (int)n, (int)limit);
+				count = (r > 0) ? (size_t)r : 0;
+				break;
+			}
+#endif
+#ifdef VOLSTORE_ZSTD
+			case zstd:
+			{
+				size_t r = ZSTD_compress(dest, limit, p, n, zstd_level_t);
+				count = ZSTD_isError(r) ? 0 : r;
+				break;
+			}
+#endif
+			default:
+				break;
+			}
+
+			if (!count || sizeof(uint32_t) + count >= n - n / 8)
+			{
+				result.clear();
+				return result;
+			}
+
+			result.resize(sizeof(uint32_t) + count);
+
+			return result;
+		}
+
+		//Uncompressed length of a stored payload.
+		//
+
+		inline uint32_t length(uint8_t c, const uint8_t* p, size_t n)
+		{
+			if (c == none)
+				return (uint32_t)n;
+
+			if (n < sizeof(uint32_t))
+				return 0;
+
+			uint32_t result;
+			std::memcpy(&result, p, sizeof(uint32_t));
+
+			return result;
+		}
+
+		//dest holds length(c, p, n) bytes. False for a codec that isn't built in or a frame that doesn't decode to that length.
+		//
+
+		inline bool decompress(uint8_t c, const uint8_t* p, size_t n, uint8_t* dest)
+		{
+			if (c == none)
+			{
+				std::memcpy(dest, p, n);
+				return true;
+			}
+
+			if (n < sizeof(uint32_t))
+				return false;
+
+			uint32_t size = length(c, p, n);
+
+			p += sizeof(uint32_t);
+			n -= sizeof(uint32_t);
+
+			switch (c)
+			{
+#ifdef VOLSTORE_LZ4
+			case lz4:
+				return LZ4_decompress_safe((const char*)p, (char*)dest, (int)n, (int)size) == (int)size;
+#endif
+#ifdef VOLSTORE_ZSTD
+			case zstd:
+				return ZSTD_decompress(dest, size, p, n) == size;
+#endif
+			default:
+				return false;
+			}
+		}
+
+		//Codecs this build decodes as a mask of 1 << codec, the capability a client sends with a stored read.
+		//
+
+		inline uint8_t accepted()
+		{
+			uint8_t result = 0;
+
+			for (uint8_t c : { lz4, zstd })
+				if (supported(c))
+					result |= uint8_t(1) << c;
+
+			return result;
+		}
+
+		//Stored read reply, the codec byte and then the payload. The store decodes when it keeps no codec per block or the
+		//client can't take this one. A missing block is the codec byte alone.
+		//
+
+		template <typename STORE, typename T> std::vector<uint8_t> reply(STORE& store, const T& id, uint8_t accept)
+		{
+			std::vector<uint8_t> result(1, none);
+
+			if constexpr (requires (uint8_t& c) { store.ReadStored(id, c); })
+			{
+				uint8_t c = none;
+				auto block = store.ReadStored(id, c);
+
+				if (c == none || (accept & (uint8_t(1) << c)))
+				{
+					result[0] = c;
+					result.insert(result.end(), block.begin(), block.end());
+
+					return result;
+				}
+			}
+
+			auto block = store.Read(id);
+			result.insert(result.end(), block.begin(), block.end());
+
+			return result;
+		}
+	}
+}
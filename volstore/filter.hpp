@@ -0,0 +1,288 @@
+/* Copyright (C) 2020 D8DATAWORKS - All Rights Reserved */
+
+#pragma once
+
+#include <string_view>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <filesystem>
+#include <atomic>
+#include <cstring>
+#include <algorithm>
+#include <memory>
+#include <array>
+
+#include "index.hpp"
+#include "io.hpp"
+
+#include "tdb/legacy.hpp"
+
+namespace volstore
+{
+	/*
+		Blocked Bloom filter in front of the index, answers most queries for unknown blocks without touching index.db.
+
+		Each key sets 7 bits inside one 512 bit block, so a query costs a single cache line. 12 bits per key,
+		about 1% false positives at the sized key count. Keys are uniform hashes, the block and bit positions
+		come straight from key bytes the index doesn't bucket on. Bits are only ever set, deleted keys stay
+		"maybe" and the index answers for them.
+
+		Keys that set a new bit are counted. The Add that takes the newest table past what it was sized for stacks one
+		twice its size on top and new keys go there, queries check every table. The false positive rates of the tables
+		add up, indexes that can list their keys are rebuilt into a single table on open.
+	*/
+
+	class BloomFilter
+	{
+		static size_t constexpr bits_per_key_t = 12;
+		static size_t constexpr hashes_t = 7;
+		static size_t constexpr words_t = 8;
+		static size_t constexpr layers_t = 16;
+		static uint64_t constexpr minimum_t = 1024 * 1024;
+
+		static uint64_t constexpr magic_t = 0xD8B1F17E00000002;
+
+		struct Table
+		{
+			std::vector<uint64_t> words;
+			uint64_t blocks;
+
+			Table(uint64_t _blocks) : words(_blocks * words_t), blocks(_blocks) { }
+
+			uint64_t* Block(uint64_t h1) { return words.data() + (h1 % blocks) * words_t; }
+
+			uint64_t Capacity() const { return blocks * words_t * 64 / bits_per_key_t; }
+		};
+
+		//Tables are stacked by one Add at a time, queries and adds read layers[0, depth).
+		//
+		std::vector<std::unique_ptr<Table>> tables;
+		std::array<std::atomic<Table*>, layers_t> layers = {};
+		std::atomic<size_t> depth = 0;
+		std::atomic<bool> growing = false;
+
+		std::atomic<uint64_t> keys = 0;
+		bool enabled = false;
+
+		static void Hash(const tdb::Key32& k, uint64_t& h1, uint64_t& h2)
+		{
+			std::memcpy(&h1, (const uint8_t*)&k + 8, sizeof(h1));
+			std::memcpy(&h2, (const uint8_t*)&k + 16, sizeof(h2));
+		}
+
+		static uint64_t Word(const uint64_t& word)
+		{
+			return std::atomic_ref<uint64_t>(const_cast<uint64_t&>(word)).load(std::memory_order_relaxed);
+		}
+
+		Table* Top() const { return layers[depth.load(std::memory_order_acquire) - 1].load(std::memory_order_relaxed); }
+
+		void Push(std::unique_ptr<Table>&& t)
+		{
+			size_t n = depth;
+
+			tables.push_back(std::move(t));
+			layers[n].store(tables.back().get(), std::memory_order_relaxed);
+
+			keys = 0;
+			depth.store(n + 1, std::memory_order_release);
+		}
+
+		void Grow()
+		{
+			if (growing.exchange(true))
+				return;
+
+			if (depth < layers_t && keys.load() > Top()->Capacity())
+				Push(std::make_unique<Table>(Top()->blocks * 2));
+
+			growing = false;
+		}
+
+	public:
+
+		bool Enabled() const { return enabled; }
+
+		//Size for keys and clear, enables the filter. Not while other threads use it.
+		//
+
+		void Reset(uint64_t _keys, uint64_t minimum = minimum_t)
+		{
+			Disable();
+
+			_keys = std::max(_keys, minimum);
+
+			Push(std::make_unique<Table>((_keys * bits_per_key_t + words_t * 64 - 1) / (words_t * 64)));
+			enabled = true;
+		}
+
+		void Disable()
+		{
+			enabled = false;
+			depth = 0;
+			tables.clear();
+		}
+
+		void Add(const tdb::Key32& k)
+		{
+			if (!enabled)
+				return;
+
+			uint64_t h1, h2;
+			Hash(k, h1, h2);
+
+			auto block = Top()->Block(h1);
+			bool added = false;
+
+			for (size_t i = 0; i < hashes_t; i++, h2 >>= 9)
+			{
+				uint64_t bit = uint64_t(1) << (h2 & 63);
+
+				if (!(std::atomic_ref<uint64_t>(block[(h2 >> 6) & 7]).fetch_or(bit, std::memory_order_relaxed) & bit))
+					added = true;
+			}
+
+			if (added && keys.fetch_add(1, std::memory_order_relaxed) >= Top()->Capacity())
+				Grow();
+		}
+
+		void Prefetch(const tdb::Key32& k) const
+		{
+			if (!enabled)
+				return;
+
+			uint64_t h1, h2;
+			Hash(k, h1, h2);
+
+			for (size_t l = depth.load(std::memory_order_acquire); l--; )
+				prefetch(layers[l].load(std::memory_order_relaxed)->Block(h1));
+		}
+
+		//False only when the key was never added.
+		//
+
+		bool Maybe(const tdb::Key32& k) const
+		{
+			if (!enabled)
+				return true;
+
+			uint64_t h1, h2;
+			Hash(k, h1, h2);
+
+			for (size_t l = depth.load(std::memory_order_acquire); l--; )
+			{
+				auto block = layers[l].load(std::memory_order_relaxed)->Block(h1);
+				uint64_t h = h2;
+				size_t i = 0;
+
+				for (; i < hashes_t; i++, h >>= 9)
+					if (!(Word(block[(h >> 6) & 7]) & (uint64_t(1) << (h & 63))))
+						break;
+
+				if (i == hashes_t)
+					return true;
+			}
+
+			return false;
+		}
+
+		//Tables stacked so far.
+		//
+
+		size_t Depth() const { return depth; }
+
+		void Save(std::string_view path) const
+		{
+			if (!enabled)
+			{
+				std::filesystem::remove(path);
+				return;
+			}
+
+			std::string temp = std::string(path) + ".tmp";
+
+			//Left by a crash mid save, Open doesn't truncate:
+			//
+
+			std::filesystem::remove(temp);
+
+			{
+				io::File file(temp, true);
+				uint64_t offset = 0;
+
+				size_t n = depth;
+
+				uint64_t header[3] = { magic_t, n, keys };
+				offset += file.Write(offset, header, sizeof(header));
+
+				//Adds go on while it is written:
+				//
+
+				std::vector<uint64_t> chunk;
+
+				for (size_t l = 0; l < n; l++)
+				{
+					auto t = layers[l].load();
+
+					offset += file.Write(offset, &t->blocks, sizeof(t->blocks));
+
+					for (size_t w = 0; w < t->words.size(); w += chunk.size())
+					{
+						chunk.resize(std::min(t->words.size() - w, (size_t)64 * 1024));
+
+						for (size_t i = 0; i < chunk.size(); i++)
+							chunk[i] = Word(t->words[w + i]);
+
+						offset += file.Write(offset, chunk.data(), chunk.size() * sizeof(uint64_t));
+					}
+				}
+
+				file.Sync();
+			}
+
+			io::Replace(temp, path);
+		}
+
+		//Not while other threads use it.
+		//
+
+		bool Load(std::string_view path)
+		{
+			std::ifstream file(std::string(path), std::ios::binary);
+
+			uint64_t header[3] = {};
+
+			if (!file.read((char*)header, sizeof(header)) || header[0] != magic_t || !header[1] || header[1] > layers_t)
+				return false;
+
+			Disable();
+
+			for (size_t l = 0; l < header[1]; l++)
+			{
+				uint64_t blocks = 0;
+
+				if (!file.read((char*)&blocks, sizeof(blocks)) || !blocks)
+				{
+					Disable();
+					return false;
+				}
+
+				auto t = std::make_unique<Table>(blocks);
+
+				if (!file.read((char*)t->words.data(), t->words.size() * sizeof(uint64_t)))
+				{
+					Disable();
+					return false;
+				}
+
+				Push(std::move(t));
+			}
+
+			keys = header[2];
+			enabled = true;
+
+			return true;
+		}
+	};
+}
@@ -17,6 +17,13 @@
 #include <array>
 #include <future>
 #include <bitset>
+#include <mutex>
+#include <memory>
+#include <atomic>
+#include <charconv>
+
+#include "bitmap.hpp"
+#include "codec.hpp"
 
 #include "d8u/util.hpp"
 #include "d8u/string.hpp"
@@ -85,19 +92,31 @@ namespace volstore
 
                         case switch_t("/many"):
                         {
+                            //Up to bitmap::frame_t hex keys, as with POST:
+                            //
+
+                            if (!req.parameters.size() || req.parameters.size() > bitmap::frame_t)
+                                return c.Http400();
+
                             std::vector<uint8_t> bin;
+                            bin.reserve(req.parameters.size() * U);
 
                             for (auto& e : req.parameters)
                             {
                                 auto v = to_bin(e.second);
+
+                                if (v.size() != U)
+                                    return c.Http400();
+
                                 bin.insert(bin.end(), v.begin(), v.end());
                             }
 
-                            std::bitset<64> bitmap(store.Many<U>(bin));
-                            auto bitmap_string = bitmap.to_string();
+                            auto bits = store.ManyBitmap<U>(bin);
+                            std::string bitmap_string(req.parameters.size(), '0');
 
-                            std::reverse(bitmap_string.begin(), bitmap_string.end());
-                            bitmap_string.resize(req.parameters.size());
+                            for (size_t i = 0; i < bitmap_string.size() && i < bits.size() * 8; i++)
+                                if (bitmap::get(bits.data(), i))
+                                    bitmap_string[i] = '1';
 
                             return c.Response("200 OK", bitmap_string, std::string_view("Content-Type: text/plain\r\n"));
                         }
@@ -108,6 +127,30 @@ namespace volstore
 
                             return c.Response("200 OK", store.Read(to_bin(req.parameters.begin()->second)), std::string_view("Content-Type: application/octet-stream\r\n"));
                         }
+                        case switch_t("/stored"):
+                        {
+                            //id and the codec::accepted mask of the client as codecs, the body is codec::reply:
+                            //
+
+                            std::vector<uint8_t> id;
+                            uint8_t accept = 0;
+
+                            for (auto& e : req.parameters)
+                            {
+                                if (e.first == "id")
+                                {
+                                    auto v = to_bin(e.second);
+                                    id.assign(v.begin(), v.end());
+                                }
+                                else if (e.first == "codecs" && std::from_chars(e.second.data(), e.second.data() + e.second.size(), accept).ec != std::errc())
+                                    return c.Http400();
+                            }
+
+                            if (id.size() != U)
+                                return c.Http400();
+
+                            return c.Response("200 OK", codec::reply(store, id, accept), std::string_view("Content-Type: application/octet-stream\r\n"));
+                        }
                         }
 
                         break;
@@ -129,6 +172,32 @@ namespace volstore
 
                             return c.Http200();
                         }
+                        case switch_t("/many"):
+                        {
+                            //Body of up to bitmap::frame_t binary keys, replies with their bitmap:
+                            //
+
+                            if (!req.body.size() || req.body.size() % U || req.body.size() / U > bitmap::frame_t)
+                                return c.Http400();
+
+                            return c.Response("200 OK", store.ManyBitmap<U>(req.body), std::string_view("Content-Type: application/octet-stream\r\n"));
+                        }
+                        case switch_t("/delete"):
+                        {
+                            //Body of up to 64 binary keys, replies with a '0' or '1' per key:
+                            //
+
+                            if (!req.body.size() || req.body.size() % U || req.body.size() / U > 64)
+                                return c.Http400();
+
+                            std::bitset<64> bitmap(store.DeleteMany<U>(req.body));
+                            auto bitmap_string = bitmap.to_string();
+
+                            std::reverse(bitmap_string.begin(), bitmap_string.end());
+                            bitmap_string.resize(req.body.size() / U);
+
+                            return c.Response("200 OK", bitmap_string, std::string_view("Content-Type: text/plain\r\n"));
+                        }
                         }
                     }
 
@@ -160,6 +229,22 @@ namespace volstore
             return result;
         }
 
+        //The block as stored when this build decodes its codec, c names it, see codec::decompress. Otherwise the server
+        //decodes it and c is codec::none.
+        //
+
+        template <typename T> std::vector<uint8_t> ReadStored(const T& id, uint8_t& c)
+        {
+            auto res = client.GetWait(string("/stored?id=") + to_hex(id) + "&codecs=" + to_string(codec::accepted()));
+
+            if (res.body.size() <= 1)
+                throw std::runtime_error("Block Not Found");
+
+            c = (uint8_t)res.body[0];
+
+            return std::vector<uint8_t>((uint8_t*)res.body.data() + 1, (uint8_t*)res.body.data() + res.body.size());
+        }
+
         template <typename T, typename Y> void Write(const T& id, const Y& payload)
         {
             auto res = client.PostWait(string("/write?id=") + to_hex(id), payload, std::string_view("Content-Type: application/octet-stream\r\n"));
@@ -198,6 +283,51 @@ namespace volstore
 
             return result.to_ullong();
         }
+
+        //Existence of any number of keys as a bitmap, posted to /many in frames, see bitmap.hpp.
+        //
+
+        template <size_t U, typename T> std::vector<uint8_t> ManyBitmap(const T& ids)
+        {
+            auto limit = ids.size() / U;
+            std::vector<uint8_t> result(bitmap::bytes(limit));
+
+            bitmap::frames(limit, [&](size_t first, size_t count)
+            {
+                std::vector<uint8_t> frame((uint8_t*)ids.data() + first * U, (uint8_t*)ids.data() + (first + count) * U);
+
+                auto res = client.PostWait("/many", frame, std::string_view("Content-Type: application/octet-stream\r\n"));
+
+                if (res.status != 200 || res.body.size() != bitmap::bytes(count))
+                    throw runtime_error("Bad reply");
+
+                bitmap::merge_at(result, first, count, (const uint8_t*)res.body.data(), res.body.size());
+            });
+
+            return result;
+        }
+
+        template <size_t U, typename T> uint64_t DeleteMany(const T& ids)
+        {
+            auto limit = ids.size() / U;
+
+            if (limit > 64)
+                throw runtime_error("The max limit for DeleteMany is 64");
+
+            std::vector<uint8_t> keys((uint8_t*)ids.data(), (uint8_t*)ids.data() + limit * U);
+
+            auto res = client.PostWait("/delete", keys, std::string_view("Content-Type: application/octet-stream\r\n"));
+
+            std::string bits((res.body.size()) ? std::string((char*)res.body.data(), res.body.size()) : "");
+            std::reverse(bits.begin(), bits.end());
+
+            return std::bitset<64>(bits).to_ullong();
+        }
+
+        template <typename T> bool Delete(const T& id)
+        {
+            return DeleteMany<32>(id) & 1;
+        }
     };
 
     class HttpStoreEventClient
@@ -268,6 +398,74 @@ namespace volstore
                 f(result.to_ullong());
             }, q);
         }
+
+        //Existence of any number of keys, f(bitmap) runs once the last frame has been answered. See bitmap.hpp.
+        //
+
+        template <size_t U, typename T, typename F> void ManyBitmap(const T& ids, F f)
+        {
+            struct State
+            {
+                std::vector<uint8_t> result;
+                std::atomic<size_t> pending = 0;
+                std::mutex lock;
+                F f;
+
+                State(F&& _f) : f(std::move(_f)) { }
+            };
+
+            auto limit = ids.size() / U;
+            auto state = std::make_shared<State>(std::move(f));
+
+            state->result.resize(bitmap::bytes(limit));
+
+            if (!limit)
+                return state->f(std::move(state->result));
+
+            state->pending = (limit + bitmap::frame_t - 1) / bitmap::frame_t;
+
+            bitmap::frames(limit, [&](size_t first, size_t count)
+            {
+                std::vector<uint8_t> frame((uint8_t*)ids.data() + first * U, (uint8_t*)ids.data() + (first + count) * U);
+
+                client.PostCallback([state, first, count](auto res)
+                {
+                    {
+                        std::lock_guard<std::mutex> lck(state->lock);
+                        bitmap::merge_at(state->result, first, count, (const uint8_t*)res.body.data(), res.body.size());
+                    }
+
+                    if (--state->pending == 0)
+                        state->f(std::move(state->result));
+                }, "/many", frame, std::string_view("Content-Type: application/octet-stream\r\n"));
+            });
+        }
+
+        template <size_t U, typename T, typename F> void DeleteMany(const T& ids, F f)
+        {
+            auto limit = ids.size() / U;
+
+            if (limit > 64)
+                throw runtime_error("The max limit for DeleteMany is 64");
+
+            std::vector<uint8_t> keys((uint8_t*)ids.data(), (uint8_t*)ids.data() + limit * U);
+
+            client.PostCallback([f = std::move(f)](auto res)
+            {
+                std::string bits((res.body.size()) ? std::string((char*)res.body.data(), res.body.size()) : "");
+                std::reverse(bits.begin(), bits.end());
+
+                f(std::bitset<64>(bits).to_ullong());
+            }, "/delete", keys, std::string_view("Content-Type: application/octet-stream\r\n"));
+        }
+
+        template <typename T, typename F> void Delete(const T& id, F f)
+        {
+            DeleteMany<32>(id, [f = std::move(f)](uint64_t res)
+            {
+                f((res & 1) != 0);
+            });
+        }
     };
 
     class SimpleHttpStoreClient
@@ -338,6 +536,55 @@ namespace volstore
 
             return result.to_ullong();
         }
+
+        //Existence of any number of keys as a bitmap, posted to /many in frames, see bitmap.hpp.
+        //
+
+        template <size_t U, typename T> std::vector<uint8_t> ManyBitmap(const T& ids) const
+        {
+            auto limit = ids.size() / U;
+            std::vector<uint8_t> result(bitmap::bytes(limit));
+
+            HttpConnection client(addr);
+
+            bitmap::frames(limit, [&](size_t first, size_t count)
+            {
+                std::vector<uint8_t> frame((uint8_t*)ids.data() + first * U, (uint8_t*)ids.data() + (first + count) * U);
+
+                auto res = client.Post("/many", frame, std::string_view("Content-Type: application/octet-stream\r\n"));
+
+                if (res.status != 200 || res.body.size() != bitmap::bytes(count))
+                    throw runtime_error("Bad reply");
+
+                bitmap::merge_at(result, first, count, (const uint8_t*)res.body.data(), res.body.size());
+            });
+
+            return result;
+        }
+
+        template <size_t U, typename T> uint64_t DeleteMany(const T& ids) const
+        {
+            auto limit = ids.size() / U;
+
+            if (limit > 64)
+                throw runtime_error("The max limit for DeleteMany is 64");
+
+            std::vector<uint8_t> keys((uint8_t*)ids.data(), (uint8_t*)ids.data() + limit * U);
+
+            HttpConnection client(addr);
+
+            auto res = client.Post("/delete", keys, std::string_view("Content-Type: application/octet-stream\r\n"));
+
+            std::string bits((res.body.size()) ? std::string((char*)res.body.data(), res.body.size()) : "");
+            std::reverse(bits.begin(), bits.end());
+
+            return std::bitset<64>(bits).to_ullong();
+        }
+
+        template <typename T> bool Delete(const T& id) const
+        {
+            return DeleteMany<32>(id) & 1;
+        }
     };
 
 	template <typename STORE, size_t U = 32, size_t M = 1024 * 1024> class _DeprecatedHTTPServer
@@ -9,8 +9,28 @@
 #include <bitset>
 #include <atomic>
 #include <thread>
+#include <memory>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <shared_mutex>
+#include <limits>
 
 #include "../mio.hpp"
+#include "io.hpp"
+#include "location.hpp"
+#include "space.hpp"
+#include "record.hpp"
+#include "repair.hpp"
+#include "scrub.hpp"
+#include "stats.hpp"
+#include "journal.hpp"
+#include "index.hpp"
+#include "filter.hpp"
+#include "lsm.hpp"
+#include "bitmap.hpp"
+#include "cache.hpp"
+#include "slab.hpp"
 
 #include "tdb/legacy.hpp"
 #include "d8u/util.hpp"
@@ -22,28 +42,431 @@ namespace volstore
 	using namespace std;
 	using namespace gsl;
 
-	template < typename TH > class Image
+	/*
+		Flatten (compaction) support shared by the engines.
+
+		Segment 0 is image.dat, Flatten copies the live blocks of the active segment into the other of segments 1 and 2,
+		swapping each index entry with a compare exchange, then deletes the old segment. flatten.db records the target
+		segment while a flatten is in progress so an interrupted run resumes on the next start.
+	*/
+
+	namespace flatten
+	{
+		static uint64_t constexpr segments_t = 3;
+
+		inline std::string marker(std::string_view root)
+		{
+			return std::string(root) + "/flatten.db";
+		}
+
+		inline bool pending(std::string_view root)
+		{
+			return std::filesystem::exists(marker(root));
+		}
+
+		inline uint64_t target(std::string_view root)
+		{
+			uint64_t segment = 0;
+			std::ifstream(marker(root), ios::binary).read((char*)&segment, sizeof(uint64_t));
+
+			return segment;
+		}
+
+		inline void begin(std::string_view root, uint64_t segment)
+		{
+			std::ofstream(marker(root), ios::binary).write((const char*)&segment, sizeof(uint64_t));
+		}
+
+		inline void end(std::string_view root)
+		{
+			std::filesystem::remove(marker(root));
+		}
+
+		//The segment new blocks go to after a restart.
+		//
+
+		inline uint64_t active(std::string_view root)
+		{
+			if (pending(root))
+				return target(root);
+
+			for (uint64_t s = segments_t - 1; s > 0; s--)
+				if (std::filesystem::exists(location::path(root, s)))
+					return s;
+
+			return 0;
+		}
+
+		inline uint64_t next(uint64_t segment)
+		{
+			return (segment == 1) ? 2 : 1;
+		}
+
+		//Readers may still hold a location from before the swap, give them time before the old segment goes away.
+		//
+
+		inline bool grace(const bool& running, size_t seconds = 10)
+		{
+			for (size_t i = 0; i < seconds && running; i++)
+				std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+
+			return running;
+		}
+	}
+
+	/*
+		The index is flushed at journal checkpoints, when the journal passes journal_t bytes or every checkpoint_t seconds.
+	*/
+
+	namespace checkpoint
+	{
+		static uint64_t constexpr journal_t = 64 * 1024 * 1024;
+		static size_t constexpr seconds_t = 300;
+
+		inline bool due(Journal& journal, size_t counter)
+		{
+			return counter % seconds_t == 0 || journal.Size() > journal_t;
+		}
+	}
+
+	template < typename TH, typename INDEX = tdb::LargeHashmapSafe > class Image
 	{
 		static uint64_t constexpr book_t = 256 * 1024 * 1024;
-		tdb::LargeHashmapSafe db;
-		tdb::_MapList<book_t, 0> dat;
+		using segment_t = tdb::_MapList<book_t, 0>;
 
-		d8u::util::Statistics stats;
+		INDEX db;
+
+		//Published atomically, whoever loads a segment keeps it mapped for as long as it holds the pointer. Writes hold
+		//segment_lock shared from picking the active segment until the record is sealed, Flatten takes it exclusively
+		//after the switch so every write into the old segment has landed before it is copied.
+		//
+		std::atomic<std::shared_ptr<segment_t>> dat[flatten::segments_t];
+		std::atomic<uint64_t> active = 0;
+		std::shared_mutex segment_lock;
+
+		Statistics stats;
+
+		std::atomic<bool> flatten_request = false;
+		std::atomic<bool> flattening = false;
+		std::atomic<size_t> flatten_rate = 32 * 1024 * 1024;
+		std::atomic<size_t> flatten_threshold = 50;
+		std::thread flatten_thread;
+
+		DeadSpace dead;
+		Journal journal;
+		BloomFilter filter;
 
 		bool running = true;
 		std::thread manager_thread;
 
 		std::string root;
 
+		//Returns how many entries were moved or dropped, damaged counts those left in place because their record is unreadable.
+		//
+
+		size_t FlattenPass(uint64_t from, uint64_t to, io::Throttle& throttle, size_t& damaged)
+		{
+			size_t count = 0;
+			auto source = dat[from].load();
+			auto target = dat[to].load();
+
+			damaged = 0;
+
+			db.Table().Iterate([&](auto& v)
+			{
+				std::atomic_ref<std::remove_reference_t<decltype(v)>> slot(v);
+				uint64_t current = slot.load();
+
+				if (!current || location::segment(current) != from)
+					return running;
+
+				//Deleted, the entry goes away with the segment:
+				//
+
+				if (current & location::tombstone)
+				{
+					count++;
+					slot.compare_exchange_strong(current, 0);
+
+					return running;
+				}
+
+				auto block = source->offset(location::offset(current));
+
+				if (!block || !record::length(block) && record::legacy(block) || record::length(block) > record::max_block_t)
+				{
+					damaged++;
+					return running; //Left to scrub and repair, the segment is kept.
+				}
+
+				count++;
+
+				//Records are copied verbatim, legacy ones keep their format:
+				//
+
+				auto size = record::total(block);
+				auto [p, o] = target->Allocate(size);
+
+				if (!p)
+					throw std::runtime_error("Flatten failed to allocate");
+
+				std::copy(block, block + size, p);
+				slot.compare_exchange_strong(current, location::make(to, o));
+
+				throttle(size);
+
+				return running;
+			});
+
+			return count;
+		}
+
+		void _Flatten()
+		{
+			uint64_t to = active, from = 0;
+
+			if (flatten::pending(root))
+			{
+				while (from < flatten::segments_t && (from == to || !dat[from].load()))
+					from++;
+
+				if (from == flatten::segments_t)
+					return flatten::end(root);
+			}
+			else
+			{
+				from = to;
+				to = flatten::next(from);
+
+				//A segment kept by an earlier Flatten is still open:
+				//
+
+				if (!dat[to].load())
+					dat[to] = std::make_shared<segment_t>(location::path(root, to));
+
+				flatten::begin(root, to);
+				active = to;
+			}
+
+			//Writes that picked up the old segment before the switch have landed once the lock is had:
+			//
+
+			{
+				std::unique_lock<std::shared_mutex> lck(segment_lock);
+			}
+
+			io::Throttle throttle(flatten_rate);
+			size_t damaged = 0;
+
+			while (running && FlattenPass(from, to, throttle, damaged)) {}
+
+			if (!running)
+				return; //Resumes on the next start.
+
+			dat[to].load()->Flush();
+			db.Flush();
+
+			if (damaged)
+			{
+				std::cout << "Flatten: " << damaged << " unreadable blocks left in segment " << from << ", kept for scrub and repair" << std::endl;
+				return flatten::end(root);
+			}
+
+			//Lookups from before the swap get time to finish, then the segment is unmapped once the last Mapping of it
+			//is dropped:
+			//
+
+			if (!flatten::grace(running))
+				return;
+
+			auto retired = dat[from].exchange(nullptr);
+
+			while (running && retired.use_count() > 1)
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+			if (!running)
+				return; //Resumes on the next start, the segment holds no more entries.
+
+			retired.reset();
+			std::filesystem::remove(location::path(root, from));
+
+			dead.Clear(from);
+			dead.Flush();
+
+			flatten::end(root);
+		}
+
+		std::pair<gsl::span<uint8_t>, uint64_t> _Allocate(const tdb::Key32& id, size_t size)
+		{
+			stats.atomic.blocks++;
+			stats.atomic.write += size;
+
+			//Race condition:
+			//A block request happening around the same time will report zero as the offset.
+			//Up until the line below: "*res.first = o;"
+			//This has been resolved by reporting a miss for all uninitialized pointers.
+
+			filter.Add(id);
+
+			auto res = db.InsertLock(id, uint64_t(0));
+
+			//Duplicate block insert? Abort.
+			//This happens usually when the client isn't using a local block filter.
+			//
+
+			if (res.second && location::live(std::atomic_ref<uint64_t>(*res.first).load())) 
+				return std::make_pair(gsl::span<uint8_t>(), 0);
+
+			auto scope = journal.Scope();
+
+			//This code will align blocks to the page at the cost of packing. Not needed.
+			//auto [p, o] = dat.AllocateAlign(size + sizeof(record::Header));
+			//
+
+			uint64_t s = active;
+			auto [p, o] = dat[s].load()->Allocate(size + sizeof(record::Header));
+
+			if(!p) 
+				return std::make_pair(gsl::span<uint8_t>(), 0);
+
+			//The payload is filled in by the caller, Write seals the record once it has.
+			//
+
+			auto header = record::make(&id, (uint32_t)size, record::unsealed);
+			std::memcpy(p, &header, sizeof(record::Header));
+
+			uint64_t v = location::make(s, o);
+
+			std::atomic_ref<uint64_t>(*res.first).store(v);
+			journal.Append(&id, v);
+
+			return std::make_pair(gsl::span<uint8_t>(p + sizeof(record::Header), size), s);
+		}
+
+		//Payload of the record at block, checked against its CRC when the record carries one.
+		//
+
+		static gsl::span<uint8_t> Payload(uint8_t* block)
+		{
+			auto payload = block + record::header_size(block);
+
+			if (!record::legacy(block) && !record::verify(*((record::Header*)block), payload))
+				throw std::runtime_error("Block checksum mismatch");
+
+			return gsl::span<uint8_t>(payload, record::length(block));
+		}
+
+		//The record at v is in the mapped segment, carries key and passes its checksum. Entries are logged before the
+		//payload is copied and the mapping is flushed on its own, a journal entry can outlive the record after a crash.
+		//
+
+		bool Durable(const tdb::Key32& key, uint64_t v)
+		{
+			uint64_t s = location::segment(v), o = location::offset(v);
+			auto d = (s < flatten::segments_t) ? dat[s].load() : nullptr;
+
+			if (!d)
+				return false;
+
+			auto block = d->offset(o);
+
+			if (!block || o + record::legacy_t > d->size() || record::length(block) > record::max_block_t || o + record::total(block) > d->size())
+				return false;
+
+			if (record::legacy(block))
+				return record::length(block) != 0;
+
+			auto& header = *((record::Header*)block);
+
+			return record::verify(header, block + sizeof(record::Header)) && !std::memcmp(header.key, &key, sizeof(header.key));
+		}
+
+		//filter.db is saved with the index, the journal replay on open adds whatever came after.
+		//
+
+		void Checkpoint()
+		{
+			journal.Checkpoint([&]()
+			{
+				db.Flush();
+				filter.Save(root + "/filter.db");
+			});
+		}
+
+		//Indexes that can list their keys rebuild the filter sized to them, others load filter.db. Without either it stays off.
+		//
+
+		void LoadFilter()
+		{
+			if constexpr (KeyedIndex<INDEX>)
+			{
+				uint64_t keys = 0;
+				db.IterateKeys([&](const tdb::Key32&, uint64_t&) { keys++; return true; });
+
+				filter.Reset(keys);
+				db.IterateKeys([&](const tdb::Key32& k, uint64_t&) { filter.Add(k); return true; });
+			}
+			else if (!filter.Load(root + "/filter.db"))
+			{
+				bool empty = true;
+				db.Table().Iterate([&](auto&) { empty = false; return false; });
+
+				if (empty)
+					filter.Reset(0);
+				else
+					std::cout << "Negative lookup filter disabled, filter.db is missing" << std::endl;
+			}
+		}
+
 	public:
 
-		d8u::util::Statistics* Stats() { return &stats; }
+		//Span into a segment mapping that keeps the segment mapped while it's held. Flatten unmaps a retired segment
+		//once the last one is dropped, the network layer holds it until the reply or the socket read is done.
+		//
+		struct Mapping : gsl::span<uint8_t>
+		{
+			std::shared_ptr<segment_t> segment;
+		};
+
+		Statistics* Stats() { return &stats; }
 
 		Image(string_view _root)
 			: db(string(_root) + "/index.db")
-			, dat(string(_root) + "/image.dat")
+			, active(flatten::active(_root))
+			, dead(string(_root) + "/dead.db")
+			, journal(_root)
 			, root(_root)
-			, manager_thread([&]()
+		{
+			if (std::filesystem::exists(string(_root) + "/lock.db"))
+				throw std::runtime_error("Image is locked, is a backup running? Did a backup fail to complete gracefully? If the second is true please delete the lock file.");
+
+			d8u::util::empty_file(string(_root) + "/lock.db");
+
+			//A failed open gives the lock back, the journal is only checkpointed once it has been replayed:
+			//
+
+			try
+			{
+				for (uint64_t s = 0; s < flatten::segments_t; s++)
+					if (s == active || std::filesystem::exists(location::path(root, s)))
+						dat[s] = std::make_shared<segment_t>(location::path(root, s));
+
+				flatten_request = flatten::pending(root);
+
+				LoadFilter();
+				Replay();
+			}
+			catch (...)
+			{
+				std::filesystem::remove(string(root) + "/lock.db");
+
+				throw;
+			}
+
+			//Background work starts once the index is consistent:
+			//
+
+			manager_thread = std::thread([&]()
 			{
 				size_t counter = 0;
 				while (running)
@@ -52,20 +475,34 @@ namespace volstore
 
 					if (counter++ % 10 == 0)
 					{
-						db.Flush();
-						dat.Flush();
+						dead.Flush();
+
+						for (auto& d : dat)
+							if (auto segment = d.load()) segment->Flush();
+
+						if (checkpoint::due(journal, counter - 1))
+							Checkpoint();
+
+						if (flatten_threshold && !flattening && dead.Segment(active) > dat[active].load()->size() / 100 * flatten_threshold)
+							flatten_request = true;
 					}
 
-					/*
-						Todo Flatten
-					*/
-				}
-			}) 
-		{ 
-			if (std::filesystem::exists(string(_root) + "/lock.db"))
-				throw std::runtime_error("Image is locked, is a backup running? Did a backup fail to complete gracefully? If the second is true please delete the lock file.");
+					if (flatten_request && !flattening)
+					{
+						if (flatten_thread.joinable())
+							flatten_thread.join();
 
-			d8u::util::empty_file(string(_root) + "/lock.db");
+						flatten_request = false;
+						flattening = true;
+
+						flatten_thread = std::thread([&]()
+						{
+							_Flatten();
+							flattening = false;
+						});
+					}
+				}
+			});
 		}
 
 		~Image()
@@ -73,14 +510,71 @@ namespace volstore
 			running = false;
 			manager_thread.join();
 
+			if (flatten_thread.joinable())
+				flatten_thread.join();
+
+			for (auto& d : dat)
+				if (auto segment = d.load()) segment->Flush();
+
+			Checkpoint();
+
 			std::filesystem::remove(string(root) + "/lock.db");
 		}
 
+		//Background compaction, live blocks are copied into a new segment at no more than FlattenRate bytes per second.
+		//
+
+		void Flatten() { flatten_request = true; }
+
+		void FlattenRate(size_t bytes_per_second) { flatten_rate = bytes_per_second; }
+
+		//Percentage of the active segment that must be dead before Flatten starts on its own, zero disables.
+		//
+
+		void FlattenThreshold(size_t percent) { flatten_threshold = percent; }
+
+		DeadSpace& Dead() { return dead; }
+
+		bool Flattening() { return flatten_request || flattening; }
+
+		//Restores the index changes logged since the last checkpoint, runs on open.
+		//
+
+		size_t Replay()
+		{
+			auto count = journal.Replay(db, active, [&](const tdb::Key32& k, uint64_t v) { return Durable(k, v); }, [&](const tdb::Key32& k) { filter.Add(k); });
+
+			if (count)
+				std::cout << "Journal entries replayed: " << count << std::endl;
+
+			Checkpoint();
+
+			return count;
+		}
+
+		//Recovers index entries from the records in the segment files, for an index.db that was lost or damaged.
+		//
+
+		size_t Rebuild()
+		{
+			for (auto& d : dat)
+				if (auto segment = d.load()) segment->Flush();
+
+			auto count = record::rebuild(db, root, flatten::segments_t, active, [&](const tdb::Key32& k) { filter.Add(k); });
+
+			if constexpr (KeyedIndex<INDEX>)
+				LoadFilter(); //Resized to the recovered keys.
+
+			std::cout << "Rebuilt index entries: " << count << std::endl;
+
+			return count;
+		}
+
 		template <typename T> bool ValidateStandard(const T& id)
 		{
 			auto block = Map(id);
 
-			return d8u::transform::validate_block<T>(block);
+			return d8u::transform::validate_block<T>(gsl::span<uint8_t>(block));
 		}
 
 		template <typename T, typename V> bool Validate(const T& id, V v)
@@ -90,34 +584,48 @@ namespace volstore
 			return v(block);
 		}
 
-		template <typename T> gsl::span<uint8_t> Map(const T& id)
+		template <typename T> Mapping Map(const T& id)
 		{
 			auto addr = db.FindLock(*((tdb::Key32*) id.data()));
 
-			if (!addr) return gsl::span<uint8_t>();
+			uint64_t v = (addr) ? std::atomic_ref<uint64_t>(*addr).load(std::memory_order_acquire) : 0;
+
+			if (!location::live(v)) return Mapping();
+
+			//Gone when a Flatten retired the segment after the lookup, the block has moved on:
+			//
+
+			auto d = dat[location::segment(v)].load();
 
-			auto block = dat.offset(*addr);
+			if (!d) return Mapping();
 
-			if (!block) return gsl::span<uint8_t>();
+			auto block = d->offset(location::offset(v));
 
-			auto size = *((uint32_t*)block);
+			if (!block) return Mapping();
+
+			auto payload = Payload(block);
 
 			stats.atomic.items++;
-			stats.atomic.read += size;
+			stats.atomic.read += payload.size();
 
-			return gsl::span<uint8_t>(block + sizeof(uint32_t), size);
+			return Mapping { payload, std::move(d) };
 		}
 
+		//Walks the active segment. After a Flatten completes that segment holds every block.
+		//
+
 		template <typename F> uint64_t EnumerateMap(uint64_t start, F&& f)
 		{
 			bool _continue = true;
+			auto segment = this->dat[active].load();
+			auto& dat = *segment;
 
 			while (_continue && start < dat.size())
 			{
 				auto block = dat.offset(start);
-				auto size = *((uint32_t*)block);
+				auto size = record::length(block);
 
-				if (!size)
+				if (!size && record::legacy(block))
 				{
 					//Alignment Gap: Jump to next book
 					//
@@ -126,189 +634,1316 @@ namespace volstore
 					continue;
 				}
 
-				_continue = f(gsl::span<uint8_t>(block + sizeof(uint32_t), size));
+				if (record::legacy(block) || !(((record::Header*)block)->flags & record::deleted))
+					_continue = f(gsl::span<uint8_t>(block + record::header_size(block), size));
+
+				start += record::total(block);
+			}
+
+			return start;
+		}
+
+		template <typename F> uint64_t Enumerate(uint64_t start, F&& f)
+		{
+			return EnumerateMap(start, [f = std::move(f)](auto map)
+			{
+				d8u::sse_vector result(map.size());
+
+				std::copy(map.begin(), map.end(), result.begin());
+
+				return f(result);
+			});
+		}
+
+		template <typename T> d8u::sse_vector Read(const T& id)
+		{
+			auto map = Map(id);
+
+			d8u::sse_vector result(map.size());
+
+			std::copy(map.begin(), map.end(), result.begin());
+
+			return result;
+		}
+
+		template <typename T> Mapping Allocate(const T& id, size_t size)
+		{
+			std::shared_lock<std::shared_mutex> lck(segment_lock);
+
+			auto [block, s] = _Allocate(*((tdb::Key32*) id.data()), size);
+
+			if (!block.data())
+				return Mapping();
+
+			return Mapping { block, dat[s].load() };
+		}
+
+		template <typename T, typename Y> void Write(const T& id, const Y& payload)
+		{
+			std::shared_lock<std::shared_mutex> lck(segment_lock);
+
+			auto [block, s] = _Allocate(*((tdb::Key32*) id.data()), payload.size());
+
+			if (!block.data())
+				return; //Todo notification, however this never causes problems.
+
+			std::copy(payload.begin(), payload.end(), block.begin());
+
+			auto header = block.data() - sizeof(record::Header);
+			record::seal(*((record::Header*)header), block.data());
+
+			dat[s].load()->Flush2(header, block.size() + sizeof(record::Header));
+		}
+
+		template <typename T> bool Is(const T& id)
+		{
+			stats.atomic.queries++;
+
+			auto& key = *((tdb::Key32*) id.data());
+
+			if (!filter.Maybe(key))
+			{
+				stats.filter.negatives++;
+				return false;
+			}
+
+			return location::live_slot(db.FindLock(key));
+		}
+
+		template <size_t U, typename T> uint64_t Many(const T& ids)
+		{
+			std::bitset<64> result;
+
+			auto limit = ids.size() / U;
+
+			stats.atomic.queries += limit;
+
+			if (limit > 64)
+				throw runtime_error("The max limit for Many is 64");
+
+			uint64_t* found[64];
+			stats.filter.negatives += FindMany(db, filter, (const tdb::Key32*)ids.data(), limit, found);
+
+			for (size_t i = 0; i < limit; i++)
+				result.set(i, location::live_slot(found[i]));
+
+			return result.to_ullong();
+		}
+
+		//Existence of any number of keys as a bitmap, see bitmap.hpp.
+		//
+
+		template <size_t U, typename T> std::vector<uint8_t> ManyBitmap(const T& ids)
+		{
+			auto limit = ids.size() / U;
+
+			stats.atomic.queries += limit;
+
+			std::vector<uint8_t> result(bitmap::bytes(limit));
+			std::vector<uint64_t*> found(std::min(limit, bitmap::frame_t));
+
+			bitmap::frames(limit, [&](size_t first, size_t count)
+			{
+				stats.filter.negatives += FindMany(db, filter, (const tdb::Key32*)ids.data() + first, count, found.data());
+
+				for (size_t i = 0; i < count; i++)
+					if (location::live_slot(found[i]))
+						bitmap::set(result.data(), first + i);
+			});
+
+			return result;
+		}
+
+		//Marks the entry as a tombstone, the space is reclaimed by the next Flatten.
+		//
+
+		template <typename T> bool Delete(const T& id)
+		{
+			auto addr = db.FindLock(*((tdb::Key32*) id.data()));
+
+			if (!addr)
+				return false;
+
+			std::shared_lock<std::shared_mutex> lck(segment_lock);
+			auto scope = journal.Scope();
+
+			std::atomic_ref<uint64_t> slot(*addr);
+			uint64_t current = slot.load();
+
+			if (!location::live(current) || !slot.compare_exchange_strong(current, current | location::tombstone))
+				return false;
+
+			journal.Append(id.data(), current | location::tombstone);
+
+			auto d = dat[location::segment(current)].load();
+			auto block = (d) ? d->offset(location::offset(current)) : nullptr;
+
+			dead.Add(current, (block) ? record::total(block) : record::legacy_t);
+
+			//The tombstone record lets an index rebuilt from the data file see the delete:
+			//
+
+			uint64_t s = active;
+			auto [p, o] = dat[s].load()->Allocate(sizeof(record::Header));
+
+			if (p)
+			{
+				auto t = record::tombstone(id);
+				std::copy(t.begin(), t.end(), p);
+
+				dead.Add(location::make(s, o), t.size());
+			}
+
+			return true;
+		}
+
+		template <size_t U, typename T> uint64_t DeleteMany(const T& ids)
+		{
+			std::bitset<64> result;
+
+			auto limit = ids.size() / U;
+
+			if (limit > 64)
+				throw runtime_error("The max limit for DeleteMany is 64");
+
+			for (size_t i = 0; i < limit; i++)
+				result.set(i, Delete(gsl::span<uint8_t>((uint8_t*)ids.data() + U * i, U)));
+
+			return result.to_ullong();
+		}
+	};
+
+	template < typename TH, typename INDEX = tdb::LargeHashmapSafe > class Image2
+	{
+		static uint64_t constexpr book_t = 256 * 1024 * 1024;
+
+		//Speculative read size, header and payload of small blocks arrive together in one page.
+		//
+		static size_t constexpr read_hint_t = 4096 - sizeof(record::Header);
+
+		//Write tickets carry the segment of the writer that issued them.
+		//
+		static uint64_t constexpr ticket_bits = 64 - location::segment_bits;
+
+		//Default size at which the active segment is sealed and new blocks move on to a new one.
+		//
+		static uint64_t constexpr segment_t = 4ull * 1024 * 1024 * 1024;
+
+		//Default seconds between tiering sweeps.
+		//
+		static size_t constexpr tier_age_t = 24 * 60 * 60;
+
+		//Most the scrubber reads at once, a larger budget takes several windows.
+		//
+		static size_t constexpr scrub_window_t = 4 * 1024 * 1024;
+
+		INDEX db;
+
+		Statistics stats;
+
+		std::string root;
+
+		bool durable_writes;
+		bool direct_io;
+
+		//Data directories, one per drive. Each segment file lives on one of them and each has an active segment of its own.
+		//Devices [0, fast) are the fast tier new blocks go to, the rest the capacity tier.
+		//
+		std::vector<std::string> devices;
+		size_t fast;
+		std::vector<uint8_t> device;
+
+		//Published atomically, whoever loads a segment keeps it alive for as long as it holds the pointer. Appends hold
+		//segment_lock shared from picking the active segment until the index points at the record, Open and Retire take it
+		//exclusively, so a writer is only dropped once no append can still reach it.
+		//
+		std::vector<std::atomic<std::shared_ptr<io::GroupWriter>>> wfile;
+		std::vector<std::atomic<std::shared_ptr<io::ReadPool<>>>> rfile;
+		std::unique_ptr<std::atomic<uint64_t>[]> active;
+		std::atomic<uint64_t> last = 0;
+
+		std::atomic<uint64_t> segment_size = segment_t;
+		std::atomic<size_t> tier_age = tier_age_t;
+		std::shared_mutex segment_lock;
+
+		std::atomic<bool> flatten_request = false;
+		std::atomic<bool> flattening = false;
+		std::atomic<size_t> flatten_rate = 32 * 1024 * 1024;
+		std::atomic<size_t> flatten_threshold = 50;
+		std::thread flatten_thread;
+
+		DeadSpace dead;
+		Journal journal;
+		BloomFilter filter;
+		BlockCache<d8u::sse_vector> cache;
+		Slab slab;
+		std::atomic<uint8_t> compression = codec::none;
+
+		std::atomic<size_t> scrub_rate = 0;
+		scrub::Cursor scrub_cursor;
+		std::vector<uint64_t> scrub_horizon;
+
+		bool running = true;
+		std::thread manager_thread;
+
+		static std::vector<std::string> Devices(const std::vector<std::string>& devices, const std::vector<std::string>& cold)
+		{
+			if (devices.empty() || devices.size() + cold.size() > std::numeric_limits<uint8_t>::max() + 1)
+				throw std::runtime_error("Image2 takes 1 to 256 data directories");
+
+			auto result = devices;
+			result.insert(result.end(), cold.begin(), cold.end());
+
+			return result;
+		}
+
+		bool Tiered() const { return fast < devices.size(); }
+
+		bool Cold(uint64_t segment) const { return device[segment] >= fast; }
+
+		std::string Path(uint64_t segment)
+		{
+			return location::path(devices[device[segment]], segment);
+		}
+
+		//Blocks are striped by key within a tier: every record of a key in it lands on the same device, so segment order
+		//still tells the newest. Legacy records carry no key and go to the first device.
+		//
+
+		size_t Stripe(const void* key, bool cold = false)
+		{
+			size_t first = (cold) ? fast : 0;
+			size_t count = (cold) ? devices.size() - fast : fast;
+
+			uint64_t h = 0;
+
+			if (key)
+				std::memcpy(&h, (const uint8_t*)key + 24, sizeof(h));
+
+			return first + h % count;
+		}
+
+		bool Active(uint64_t segment)
+		{
+			for (size_t d = 0; d < devices.size(); d++)
+				if (active[d] == segment)
+					return true;
+
+			return false;
+		}
+
+		//write: false for a sealed segment, it is only read until flatten empties it.
+		//
+
+		void Open(uint64_t segment, size_t d, bool write = true)
+		{
+			std::unique_lock<std::shared_mutex> lck(segment_lock);
+
+			device[segment] = (uint8_t)d;
+
+			//No record is ever placed at offset zero of a new segment, zero is the unwritten index value.
+			//
+
+			if (write)
+				wfile[segment] = std::make_shared<io::GroupWriter>(Path(segment), sizeof(uint64_t), direct_io);
+
+			rfile[segment] = std::make_shared<io::ReadPool<>>(Path(segment), direct_io);
+			last = std::max(last.load(), segment);
+		}
+
+		//Seals the active segment of device d, its new blocks go to a fresh one. Manager thread only.
+		//force: even when nothing was written to it yet.
+		//
+
+		void Roll(size_t d, bool force = false)
+		{
+			uint64_t from = active[d];
+
+			if (!force && wfile[from].load()->Tail() <= io::GroupWriter::First(sizeof(uint64_t), direct_io))
+				return; //Nothing in it yet.
+
+			if (last == location::segment_mask)
+			{
+				if (segment_size)
+					std::cout << "Segment numbers exhausted, the active segment keeps growing" << std::endl;
+
+				segment_size = 0;
+				return;
+			}
+
+			uint64_t to = last + 1;
+			Open(to, d);
+
+			//Whatever the fast tier writes from now on must be newer than the copies the capacity tier takes, so
+			//replay and rebuild see a delete or rewrite win over a block moved before it. Fast devices move past it first:
+			//
+
+			if (Cold(to))
+				for (size_t f = 0; f < fast; f++)
+					Roll(f, true);
+
+			active[d] = to;
+
+			Retire(from);
+		}
+
+		//Syncs and drops the writer of a segment that was just sealed. Appends that picked it before the switch are waited
+		//out on segment_lock, the records they queued are in the file before readers stop looking in the writer.
+		//A writer that failed is kept so Wait and Sync go on reporting it.
+		//
+
+		void Retire(uint64_t s)
+		{
+			{
+				std::unique_lock<std::shared_mutex> lck(segment_lock);
+			}
+
+			if (auto writer = wfile[s].load())
+			{
+				try
+				{
+					writer->Sync();
+				}
+				catch (std::exception& e)
+				{
+					std::cout << "Segment " << s << " failed to write: " << e.what() << std::endl;
+					return;
+				}
+			}
+
+			wfile[s].store(nullptr);
+		}
+
+		bool Sealed(uint64_t s)
+		{
+			return !Active(s) && rfile[s].load();
+		}
+
+		//More of the segment is dead than FlattenThreshold allows.
+		//
+
+		bool Worth(uint64_t s)
+		{
+			auto writer = wfile[s].load();
+			auto pool = rfile[s].load();
+
+			if (!flatten_threshold || !pool)
+				return false;
+
+			uint64_t size = (writer) ? writer->Tail() : pool->Get().Size();
+
+			if (size <= io::GroupWriter::First(sizeof(uint64_t), direct_io))
+				return !Active(s); //Sealed empty by a forced Roll.
+
+			return dead.Segment(s) > size / 100 * flatten_threshold;
+		}
+
+		std::shared_ptr<const d8u::sse_vector> Cached(const tdb::Key32& key, uint64_t v)
+		{
+			if (!cache.Enabled())
+				return nullptr;
+
+			auto hit = cache.Find(key, v);
+
+			if (!hit)
+			{
+				stats.cache.misses++;
+				return nullptr;
+			}
+
+			stats.cache.hits++;
+			stats.atomic.items++;
+			stats.atomic.read += hit->size();
+
+			return hit;
+		}
+
+		//The record at v while its writer still holds it, empty once it is in the file.
+		//
+
+		std::vector<uint8_t> Pending(uint64_t v)
+		{
+			auto writer = wfile[location::segment(v)].load();
+
+			return (writer) ? writer->Pending(location::offset(v)) : std::vector<uint8_t>();
+		}
+
+		//key: when given, the record must carry this key. stored: when given, a compressed payload is returned as stored and its codec set here.
+		//
+
+		d8u::sse_vector ReadAt(uint64_t v, const void* key = nullptr, uint8_t* stored = nullptr)
+		{
+			auto pool = rfile[location::segment(v)].load();
+
+			if (!pool)
+				throw std::runtime_error("Bad block segment");
+
+			auto& file = pool->Get();
+			uint64_t offset = location::offset(v);
+
+			//Still queued for the group commit, the file doesn't hold it yet:
+			//
+
+			auto pending = Pending(v);
+
+			auto read = [&](uint64_t at, void* dest, size_t size) -> size_t
+			{
+				if (pending.empty())
+					return file.Read(at, dest, size);
+
+				size_t from = std::min<size_t>(at - offset, pending.size());
+				size = std::min(size, pending.size() - from);
+
+				std::memcpy(dest, pending.data() + from, size);
+
+				return size;
+			};
+
+			d8u::sse_vector result;
+			record::Header header;
+
+			result.resize(read_hint_t);
+			auto count = (pending.empty()) ? file.Read(offset, &header, sizeof(record::Header), result.data(), read_hint_t)
+				: read(offset, &header, sizeof(record::Header)) + read(offset + sizeof(record::Header), result.data(), read_hint_t);
+
+			if (count < record::legacy_t || record::length(&header) > record::max_block_t)
+				throw std::runtime_error("Bad block size");
+
+			uint32_t size = record::length(&header);
+
+			if (record::legacy(&header))
+			{
+				//Written before records carried a header, the payload starts right after the size:
+				//
+
+				result.resize(size);
+
+				if (read(offset + record::legacy_t, result.data(), size) != size)
+					throw std::runtime_error("Short block read");
+			}
+			else
+			{
+				if (count < sizeof(record::Header) || !record::valid(header) || (header.flags & record::deleted))
+					throw std::runtime_error("Bad block size");
+
+				count -= sizeof(record::Header);
+				result.resize(size);
+
+				if (count < size && read(offset + sizeof(record::Header) + count, result.data() + count, size - count) != size - count)
+					throw std::runtime_error("Short block read");
+
+				if (key && std::memcmp(header.key, key, sizeof(header.key)))
+					throw std::runtime_error("Block key mismatch");
+
+				if (!record::verify(header, result.data()))
+					throw std::runtime_error("Block checksum mismatch");
+
+				if (stored)
+					*stored = header.codec;
+				else if (header.codec != codec::none)
+				{
+					d8u::sse_vector block;
+
+					if (!record::decode(header, result.data(), block))
+						throw std::runtime_error("Bad compressed block");
+
+					result = std::move(block);
+				}
+			}
+
+			stats.atomic.items++;
+			stats.atomic.read += size;
+
+			return result;
+		}
+
+		//The whole record as stored, verified. Flatten copies records verbatim so legacy ones keep their format.
+		//
+
+		std::vector<uint8_t> ReadRecord(uint64_t v)
+		{
+			auto pool = rfile[location::segment(v)].load();
+
+			if (!pool)
+				throw std::runtime_error("Bad block segment");
+
+			if (auto pending = Pending(v); pending.size())
+				return pending;
+
+			auto& file = pool->Get();
+			uint64_t offset = location::offset(v);
+
+			record::Header header;
+			auto count = file.Read(offset, &header, sizeof(record::Header));
+
+			if (count < record::legacy_t || record::length(&header) > record::max_block_t || (!record::legacy(&header) && count < sizeof(record::Header)))
+				throw std::runtime_error("Bad block size");
+
+			std::vector<uint8_t> result(record::total(&header));
+
+			if (file.Read(offset, result.data(), result.size()) != result.size())
+				throw std::runtime_error("Short block read");
+
+			if (!record::legacy(&header) && !record::verify(header, result.data() + sizeof(record::Header)))
+				throw std::runtime_error("Block checksum mismatch");
+
+			return result;
+		}
+
+		//The record at v is on disk, carries key and passes its checksum. The journal is synced apart from the data
+		//files, after a crash an entry can point at a record that never made it.
+		//
+
+		bool Durable(const tdb::Key32& key, uint64_t v)
+		{
+			try
+			{
+				auto block = ReadRecord(v);
+
+				return record::legacy(block.data()) || !std::memcmp(((record::Header*)block.data())->key, &key, sizeof(tdb::Key32));
+			}
+			catch (...)
+			{
+				return false;
+			}
+		}
+
+		//A segment with a block that can't be read is taken out of from, it stays for scrub and repair to deal with.
+		//
+
+		size_t FlattenPass(std::vector<bool>& from, io::Throttle& throttle)
+		{
+			size_t count = 0;
+
+			db.Table().Iterate([&](auto& v)
+			{
+				std::atomic_ref<std::remove_reference_t<decltype(v)>> slot(v);
+				uint64_t current = slot.load();
+
+				if (!current || !from[location::segment(current)])
+					return running;
+
+				count++;
+
+				//Deleted, the entry goes away with the segment:
+				//
+
+				if (current & location::tombstone)
+				{
+					slot.compare_exchange_strong(current, 0);
+					return running;
+				}
+
+				std::vector<uint8_t> block;
+
+				try
+				{
+					block = ReadRecord(current);
+				}
+				catch (...)
+				{
+					uint64_t s = location::segment(current);
+
+					std::cout << "Flatten: unreadable block at " << current << ", segment " << s << " kept for scrub and repair" << std::endl;
+					from[s] = false;
+
+					return running;
+				}
+
+				auto size = block.size();
+				auto key = (record::legacy(block.data())) ? nullptr : ((record::Header*)block.data())->key;
+
+				std::shared_lock<std::shared_mutex> lck(segment_lock);
+
+				uint64_t to = active[Stripe(key, Cold(location::segment(current)))];
+				auto [o, ticket] = wfile[to].load()->Append(std::move(block));
+
+				if (slot.compare_exchange_strong(current, location::make(to, o) | (current & location::accessed)))
+					slab.Move(location::where(current), location::make(to, o));
+
+				throttle(size);
+
+				return running;
+			});
+
+			return count;
+		}
+
+		//Marks the entry damaged if it still points at the record the scrubber checked.
+		//
+
+		void Flag(const uint8_t* key, uint64_t v, uint64_t bytes)
+		{
+			auto addr = db.FindLock(*((tdb::Key32*)key));
+
+			if (!addr)
+				return;
+
+			std::atomic_ref<uint64_t> slot(*addr);
+			uint64_t current = slot.load();
+
+			while (location::where(current) == v && !slot.compare_exchange_weak(current, current | location::tombstone | location::corrupt)) {}
+
+			if (location::where(current) == v)
+			{
+				dead.Add(v, bytes);
+				slab.Erase(v);
+			}
+		}
+
+		/*
+			One slice of the background scrub, about budget bytes of the data files from the cursor onward, read a window
+			at a time. Runs on the manager thread, never while a Flatten is retiring segments.
+		*/
+
+		void Scrub(size_t budget)
+		{
+			//Only records reserved before the previous slice are checked, anything newer may still be in flight:
+			//
+
+			auto horizon = scrub_horizon;
+
+			for (uint64_t s = 0; s <= last; s++)
+			{
+				auto writer = wfile[s].load();
+				scrub_horizon[s] = (writer) ? writer->Tail() : UINT64_MAX; //Sealed, nothing is in flight.
+			}
+
+			size_t spent = 0;
+
+			while (running && spent < budget && ScrubWindow(horizon, std::min(budget - spent, scrub_window_t), spent)) {}
+		}
+
+		//Checks up to budget bytes at the cursor and adds what it got through to spent. False at the end of a pass or when
+		//the rest of the segment is still being written.
+		//
+
+		bool ScrubWindow(const std::vector<uint64_t>& horizon, size_t budget, size_t& spent)
+		{
+			auto& c = scrub_cursor;
+
+			std::shared_ptr<io::ReadPool<>> pool;
+
+			while (c.segment < location::segments_t && !(pool = rfile[c.segment].load()))
+			{
+				c.segment++;
+				c.offset = 0;
+			}
+
+			if (c.segment == location::segments_t)
+			{
+				c = scrub::Cursor();
+				stats.scrub.passes++;
+
+				return false;
+			}
+
+			auto& file = pool->Get();
+			uint64_t end = std::min(file.Size(), horizon[c.segment]);
+
+			if (c.offset >= end)
+			{
+				c.segment++;
+				c.offset = 0;
+
+				return true;
+			}
+
+			std::vector<uint8_t> window((size_t)std::min((uint64_t)budget, end - c.offset));
+			window.resize(file.Read(c.offset, window.data(), window.size()));
+
+			size_t pos = 0;
+
+			auto resync = [&]()
+			{
+				for (pos++; pos + record::legacy_t <= window.size(); pos++)
+					if (!record::legacy(window.data() + pos))
+						return;
+
+				pos = window.size();
+			};
+
+			while (pos < window.size())
+			{
+				const uint8_t* p = window.data() + pos;
+				const uint8_t* payload = nullptr;
+				uint32_t size = 0;
+
+				std::vector<uint8_t> large;
+				auto status = record::check(p, window.size() - pos, payload, size);
+
+				if (status == record::Check::incomplete)
+				{
+					if (pos || window.size() < sizeof(record::Header) || record::total(p) > end - c.offset)
+						break; //Picked up by the next slice, or the tail of the file is still being written.
+
+					//Larger than the budget, read it whole:
+					//
+
+					large.resize(record::total(p));
+					large.resize(file.Read(c.offset, large.data(), large.size()));
+
+					p = large.data();
+					status = record::check(p, large.size(), payload, size);
+
+					if (status == record::Check::incomplete)
+						break;
+				}
+
+				uint64_t v = location::make(c.segment, c.offset + pos);
+
+				if (record::legacy(p) && !size)
+				{
+					//Unwritten space between queued records, or the reserved start of a segment:
+					//
+
+					resync();
+					continue;
+				}
+
+				bool keyed = !record::legacy(p);
+				bool damaged = status == record::Check::corrupt;
+
+				//Only blocks the index still points at matter. Deleted, replaced or already flagged records are skipped,
+				//unless the key itself may be what was damaged:
+				//
+
+				if (keyed)
+				{
+					auto addr = db.FindLock(*((tdb::Key32*)((record::Header*)p)->key));
+
+					if (!(addr && location::where(std::atomic_ref<uint64_t>(*addr).load(std::memory_order_acquire)) == v) && !(!addr && damaged))
+					{
+						if (damaged)
+							resync();
+						else
+							pos += record::total(p);
+
+						continue;
+					}
+				}
+
+				if (!damaged && keyed && ((record::Header*)p)->codec != codec::none)
+				{
+					std::vector<uint8_t> block;
+
+					damaged = !record::decode(*((record::Header*)p), payload, block) || !d8u::transform::validate_block<TH>(gsl::span<uint8_t>(block.data(), block.size()));
+				}
+				else if (!damaged)
+					damaged = !d8u::transform::validate_block<TH>(gsl::span<uint8_t>((uint8_t*)payload, size));
+
+				if (damaged)
+				{
+					stats.scrub.errors++;
+					std::cout << "Scrub: corruption at " << v << std::endl;
+
+					if (keyed)
+						Flag(((record::Header*)p)->key, v, record::total(p));
+
+					if (status == record::Check::corrupt)
+					{
+						resync();
+						continue;
+					}
+				}
+
+				stats.scrub.blocks++;
+				stats.scrub.bytes += record::total(p);
+
+				pos += record::total(p);
+			}
+
+			c.offset += pos;
+			spent += pos;
+
+			return pos != 0;
+		}
+
+		//Moves the live blocks of the sealed segments into the active one, then deletes them. False when stopped part way.
+		//
+
+		//Sealed segments were retired, nothing appends to them any more. Readers still holding one keep its file open.
+		//
+
+		bool Compact(std::vector<bool>& from, io::Throttle& throttle)
+		{
+			while (running && FlattenPass(from, throttle)) {}
+
+			if (!running)
+				return false;
+
+			Sync();
+			db.Flush();
+
+			for (uint64_t s = 0; s < from.size(); s++)
+			{
+				if (!from[s])
+					continue;
+
+				wfile[s].store(nullptr);
+				rfile[s].store(nullptr);
+
+				std::filesystem::remove(Path(s));
+				dead.Clear(s);
+			}
+
+			slab.Retain([&](uint64_t v) { return !from[location::segment(v)]; });
+
+			dead.Flush();
+
+			return true;
+		}
+
+		/*
+			One turn of the tiering clock over the index. A block in a sealed fast segment whose access bit is still clear
+			from the previous turn is copied to the capacity tier, one whose bit is set gets it cleared. The copies leave
+			dead space behind, Worth then compacts the fast segments the remaining blocks are in.
+		*/
+
+		void Demote(io::Throttle& throttle)
+		{
+			db.Table().Iterate([&](auto& v)
+			{
+				std::atomic_ref<std::remove_reference_t<decltype(v)>> slot(v);
+				uint64_t current = slot.load();
+
+				if (!location::live(current) || Cold(location::segment(current)) || Active(location::segment(current)))
+					return running;
+
+				if (current & location::accessed)
+				{
+					slot.compare_exchange_strong(current, current & ~location::accessed);
+					return running;
+				}
+
+				std::vector<uint8_t> block;
+
+				try
+				{
+					block = ReadRecord(current);
+				}
+				catch (...)
+				{
+					return running; //Left to scrub and repair.
+				}
+
+				auto size = block.size();
+				auto key = (record::legacy(block.data())) ? nullptr : ((record::Header*)block.data())->key;
+
+				std::shared_lock<std::shared_mutex> lck(segment_lock);
+
+				uint64_t to = active[Stripe(key, true)];
+				auto [o, ticket] = wfile[to].load()->Append(std::move(block));
+
+				if (slot.compare_exchange_strong(current, location::make(to, o)))
+				{
+					dead.Add(current, size);
+					slab.Move(current, location::make(to, o));
+
+					stats.tier.blocks++;
+					stats.tier.bytes += size;
+				}
+				else
+					dead.Add(location::make(to, o), size);
+
+				throttle(size);
+
+				return running;
+			});
+
+			stats.tier.sweeps++;
+		}
+
+		//all: every sealed segment, otherwise only those past FlattenThreshold. migrate: a Demote sweep first.
+		//
+
+		void _Flatten(bool all, bool migrate)
+		{
+			io::Throttle throttle(flatten_rate);
+
+			if (migrate)
+				Demote(throttle);
+
+			std::vector<bool> from(location::segments_t);
+			bool any = false;
+
+			for (uint64_t s = 0; s <= last; s++)
+			{
+				if (Sealed(s) && (all || Worth(s)))
+				{
+					from[s] = true;
+					any = true;
+				}
+			}
+
+			if (any && !Compact(from, throttle))
+				return; //Resumes on the next start.
+
+			if (all && running)
+				flatten::end(root);
+		}
+
+		//filter.db and slab.db are saved with the index. The journal replay on open adds the keys that came after to the filter,
+		//their tiny blocks go back into the slab when first read.
+		//
+
+		void Checkpoint()
+		{
+			journal.Checkpoint([&]()
+			{
+				db.Flush();
+				filter.Save(root + "/filter.db");
+				slab.Save(root + "/slab.db");
+			});
+		}
+
+		//Indexes that can list their keys rebuild the filter sized to them, others load filter.db. Without either it stays off.
+		//
+
+		void LoadFilter()
+		{
+			if constexpr (KeyedIndex<INDEX>)
+			{
+				uint64_t keys = 0;
+				db.IterateKeys([&](const tdb::Key32&, uint64_t&) { keys++; return true; });
+
+				filter.Reset(keys);
+				db.IterateKeys([&](const tdb::Key32& k, uint64_t&) { filter.Add(k); return true; });
+			}
+			else if (!filter.Load(root + "/filter.db"))
+			{
+				bool empty = true;
+				db.Table().Iterate([&](auto&) { empty = false; return false; });
+
+				if (empty)
+					filter.Reset(0);
+				else
+					std::cout << "Negative lookup filter disabled, filter.db is missing" << std::endl;
+			}
+		}
+
+	public:
+
+		Statistics* Stats() { return &stats; }
+
+		//durable_writes: Write returns only once the batch carrying the block has been synced to disk.
+		//direct_io: segment files bypass the page cache, so it is left to the index and the block cache, size that with CacheSize.
+		//
+
+		Image2(string_view _root, int start_code = 0, bool _durable_writes = false, bool _direct_io = false)
+			: Image2(_root, std::vector<std::string>{ string(_root) }, start_code, _durable_writes, _direct_io) { }
+
+		Image2(string_view _root, const std::vector<std::string>& _devices, int start_code = 0, bool _durable_writes = false, bool _direct_io = false)
+			: Image2(_root, _devices, std::vector<std::string>(), start_code, _durable_writes, _direct_io) { }
+
+		//devices: data directories the segment files are striped over, one per drive, root may be one of them. The index and
+		//the other metadata stay in root. Every directory holding segments must stay listed, a new one only takes new blocks
+		//until a Flatten moves the rest. cold: the capacity tier, blocks that go unread move there, see TierAge.
+		//
+
+		Image2(string_view _root, const std::vector<std::string>& _devices, const std::vector<std::string>& cold, int start_code = 0, bool _durable_writes = false, bool _direct_io = false)
+			: db(string(_root) + "/index.db")
+			, root(_root)
+			, durable_writes(_durable_writes)
+			, direct_io(_direct_io)
+			, devices(Devices(_devices, cold))
+			, fast(_devices.size())
+			, device(location::segments_t)
+			, wfile(location::segments_t)
+			, rfile(location::segments_t)
+			, active(std::make_unique<std::atomic<uint64_t>[]>(devices.size()))
+			, dead(string(_root) + "/dead.db")
+			, journal(_root)
+			, scrub_cursor(scrub::load(_root))
+			, scrub_horizon(location::segments_t, 0)
+		{
+			//A start_code recovers an image that didn't close and takes its lock over:
+			//
+
+			if (start_code)
+				std::filesystem::remove(string(root) + "/lock.db");
+
+			if (std::filesystem::exists(string(_root) + "/lock.db"))
+				throw std::runtime_error("Image is locked, is a backup running? Did a backup fail to complete gracefully? If the second is true please delete the lock file.");
+
+			d8u::util::empty_file(string(_root) + "/lock.db");
+
+			//A failed open gives the lock back, the journal is only checkpointed once it has been replayed:
+			//
+
+			try
+			{
+				for (size_t d = 0; d < devices.size(); d++)
+					for (uint64_t s = 0; s < location::segments_t; s++)
+						if (!rfile[s].load() && std::filesystem::exists(location::path(devices[d], s)))
+							Open(s, d, false);
+
+				//New blocks go to the newest segment of each device, a device without one starts a new segment. The capacity
+				//tier goes first, fast devices with nothing newer than it start a new segment too, see Roll:
+				//
+
+				uint64_t top = 0;
+
+				for (size_t d = devices.size(); d--; )
+				{
+					uint64_t newest = location::segments_t;
+
+					for (uint64_t s = 0; s <= last; s++)
+						if (rfile[s].load() && device[s] == d)
+							newest = s;
+
+					if (newest == location::segments_t || (d < fast && Tiered() && newest < top))
+						newest = (rfile[last].load()) ? last + 1 : last.load();
+
+					if (d >= fast)
+						top = std::max(top, newest);
+
+					if (newest > location::segment_mask)
+						throw std::runtime_error("Segment numbers exhausted");
+
+					active[d] = newest;
+					Open(newest, d);
+				}
+
+				//Nothing is in flight yet, the scrub resumes over everything on disk:
+				//
+
+				for (uint64_t s = 0; s <= last; s++)
+				{
+					auto writer = wfile[s].load();
+					scrub_horizon[s] = (writer) ? writer->Tail() : UINT64_MAX;
+				}
+
+				//Entries at or past the end of a segment were lost with its tail, those offsets get written again:
+				//
+
+				if (slab.Load(root + "/slab.db"))
+				{
+					slab.Retain([&](uint64_t v)
+					{
+						auto pool = rfile[location::segment(v)].load();
+
+						return pool && location::offset(v) < pool->Get().Size();
+					});
+				}
+
+				flatten_request = flatten::pending(root);
+
+				LoadFilter();
+				Replay();
+
+				if (start_code == 1)
+					RepairQuick();
+				else if (start_code == 2)
+					Repair(false);
+				else if (start_code == 3)
+					Repair(true);
+				else if (start_code == 4)
+					Rebuild();
+			}
+			catch (...)
+			{
+				std::filesystem::remove(string(root) + "/lock.db");
 
-				start += sizeof(uint32_t) + size;
+				throw;
 			}
 
-			return start;
-		}
+			//Background work starts once the index is consistent, Flatten and Compact would swap files under Repair:
+			//
 
-		template <typename F> uint64_t Enumerate(uint64_t start, F&& f)
-		{
-			return EnumerateMap(start, [f = std::move(f)](auto map)
+			manager_thread = std::thread([&]()
 			{
-				d8u::sse_vector result(map.size());
+				size_t counter = 0;
+				bool compact = false;
+				bool demote = false;
 
-				std::copy(map.begin(), map.end(), result.begin());
+				while (running)
+				{
+					std::this_thread::sleep_for(std::chrono::milliseconds(1000));
 
-				return f(result);
-			});
-		}
+					if (scrub_rate && !flatten_request && !flattening)
+						Scrub(scrub_rate);
 
-		template <typename T> d8u::sse_vector Read(const T& id)
-		{
-			auto map = Map(id);
+					if (counter++ % 10 == 0)
+					{
+						dead.Flush();
+						scrub::save(root, scrub_cursor);
 
-			d8u::sse_vector result(map.size());
+						if (checkpoint::due(journal, counter - 1))
+							Checkpoint();
 
-			std::copy(map.begin(), map.end(), result.begin());
+						for (uint64_t s = 0; s <= last && !compact && !flattening; s++)
+							compact = Worth(s);
+					}
 
-			return result;
+					for (size_t d = 0; d < devices.size(); d++)
+						if (segment_size && wfile[active[d]].load()->Tail() >= segment_size)
+							Roll(d);
+
+					if (Tiered() && tier_age && counter % tier_age == 0)
+						demote = true;
+
+					if ((flatten_request || compact || demote) && !flattening)
+					{
+						if (flatten_thread.joinable())
+							flatten_thread.join();
+
+						bool all = flatten_request.exchange(false);
+						bool migrate = demote;
+						compact = demote = false;
+
+						//Active segments are sealed first when they are to be compacted too:
+						//
+
+						for (size_t d = 0; d < devices.size(); d++)
+							if (all || Worth(active[d]))
+								Roll(d);
+
+						if (all)
+							flatten::begin(root, active[0]);
+
+						flattening = true;
+
+						flatten_thread = std::thread([&, all, migrate]()
+						{
+							try
+							{
+								_Flatten(all, migrate);
+							}
+							catch (std::exception& e)
+							{
+								std::cout << "Flatten: " << e.what() << std::endl;
+							}
+
+							flattening = false;
+						});
+					}
+				}
+			});
 		}
 
-		template <typename T> gsl::span<uint8_t> Allocate(const T& id, size_t size)
+		~Image2()
 		{
-			stats.atomic.blocks++;
-			stats.atomic.write += size;
+			running = false;
+			manager_thread.join();
 
-			//Race condition:
-			//A block request happening around the same time will report zero as the offset.
-			//Up until the line below: "*res.first = o;"
-			//This has been resolved by reporting a miss for all uninitialized pointers.
+			if (flatten_thread.joinable())
+				flatten_thread.join();
 
-			auto res = db.InsertLock( *( (tdb::Key32*) id.data() ), uint64_t(0));
+			scrub::save(root, scrub_cursor);
 
-			//Duplicate block insert? Abort.
-			//This happens usually when the client isn't using a local block filter.
+			//A failed write leaves lock.db behind, the next open has to repair:
 			//
 
-			if (res.second && *res.first != 0) 
-				return gsl::span<uint8_t>();
+			try
+			{
+				Sync();
+			}
+			catch (std::exception& e)
+			{
+				std::cout << "Image closed with unwritten blocks: " << e.what() << std::endl;
+				return;
+			}
 
-			//This code will align blocks to the page at the cost of packing. Not needed.
-			//auto [p, o] = dat.AllocateAlign(size + sizeof(uint32_t));
-			//
+			Checkpoint();
 
-			auto [p, o] = dat.Allocate(size + sizeof(uint32_t));
+			std::filesystem::remove(string(root) + "/lock.db");
+		}
 
-			if(!p) 
-				return gsl::span<uint8_t>();
+		//Background compaction, the active segment is sealed and the live blocks of every sealed segment are copied
+		//into the new one at no more than FlattenRate bytes per second. Emptied segment files are deleted.
+		//
 
-			*((uint32_t*)p) = (uint32_t)size;
+		void Flatten() { flatten_request = true; }
 
-			*res.first = o;
+		void FlattenRate(size_t bytes_per_second) { flatten_rate = bytes_per_second; }
 
-			return gsl::span<uint8_t>(p+sizeof(uint32_t),size);
-		}
+		//Percentage of a segment that must be dead before it is compacted on its own, zero disables.
+		//
 
-		template <typename T, typename Y> void Write(const T& id, const Y& payload)
-		{
-			auto block = Allocate(id, payload.size());
+		void FlattenThreshold(size_t percent) { flatten_threshold = percent; }
 
-			if (!block.data())
-				return; //Todo notification, however this never causes problems.
+		//Size at which the active segment file is sealed and new blocks go to a new one, zero keeps a single growing file.
+		//
 
-			std::copy(payload.begin(), payload.end(), block.begin());
+		void SegmentSize(uint64_t bytes) { segment_size = bytes; }
 
-			dat.Flush2(block.data(), block.size());
-		}
+		//Seconds per turn of the tiering clock, zero stops migration. A block in a sealed fast segment that isn't read
+		//for a whole turn moves to the capacity tier at no more than FlattenRate bytes per second. Progress is in Stats()->tier.
+		//
 
-		template <typename T> bool Is(const T& id)
-		{
-			stats.atomic.queries++;
+		void TierAge(size_t seconds) { tier_age = seconds; }
 
-			auto* i = db.FindLock(*((tdb::Key32*) id.data()));
+		DeadSpace& Dead() { return dead; }
 
-			return i != nullptr && *i;
-		}
+		bool Flattening() { return flatten_request || flattening; }
 
-		template <size_t U, typename T> uint64_t Many(const T& ids)
-		{
-			std::bitset<64> result;
+		//Background scrub of the data files at no more than this many bytes per second, zero (the default) disables.
+		//Damaged blocks are flagged in the index and read as missing, progress is in Stats()->scrub.
+		//
 
-			auto limit = ids.size() / U;
+		void ScrubRate(size_t bytes_per_second) { scrub_rate = bytes_per_second; }
 
-			stats.atomic.queries += limit;
+		//Bytes of blocks kept in memory for Read, zero (the default) disables. Hits and misses are in Stats()->cache.
+		//
 
-			if (limit > 64)
-				throw runtime_error("The max limit for Many is 64");
+		void CacheSize(size_t bytes) { cache.Capacity(bytes); }
 
-			for (size_t i = 0; i < limit; i++)
-			{
-				auto* k = db.FindLock(*(((tdb::Key32*)ids.data()) + i));
-				result.set(i, (k != nullptr && *k));
-			}		
+		//Blocks of up to this many bytes are also kept in memory beside the index, Read serves them without touching the
+		//data files. Zero (the default) disables, the setting is kept in slab.db. Hits are in Stats()->slab.
+		//
 
-			return result.to_ullong();
-		}
-	};
+		void InlineSize(size_t bytes) { slab.Limit(bytes); }
 
-	template < typename TH >class Image2
-	{
-		static uint64_t constexpr book_t = 256 * 1024 * 1024;
-		tdb::LargeHashmapSafe db;
-		std::atomic<uint64_t> file_tail;
+		//Bytes of inline blocks kept at most, 256 MB by default. Blocks past it are read from the data files.
+		//
 
-		d8u::util::Statistics stats;
+		void InlineCapacity(size_t bytes) { slab.Capacity(bytes); }
 
-		bool running = true;
-		std::thread manager_thread;
+		//Codec new blocks are compressed with, codec::none (the default) stores them raw. Blocks already written keep theirs.
+		//
 
-		std::string root;
-		std::string image;
+		void Compression(uint8_t c)
+		{
+			if (!codec::supported(c))
+				throw std::runtime_error("Codec not supported");
 
-		std::ofstream wfile;
-		std::mutex wio;
+			compression = c;
+		}
 
-	public:
+		//Restores the index changes logged since the last checkpoint, runs on open before any start_code repair.
+		//
 
-		d8u::util::Statistics* Stats() { return &stats; }
+		size_t Replay()
+		{
+			auto count = journal.Replay(db, location::segments_t, [&](const tdb::Key32& k, uint64_t v) { return Durable(k, v); }, [&](const tdb::Key32& k) { filter.Add(k); });
 
-		Image2(string_view _root, int start_code = 0)
-			: db(string(_root) + "/index.db")
-			, image(string(_root) + "/image.dat")
-			, wfile(string(_root) + "/image.dat", ios::binary | ios::app)
-			, root(_root)
-			, file_tail(0)
-			, manager_thread([&]()
-			{
-				size_t counter = 0;
-				while (running)
-				{
-					std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+			if (count)
+				std::cout << "Journal entries replayed: " << count << std::endl;
 
-					if (counter++ % 10 == 0)
-					{
-						db.Flush();
-						
-						std::lock_guard<std::mutex> lck(wio);
-						wfile.flush();
-					}
+			Checkpoint();
 
-					/*
-						Todo Flatten
-					*/
-				}
-			}) 
-		{ 
-			if (start_code == 1)
-				RepairQuick();
-			else if (start_code == 2)
-				Repair(false);
-			else if (start_code == 3)
-				Repair(true);
-
-			if(start_code)
-				std::filesystem::remove(string(root) + "/lock.db");
+			return count;
+		}
 
-			if(std::filesystem::exists(root + "/image.dat"))
-				file_tail = d8u::util::GetFileSize(root + "/image.dat");
+		//Recovers index entries from the records in the segment files, start_code 4 runs this before the image opens.
+		//
 
-			if (std::filesystem::exists(string(_root) + "/lock.db"))
-				throw std::runtime_error("Image is locked, is a backup running? Did a backup fail to complete gracefully? If the second is true please delete the lock file.");
+		size_t Rebuild()
+		{
+			auto count = record::rebuild(db, [&](uint64_t s) { return (rfile[s].load()) ? Path(s) : std::string(); }, location::segments_t, location::segments_t, [&](const tdb::Key32& k) { filter.Add(k); });
 
-			d8u::util::empty_file(string(_root) + "/lock.db");
-		}
+			if constexpr (KeyedIndex<INDEX>)
+				LoadFilter(); //Resized to the recovered keys.
 
-		~Image2()
-		{
-			running = false;
-			manager_thread.join();
+			std::cout << "Rebuilt index entries: " << count << std::endl;
 
-			std::filesystem::remove(string(root) + "/lock.db");
+			return count;
 		}
 
+		//Stays a single pass, Table().Iterate is serial and the check per entry is one compare, there is nothing to fan out.
+		//
+
 		void RepairQuick()
 		{
 			auto& table = db.Table();
@@ -363,56 +1998,20 @@ namespace volstore
 			});
 		}*/
 
+		//Streams each segment in location order and validates blocks on all cores, see repair.hpp.
+		//
+
 		void Repair(bool can_write)
 		{
-			auto& table = db.Table();
-			std::ifstream file(image, ios::binary);
-
-			size_t count = 0;
-
-			auto do_repair = [&](auto& v)
+			repair::run(db, [&](uint64_t segment) -> const io::File*
 			{
-				count++;
-				std::cout << "Corruption at: " << v << std::endl;
-
-				if (!can_write)
-					return;
-
-				std::cout << "Trimming Block: " << v << std::endl;
-
-				v = 0;
-			};
+				auto pool = rfile[segment].load();
 
-			table.Iterate([&](auto & v)
+				return (pool) ? &pool->Get() : nullptr; //Repair runs before the image opens, the slot keeps it alive.
+			}, [](auto block)
 			{
-				d8u::sse_vector result;
-
-				file.seekg(v, file.beg);
-
-				uint32_t size = -1;
-
-				file.read((char*)&size, 4);
-
-				if (size > 1024 * 1024 * 32)
-				{
-					do_repair(v);
-					return true;
-				}			
-
-				result.resize(size);
-				file.read((char*)result.data(), size);
-
-				stats.atomic.items++;
-				stats.atomic.read += size;
-
-				if (!d8u::transform::validate_block<TH>(result))
-					do_repair(v);
-
-				return true;
-			});
-
-			if (count && !can_write)
-				throw std::runtime_error("Database is corrupt but repair prevented");		
+				return d8u::transform::validate_block<TH>(block);
+			}, can_write);
 		}
 
 		template <typename T> bool ValidateStandard(const T& id)
@@ -431,31 +2030,58 @@ namespace volstore
 
 		template <typename T> d8u::sse_vector Read(const T& id)
 		{
-			auto addr = db.FindLock(*((tdb::Key32*) id.data()));
+			auto& key = *((tdb::Key32*) id.data());
+			auto addr = db.FindLock(key);
+			uint64_t current = (addr) ? std::atomic_ref<uint64_t>(*addr).load() : 0;
 
-			d8u::sse_vector result;
+			if (!location::live(current)) return d8u::sse_vector();
 
-			if (!addr) return d8u::sse_vector();
+			uint64_t v = location::where(current);
 
-			std::ifstream file(image,ios::binary);
-			file.seekg(*addr, file.beg);
+			//The tiering clock's access bit, only written when it isn't set yet:
+			//
 
-			uint32_t size=-1;
+			if (Tiered() && !(current & location::accessed))
+				std::atomic_ref<uint64_t>(*addr).fetch_or(location::accessed, std::memory_order_relaxed);
 
-			file.read((char*)&size, 4);
+			d8u::sse_vector result;
 
-			if (size > 1024 * 1024 * 32)
-				throw std::runtime_error("Bad block size");
+			if (slab.Find(v, result))
+			{
+				stats.slab.hits++;
+				stats.atomic.items++;
+				stats.atomic.read += result.size();
 
-			result.resize(size);
-			file.read((char*)result.data(), size);
+				return result;
+			}
 
-			stats.atomic.items++;
-			stats.atomic.read += size;
+			if (auto hit = Cached(key, v))
+				return *hit;
+
+			result = ReadAt(v, id.data());
+
+			if (!slab.Insert(v, result.data(), result.size()))
+				cache.Insert(key, v, result);
 
 			return result;
 		}
 
+		//The payload as stored, for clients that decode themselves: c is set to its codec, see codec::decompress.
+		//
+
+		template <typename T> d8u::sse_vector ReadStored(const T& id, uint8_t& c)
+		{
+			auto addr = db.FindLock(*((tdb::Key32*) id.data()));
+
+			uint64_t v = (addr) ? std::atomic_ref<uint64_t>(*addr).load() : 0;
+
+			c = codec::none;
+
+			if (!location::live(v)) return d8u::sse_vector();
+
+			return ReadAt(v, id.data(), &c);
+		}
+
 		void _Write2() {} //No Op
 
 		template <typename T, typename Y> void _Write1(const T& id, const Y& payload)
@@ -464,39 +2090,95 @@ namespace volstore
 		}
 
 		template <typename T, typename Y> void Write(const T& id, const Y& payload)
+		{
+			auto ticket = WriteAsync(id, payload);
+
+			if (durable_writes && ticket)
+				Wait(ticket);
+		}
+
+		//Queues the block for the next group commit and returns the batch ticket, zero if there is nothing to wait for.
+		//
+
+		template <typename T, typename Y> uint64_t WriteAsync(const T& id, const Y& payload)
 		{
 			uint32_t size = (uint32_t)payload.size();
 
 			stats.atomic.blocks++;
 			stats.atomic.write += size;
 
-			auto res = db.InsertLock(*((tdb::Key32*) id.data()), uint64_t(0));
+			auto& key = *((tdb::Key32*) id.data());
 
-			if (res.second && *res.first != 0)
-				return; //Block has already been written.
+			filter.Add(key);
 
-			uint64_t o;
+			auto res = db.InsertLock(key, uint64_t(0));
 
-			{
-				std::lock_guard<std::mutex> lck(wio);
-				o = file_tail += (payload.size() + sizeof(uint32_t));
-				o -= size + sizeof(uint32_t);
+			if (res.second && location::live(std::atomic_ref<uint64_t>(*res.first).load()))
+				return 0; //Block has already been written.
 
-				wfile.seekp(o); //not needed with append mode;?
-				wfile.write((char*)&size, sizeof(uint32_t));
-				wfile.write((char*)payload.data(), payload.size());
-			}
+			auto scope = journal.Scope();
+			std::shared_lock<std::shared_mutex> lck(segment_lock);
+
+			uint64_t s = active[Stripe(id.data())];
+			auto [o, ticket] = wfile[s].load()->Append(record::encode(id, payload, compression));
+
+			//A new block gets a whole turn of the tiering clock before it can move:
+			//
+
+			uint64_t v = location::make(s, o) | ((Tiered()) ? location::accessed : 0);
+
+			//Reads, deletes and flatten use the slot concurrently:
+			//
+
+			std::atomic_ref<uint64_t>(*res.first).store(v);
+			journal.Append(id.data(), v);
+
+			slab.Insert(location::make(s, o), (const uint8_t*)payload.data(), size);
+
+			return (s << ticket_bits) | ticket;
+		}
+
+		void Wait(uint64_t ticket)
+		{
+			auto writer = wfile[ticket >> ticket_bits].load();
+
+			//A sealed segment was synced before it was retired.
+			//
+
+			if (writer)
+				writer->Wait(ticket & ((uint64_t(1) << ticket_bits) - 1));
+
+			//The index entry is durable with the journal:
+			//
+
+			journal.Sync();
+		}
+
+		//Durability point for everything written so far.
+		//
+
+		void Sync()
+		{
+			for (uint64_t s = 0; s <= last; s++)
+				if (auto writer = wfile[s].load())
+					writer->Sync();
 
-			*res.first = o;
+			journal.Sync();
 		}
 
 		template < typename T > int _IsLocal(const T& id)
 		{
 			stats.atomic.queries++;
 
-			auto* i = db.FindLock(*((tdb::Key32*) id.data()));
+			auto& key = *((tdb::Key32*) id.data());
+
+			if (!filter.Maybe(key))
+			{
+				stats.filter.negatives++;
+				return -1;
+			}
 
-			return (i != nullptr && *i) ? 1 : -1;
+			return (location::live_slot(db.FindLock(key))) ? 1 : -1;
 		}
 
 		template <size_t U, typename T> void _Many1(const T& ids) {} //No Op
@@ -510,9 +2192,64 @@ namespace volstore
 		{
 			stats.atomic.queries++;
 
-			auto* i = db.FindLock(*((tdb::Key32*) id.data()));
+			auto& key = *((tdb::Key32*) id.data());
+
+			if (!filter.Maybe(key))
+			{
+				stats.filter.negatives++;
+				return false;
+			}
+
+			return location::live_slot(db.FindLock(key));
+		}
+
+		template <typename T> bool Delete(const T& id)
+		{
+			auto addr = db.FindLock(*((tdb::Key32*) id.data()));
+
+			if (!addr)
+				return false;
+
+			auto scope = journal.Scope();
+
+			std::atomic_ref<uint64_t> slot(*addr);
+			uint64_t current = slot.load();
+
+			//Reads set the access bit and flatten moves blocks, only a delete that got there first wins:
+			//
+
+			while (location::live(current) && !slot.compare_exchange_weak(current, current | location::tombstone)) {}
+
+			if (!location::live(current))
+				return false;
+
+			journal.Append(id.data(), current | location::tombstone);
+			slab.Erase(location::where(current));
+
+			//The record may still be queued in its writer:
+			//
+
+			record::Header header = {};
+			auto pool = rfile[location::segment(current)].load();
+
+			if (auto pending = Pending(current); pending.size())
+				std::memcpy(&header, pending.data(), std::min(pending.size(), sizeof(record::Header)));
+			else if (pool)
+				pool->Get().Read(location::offset(current), &header, sizeof(record::Header));
 
-			return i != nullptr && *i;
+			dead.Add(current, record::total(&header));
+
+			//The tombstone record lets an index rebuilt from the data file see the delete:
+			//
+
+			std::shared_lock<std::shared_mutex> lck(segment_lock);
+
+			uint64_t s = active[Stripe(id.data())];
+			auto [o, ticket] = wfile[s].load()->Append(record::tombstone(id));
+
+			dead.Add(location::make(s, o), sizeof(record::Header));
+
+			return true;
 		}
 
 		template <size_t U, typename T> uint64_t Many(const T& ids)
@@ -526,13 +2263,71 @@ namespace volstore
 			if (limit > 64)
 				throw runtime_error("The max limit for Many is 64");
 
+			uint64_t* found[64];
+			stats.filter.negatives += FindMany(db, filter, (const tdb::Key32*)ids.data(), limit, found);
+
 			for (size_t i = 0; i < limit; i++)
+				result.set(i, location::live_slot(found[i]));
+
+			return result.to_ullong();
+		}
+
+		//Existence of any number of keys as a bitmap, see bitmap.hpp.
+		//
+
+		template <size_t U, typename T> std::vector<uint8_t> ManyBitmap(const T& ids)
+		{
+			auto limit = ids.size() / U;
+
+			stats.atomic.queries += limit;
+
+			std::vector<uint8_t> result(bitmap::bytes(limit));
+			std::vector<uint64_t*> found(std::min(limit, bitmap::frame_t));
+
+			bitmap::frames(limit, [&](size_t first, size_t count)
 			{
-				auto* k = db.FindLock(*(((tdb::Key32*)ids.data()) + i));
-				result.set(i, (k != nullptr && *k));
-			}
+				stats.filter.negatives += FindMany(db, filter, (const tdb::Key32*)ids.data() + first, count, found.data());
+
+				for (size_t i = 0; i < count; i++)
+					if (location::live_slot(found[i]))
+						bitmap::set(result.data(), first + i);
+			});
+
+			return result;
+		}
+
+		template <size_t U, typename T> uint64_t DeleteMany(const T& ids)
+		{
+			std::bitset<64> result;
+
+			auto limit = ids.size() / U;
+
+			if (limit > 64)
+				throw runtime_error("The max limit for DeleteMany is 64");
+
+			for (size_t i = 0; i < limit; i++)
+				result.set(i, Delete(gsl::span<uint8_t>((uint8_t*)ids.data() + U * i, U)));
 
 			return result.to_ullong();
 		}
 	};
-}
\ No newline at end of file
+	//Image2 over a sharded index, for many event threads. An existing index.db isn't carried over, start_code 4 rebuilds the shards from the data files.
+	//
+
+	template < typename TH > using Image2Sharded = Image2<TH, ShardedIndex<>>;
+
+	//Image2 over the compact fingerprint index, for key counts whose full keys no longer fit in memory.
+	//
+
+	template < typename TH > using Image2Compact = Image2<TH, FingerprintIndex>;
+
+	//Image2 over the log structured index, for key counts far beyond memory.
+	//
+
+	template < typename TH > using Image2Lsm = Image2<TH, LsmIndex>;
+
+	//Image2 over optimistic tables that grow in the background, for stores whose final size isn't known up front.
+	//
+
+	template < typename TH > using Image2Growing = Image2<TH, GrowingIndex<>>;
+}
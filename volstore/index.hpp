@@ -0,0 +1,980 @@
+/* Copyright (C) 2020 D8DATAWORKS - All Rights Reserved */
+
+#pragma once
+
+#include <string_view>
+#include <string>
+#include <vector>
+#include <memory>
+#include <filesystem>
+#include <fstream>
+#include <execution>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <xmmintrin.h>
+#endif
+
+#include "../mio.hpp"
+#include "tdb/legacy.hpp"
+
+namespace volstore
+{
+	inline void prefetch(const void* p)
+	{
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+		_mm_prefetch((const char*)p, _MM_HINT_T0);
+#elif defined(__GNUC__)
+		__builtin_prefetch(p);
+#endif
+	}
+
+	//Indexes that can list their keys, not every map keeps them.
+	//
+
+	template < typename T > concept KeyedIndex = requires (T& i, bool (*f)(const tdb::Key32&, uint64_t&)) { i.IterateKeys(f); };
+
+	//Indexes that can start loading the bucket of a key ahead of FindLock. tdb's tables don't expose where a key's bucket
+	//lives, so LargeHashmapSafe, the default INDEX, isn't one and gets no bucket prefetch. OptimisticIndex and
+	//FingerprintIndex are, ShardedIndex and GrowingIndex are when their MAP is.
+	//
+
+	template < typename T > concept PrefetchIndex = requires (T& i, const tdb::Key32& k) { i.Prefetch(k); };
+
+	//An index.db of another index type, tdb's included, can't be read or converted. The segments can rebuild it:
+	//
+
+	inline std::runtime_error ForeignIndex(std::string_view path)
+	{
+		return std::runtime_error(std::string(path) + " was written by another index type, move it aside and open with start_code 4 to rebuild it from the segments");
+	}
+
+	/*
+		Block index partitioned into N independent hash maps, index.<n>.db beside where index.db would be.
+		Each shard has its own locks and mapping, so concurrent lookups only meet when their keys share a shard.
+
+		Keys are uniform hashes. The shard comes from the last key byte because the maps bucket on the leading bytes,
+		this way every shard still spreads over all of its buckets.
+	*/
+
+	template < size_t N = 16, typename MAP = tdb::LargeHashmapSafe > class ShardedIndex
+	{
+		static_assert(N && N <= 256 && !(N & (N - 1)), "Shard count must be a power of two no larger than 256");
+
+		std::vector<std::unique_ptr<MAP>> shards;
+
+		MAP& Shard(const tdb::Key32& k)
+		{
+			return *shards[((const uint8_t*)&k)[sizeof(tdb::Key32) - 1] % N];
+		}
+
+	public:
+
+		ShardedIndex(std::string_view path)
+		{
+			std::filesystem::path p(path);
+
+			auto stem = p.stem().string();
+			auto extension = p.extension().string();
+
+			for (size_t i = 0; i < N; i++)
+				shards.push_back(std::make_unique<MAP>((p.parent_path() / (stem + "." + std::to_string(i) + extension)).string()));
+		}
+
+		auto FindLock(const tdb::Key32& k)
+		{
+			return Shard(k).FindLock(k);
+		}
+
+		auto InsertLock(const tdb::Key32& k, uint64_t v)
+		{
+			return Shard(k).InsertLock(k, v);
+		}
+
+		void Prefetch(const tdb::Key32& k) requires PrefetchIndex<MAP>
+		{
+			Shard(k).Prefetch(k);
+		}
+
+		ShardedIndex& Table() { return *this; }
+
+		template < typename F > void Iterate(F&& f)
+		{
+			bool more = true;
+
+			for (auto& s : shards)
+			{
+				if (!more)
+					break;
+
+				s->Table().Iterate([&](auto& v)
+				{
+					more = f(v);
+					return more;
+				});
+			}
+		}
+
+		//f(key, value), for maps that can list their keys.
+		//
+
+		template < typename F > void IterateKeys(F&& f) requires KeyedIndex<MAP>
+		{
+			bool more = true;
+
+			for (auto& s : shards)
+			{
+				if (!more)
+					break;
+
+				s->IterateKeys([&](const tdb::Key32& k, auto& v)
+				{
+					more = f(k, v);
+					return more;
+				});
+			}
+		}
+
+		size_t ResetNodeLocks()
+		{
+			size_t count = 0;
+
+			for (auto& s : shards)
+				count += s->Table().ResetNodeLocks();
+
+			return count;
+		}
+
+		void Flush()
+		{
+			std::for_each(std::execution::par, shards.begin(), shards.end(), [](auto& s) { s->Flush(); });
+		}
+	};
+
+	/*
+		Block index with an optimistic read path, a drop in for tdb::LargeHashmapSafe.
+
+		Open addressing over 128 byte buckets of three slots in a mapped file. Every bucket carries a sequence number
+		that writers make odd while they fill a slot. FindLock never takes a lock: it reads a bucket, and if the
+		sequence moved underneath it, reads it again. Slots are never removed or moved, so the value pointer
+		handed out stays valid and keeps the InsertLock semantics the engines rely on. Inserts of the same key
+		are serialized by a striped mutex on the home bucket.
+	*/
+
+	class OptimisticIndex
+	{
+		static uint64_t constexpr magic_t = 0xD8B1DE7800000001;
+		static size_t constexpr slots_t = 3;
+		static size_t constexpr stripes_t = 1024;
+
+		struct Slot
+		{
+			tdb::Key32 key;
+			uint64_t value;
+		};
+
+		struct alignas(128) Bucket
+		{
+			uint32_t sequence;
+			uint32_t used;
+			Slot slots[slots_t];
+		};
+
+		struct alignas(128) Header
+		{
+			uint64_t magic;
+			uint64_t buckets;
+		};
+
+		static_assert(sizeof(Bucket) == 128, "Bucket layout changed");
+
+		mio::mmap_sink map;
+		Bucket* buckets = nullptr;
+		uint64_t mask = 0;
+
+		std::mutex stripes[stripes_t];
+		size_t reset = 0;
+		std::atomic<uint64_t> size = 0;
+
+		uint64_t Home(const tdb::Key32& k) const
+		{
+			uint64_t h;
+			std::memcpy(&h, &k, sizeof(h));
+
+			return h & mask;
+		}
+
+		static void Lock(Bucket& b)
+		{
+			std::atomic_ref<uint32_t> sequence(b.sequence);
+
+			while (true)
+			{
+				uint32_t s = sequence.load(std::memory_order_relaxed);
+
+				if (!(s & 1) && sequence.compare_exchange_weak(s, s + 1, std::memory_order_acquire))
+					return;
+
+				std::this_thread::yield();
+			}
+		}
+
+		static void Unlock(Bucket& b)
+		{
+			std::atomic_ref<uint32_t>(b.sequence).fetch_add(1, std::memory_order_release);
+		}
+
+	public:
+
+		//buckets: table size for a new file, rounded up to a power of two. The file is sparse until filled.
+		//
+
+		OptimisticIndex(std::string_view path, uint64_t count = 4 * 1024 * 1024)
+		{
+			bool created = false;
+
+			if (!std::filesystem::exists(path) || !std::filesystem::file_size(path))
+			{
+				count = std::max(uint64_t(1), count);
+
+				uint64_t rounded = 1;
+				while (rounded < count)
+					rounded <<= 1;
+
+				created = true;
+
+				Header h = { magic_t, rounded };
+				std::ofstream(std::string(path), std::ios::binary).write((const char*)&h, sizeof(h));
+				std::filesystem::resize_file(path, sizeof(Header) + rounded * sizeof(Bucket));
+			}
+
+			map = mio::mmap_sink(std::string(path));
+
+			if (map.size() < sizeof(Header) || ((Header*)map.data())->magic != magic_t)
+				throw ForeignIndex(path);
+
+			auto& h = *((Header*)map.data());
+
+			if (map.size() != sizeof(Header) + h.buckets * sizeof(Bucket))
+				throw std::runtime_error("Bad index file " + std::string(path));
+
+			buckets = (Bucket*)(map.data() + sizeof(Header));
+			mask = h.buckets - 1;
+
+			//A writer that died mid insert leaves its bucket odd, readers would wait on it forever. A new file is all holes, nothing to check:
+			//
+
+			uint64_t used = 0;
+
+			for (uint64_t i = 0; i <= mask && !created; i++)
+			{
+				if (buckets[i].sequence & 1)
+				{
+					buckets[i].sequence++;
+					reset++;
+				}
+
+				used += buckets[i].used;
+			}
+
+			size = used;
+		}
+
+		uint64_t* FindLock(const tdb::Key32& k)
+		{
+			uint64_t b = Home(k);
+
+			for (uint64_t probe = 0; probe <= mask; probe++, b = (b + 1) & mask)
+			{
+				auto& bucket = buckets[b];
+				std::atomic_ref<uint32_t> sequence(bucket.sequence);
+
+				while (true)
+				{
+					uint32_t before = sequence.load(std::memory_order_acquire);
+
+					if (before & 1)
+					{
+						std::this_thread::yield();
+						continue;
+					}
+
+					uint32_t used = std::min((uint32_t)slots_t, std::atomic_ref<uint32_t>(bucket.used).load(std::memory_order_relaxed));
+					int found = -1;
+
+					for (uint32_t i = 0; i < used && found == -1; i++)
+						if (!std::memcmp(&bucket.slots[i].key, &k, sizeof(tdb::Key32)))
+							found = (int)i;
+
+					std::atomic_thread_fence(std::memory_order_acquire);
+
+					if (sequence.load(std::memory_order_relaxed) != before)
+						continue; //Raced an insert.
+
+					if (found != -1)
+						return &bucket.slots[found].value;
+
+					if (used < slots_t)
+						return nullptr;
+
+					break;
+				}
+			}
+
+			return nullptr;
+		}
+
+		void Prefetch(const tdb::Key32& k) const
+		{
+			prefetch(buckets + Home(k));
+		}
+
+		std::pair<uint64_t*, bool> InsertLock(const tdb::Key32& k, uint64_t v)
+		{
+			uint64_t b = Home(k);
+			std::lock_guard<std::mutex> lck(stripes[b % stripes_t]);
+
+			for (uint64_t probe = 0; probe <= mask; probe++, b = (b + 1) & mask)
+			{
+				auto& bucket = buckets[b];
+				Lock(bucket);
+
+				for (uint32_t i = 0; i < bucket.used; i++)
+				{
+					if (!std::memcmp(&bucket.slots[i].key, &k, sizeof(tdb::Key32)))
+					{
+						Unlock(bucket);
+						return std::make_pair(&bucket.slots[i].value, true);
+					}
+				}
+
+				if (bucket.used < slots_t)
+				{
+					auto& slot = bucket.slots[bucket.used];
+
+					slot.key = k;
+					slot.value = v;
+					std::atomic_ref<uint32_t>(bucket.used).fetch_add(1, std::memory_order_release);
+					size.fetch_add(1, std::memory_order_relaxed);
+
+					Unlock(bucket);
+					return std::make_pair(&slot.value, false);
+				}
+
+				Unlock(bucket);
+			}
+
+			throw std::runtime_error("Index is full");
+		}
+
+		//Keys held and keys the table was sized for, the table fills up well before Size() reaches Capacity().
+		//
+
+		uint64_t Size() const { return size.load(std::memory_order_relaxed); }
+		uint64_t Capacity() const { return (mask + 1) * slots_t; }
+		uint64_t Buckets() const { return mask + 1; }
+
+		OptimisticIndex& Table() { return *this; }
+
+		//Safe beside inserts, a slot is counted in used only once it is filled.
+		//
+
+		static uint32_t Used(Bucket& b)
+		{
+			return std::min((uint32_t)slots_t, std::atomic_ref<uint32_t>(b.used).load(std::memory_order_acquire));
+		}
+
+		template < typename F > void Iterate(F&& f)
+		{
+			for (uint64_t b = 0; b <= mask; b++)
+				for (uint32_t i = 0, used = Used(buckets[b]); i < used; i++)
+					if (!f(buckets[b].slots[i].value))
+						return;
+		}
+
+		template < typename F > void IterateKeys(F&& f)
+		{
+			for (uint64_t b = 0; b <= mask; b++)
+				for (uint32_t i = 0, used = Used(buckets[b]); i < used; i++)
+					if (!f(buckets[b].slots[i].key, buckets[b].slots[i].value))
+						return;
+		}
+
+		//Buckets found mid insert when the file was opened, they are reset then.
+		//
+
+		size_t ResetNodeLocks() { return reset; }
+
+		void Flush()
+		{
+			std::error_code error;
+			map.sync(error);
+		}
+	};
+
+	/*
+		Compact block index for stores whose key count outgrows memory, a drop in for tdb::LargeHashmapSafe.
+
+		Buckets hold six slots of a 16 bit fingerprint and the value in one 64 byte line, about 11 bytes a key against
+		the 40 a full key map needs. The full keys live in a second file, index.keys.db, at the slot's position. It is
+		only read to confirm a fingerprint match, so unknown keys almost never touch it. Reads and inserts follow
+		OptimisticIndex: a sequence number per bucket, striped insert locks, slots that never move.
+	*/
+
+	class FingerprintIndex
+	{
+		static uint64_t constexpr magic_t = 0xD8B1F9E700000001;
+		static size_t constexpr slots_t = 6;
+		static size_t constexpr stripes_t = 1024;
+
+		struct alignas(64) Bucket
+		{
+			uint32_t sequence;
+			uint16_t fingerprints[slots_t];	//Zero is an empty slot.
+			uint64_t values[slots_t];
+		};
+
+		struct alignas(64) Header
+		{
+			uint64_t magic;
+			uint64_t buckets;
+		};
+
+		static_assert(sizeof(Bucket) == 64, "Bucket layout changed");
+
+		mio::mmap_sink map;
+		mio::mmap_sink keys;
+		Bucket* buckets = nullptr;
+		uint64_t mask = 0;
+
+		std::mutex stripes[stripes_t];
+		size_t reset = 0;
+		std::atomic<uint64_t> size = 0;
+
+		uint64_t Home(const tdb::Key32& k) const
+		{
+			uint64_t h;
+			std::memcpy(&h, &k, sizeof(h));
+
+			return h & mask;
+		}
+
+		//From key bytes neither the home bucket, the filter nor the shard use.
+		//
+
+		static uint16_t Fingerprint(const tdb::Key32& k)
+		{
+			uint16_t f;
+			std::memcpy(&f, (const uint8_t*)&k + 28, sizeof(f));
+
+			return (f) ? f : 1;
+		}
+
+		tdb::Key32& Key(uint64_t bucket, size_t slot)
+		{
+			return *((tdb::Key32*)keys.data() + bucket * slots_t + slot);
+		}
+
+		static uint16_t Load(const uint16_t& f, std::memory_order order = std::memory_order_relaxed)
+		{
+			return std::atomic_ref<uint16_t>(const_cast<uint16_t&>(f)).load(order);
+		}
+
+		static void Lock(Bucket& b)
+		{
+			std::atomic_ref<uint32_t> sequence(b.sequence);
+
+			while (true)
+			{
+				uint32_t s = sequence.load(std::memory_order_relaxed);
+
+				if (!(s & 1) && sequence.compare_exchange_weak(s, s + 1, std::memory_order_acquire))
+					return;
+
+				std::this_thread::yield();
+			}
+		}
+
+		static void Unlock(Bucket& b)
+		{
+			std::atomic_ref<uint32_t>(b.sequence).fetch_add(1, std::memory_order_release);
+		}
+
+		static mio::mmap_sink Open(const std::string& path, uint64_t size)
+		{
+			if (!std::filesystem::exists(path) || std::filesystem::file_size(path) < size)
+			{
+				std::ofstream(path, std::ios::binary | std::ios::app);
+				std::filesystem::resize_file(path, size);
+			}
+
+			return mio::mmap_sink(path);
+		}
+
+	public:
+
+		//buckets: table size for a new file, rounded up to a power of two. Both files are sparse until filled.
+		//
+
+		FingerprintIndex(std::string_view path, uint64_t count = 4 * 1024 * 1024)
+		{
+			std::filesystem::path p(path);
+			bool created = false;
+
+			if (!std::filesystem::exists(p) || !std::filesystem::file_size(p))
+			{
+				count = std::max(uint64_t(1), count);
+
+				uint64_t rounded = 1;
+				while (rounded < count)
+					rounded <<= 1;
+
+				created = true;
+
+				Header h = { magic_t, rounded };
+				std::ofstream(p.string(), std::ios::binary).write((const char*)&h, sizeof(h));
+				std::filesystem::resize_file(p, sizeof(Header) + rounded * sizeof(Bucket));
+			}
+
+			map = mio::mmap_sink(p.string());
+
+			if (map.size() < sizeof(Header) || ((Header*)map.data())->magic != magic_t)
+				throw ForeignIndex(p.string());
+
+			auto& h = *((Header*)map.data());
+
+			if (map.size() != sizeof(Header) + h.buckets * sizeof(Bucket))
+				throw std::runtime_error("Bad index file " + p.string());
+
+			buckets = (Bucket*)(map.data() + sizeof(Header));
+			mask = h.buckets - 1;
+
+			keys = Open((p.parent_path() / (p.stem().string() + ".keys" + p.extension().string())).string(), h.buckets * slots_t * sizeof(tdb::Key32));
+
+			uint64_t used = 0;
+
+			for (uint64_t i = 0; i <= mask && !created; i++)
+			{
+				if (buckets[i].sequence & 1)
+				{
+					buckets[i].sequence++;
+					reset++;
+				}
+
+				for (size_t j = 0; j < slots_t && buckets[i].fingerprints[j]; j++)
+					used++;
+			}
+
+			size = used;
+		}
+
+		uint64_t* FindLock(const tdb::Key32& k)
+		{
+			uint64_t b = Home(k);
+			uint16_t f = Fingerprint(k);
+
+			for (uint64_t probe = 0; probe <= mask; probe++, b = (b + 1) & mask)
+			{
+				auto& bucket = buckets[b];
+				std::atomic_ref<uint32_t> sequence(bucket.sequence);
+
+				while (true)
+				{
+					uint32_t before = sequence.load(std::memory_order_acquire);
+
+					if (before & 1)
+					{
+						std::this_thread::yield();
+						continue;
+					}
+
+					uint16_t fingerprints[slots_t];
+
+					for (size_t i = 0; i < slots_t; i++)
+						fingerprints[i] = Load(bucket.fingerprints[i]);
+
+					std::atomic_thread_fence(std::memory_order_acquire);
+
+					if (sequence.load(std::memory_order_relaxed) != before)
+						continue; //Raced an insert.
+
+					//Keys are written before their fingerprint and never change after:
+					//
+
+					for (size_t i = 0; i < slots_t; i++)
+					{
+						if (!fingerprints[i])
+							return nullptr;
+
+						if (fingerprints[i] == f && !std::memcmp(&Key(b, i), &k, sizeof(tdb::Key32)))
+							return &bucket.values[i];
+					}
+
+					break;
+				}
+			}
+
+			return nullptr;
+		}
+
+		void Prefetch(const tdb::Key32& k) const
+		{
+			prefetch(buckets + Home(k));
+		}
+
+		std::pair<uint64_t*, bool> InsertLock(const tdb::Key32& k, uint64_t v)
+		{
+			uint64_t b = Home(k);
+			uint16_t f = Fingerprint(k);
+
+			std::lock_guard<std::mutex> lck(stripes[b % stripes_t]);
+
+			for (uint64_t probe = 0; probe <= mask; probe++, b = (b + 1) & mask)
+			{
+				auto& bucket = buckets[b];
+				Lock(bucket);
+
+				for (size_t i = 0; i < slots_t; i++)
+				{
+					if (!bucket.fingerprints[i])
+					{
+						Key(b, i) = k;
+						bucket.values[i] = v;
+						std::atomic_ref<uint16_t>(bucket.fingerprints[i]).store(f, std::memory_order_release);
+						size.fetch_add(1, std::memory_order_relaxed);
+
+						Unlock(bucket);
+						return std::make_pair(&bucket.values[i], false);
+					}
+
+					if (bucket.fingerprints[i] == f && !std::memcmp(&Key(b, i), &k, sizeof(tdb::Key32)))
+					{
+						Unlock(bucket);
+						return std::make_pair(&bucket.values[i], true);
+					}
+				}
+
+				Unlock(bucket);
+			}
+
+			throw std::runtime_error("Index is full");
+		}
+
+		//As OptimisticIndex.
+		//
+
+		uint64_t Size() const { return size.load(std::memory_order_relaxed); }
+		uint64_t Capacity() const { return (mask + 1) * slots_t; }
+		uint64_t Buckets() const { return mask + 1; }
+
+		FingerprintIndex& Table() { return *this; }
+
+		template < typename F > void Iterate(F&& f)
+		{
+			for (uint64_t b = 0; b <= mask; b++)
+				for (size_t i = 0; i < slots_t && Load(buckets[b].fingerprints[i], std::memory_order_acquire); i++)
+					if (!f(buckets[b].values[i]))
+						return;
+		}
+
+		template < typename F > void IterateKeys(F&& f)
+		{
+			for (uint64_t b = 0; b <= mask; b++)
+				for (size_t i = 0; i < slots_t && Load(buckets[b].fingerprints[i], std::memory_order_acquire); i++)
+					if (!f(Key(b, i), buckets[b].values[i]))
+						return;
+		}
+
+		size_t ResetNodeLocks() { return reset; }
+
+		void Flush()
+		{
+			std::error_code error;
+
+			keys.sync(error);
+			map.sync(error);
+		}
+	};
+
+	/*
+		Block index that grows without stopping the world, over tables that can't: OptimisticIndex or FingerprintIndex.
+
+		Tables are never rehashed. Once the newest one is half full a background thread creates the next, twice its
+		size, as index.level<n>.db beside index.db, and new keys go there once the newest is three quarters full. Keys
+		and values never move, the value pointers handed out stay valid as with the tables themselves. Lookups probe
+		newest first, each table holds more keys than all older ones together, so a hit costs about two probes and
+		growth costs inserts and lookups nothing but that. An existing index.db of the same table type is carried over as
+		the first table, one of another type is refused, see ForeignIndex.
+	*/
+
+	template < typename MAP = OptimisticIndex > class GrowingIndex
+	{
+		static size_t constexpr levels_t = 40;
+		static size_t constexpr stripes_t = 1024;
+
+		std::filesystem::path base;
+
+		std::unique_ptr<MAP> tables[levels_t];
+		std::atomic<size_t> levels = 0;
+
+		std::unique_ptr<MAP> next;
+		std::atomic<bool> ready = false;
+
+		std::mutex stripes[stripes_t];
+
+		std::mutex grow_lock;
+		std::condition_variable grow;
+		std::atomic<bool> running = true;
+		std::thread grower;
+
+		std::string Path(size_t level) const
+		{
+			if (!level)
+				return base.string();
+
+			return (base.parent_path() / (base.stem().string() + ".level" + std::to_string(level) + base.extension().string())).string();
+		}
+
+		size_t Stripe(const tdb::Key32& k) const
+		{
+			uint64_t h;
+			std::memcpy(&h, &k, sizeof(h));
+
+			return h % stripes_t;
+		}
+
+		//Load at which the next table is made and at which inserts move to it, in quarters.
+		//
+
+		static bool Past(const MAP& t, uint64_t quarters)
+		{
+			return t.Size() * 4 >= t.Capacity() * quarters;
+		}
+
+		//Call under grow_lock.
+		//
+
+		void Prepare()
+		{
+			size_t n = levels.load(std::memory_order_relaxed);
+
+			if (next || n == levels_t)
+				return;
+
+			next = std::make_unique<MAP>(Path(n), tables[n - 1]->Buckets() * 2);
+			ready.store(true, std::memory_order_release);
+		}
+
+		//Makes the prepared table the newest, unless another thread already moved past seen.
+		//
+
+		void Publish(size_t seen)
+		{
+			std::lock_guard<std::mutex> lck(grow_lock);
+
+			if (levels.load(std::memory_order_relaxed) != seen)
+				return;
+
+			Prepare();
+
+			if (!next)
+				throw std::runtime_error("Index is full");
+
+			tables[seen] = std::move(next);
+			ready.store(false, std::memory_order_relaxed);
+			levels.store(seen + 1, std::memory_order_release);
+		}
+
+	public:
+
+		//buckets: size of the first table of a new index.
+		//
+
+		GrowingIndex(std::string_view path, uint64_t buckets = 4 * 1024 * 1024)
+			: base(path)
+		{
+			size_t n = 0;
+
+			tables[n++] = std::make_unique<MAP>(Path(0), buckets);
+
+			while (n < levels_t && std::filesystem::exists(Path(n)))
+			{
+				tables[n] = std::make_unique<MAP>(Path(n));
+				n++;
+			}
+
+			levels = n;
+
+			grower = std::thread([&]()
+			{
+				std::unique_lock<std::mutex> lck(grow_lock);
+
+				while (running)
+				{
+					grow.wait_for(lck, std::chrono::milliseconds(1000));
+
+					if (running && Past(*tables[levels - 1], 2))
+						Prepare();
+				}
+			});
+		}
+
+		~GrowingIndex()
+		{
+			{
+				std::lock_guard<std::mutex> lck(grow_lock);
+				running = false;
+			}
+
+			grow.notify_all();
+			grower.join();
+		}
+
+		uint64_t* FindLock(const tdb::Key32& k)
+		{
+			for (size_t i = levels.load(std::memory_order_acquire); i > 0; i--)
+				if (auto v = tables[i - 1]->FindLock(k))
+					return v;
+
+			return nullptr;
+		}
+
+		//Only the newest table, it holds most keys.
+		//
+
+		void Prefetch(const tdb::Key32& k) const requires PrefetchIndex<MAP>
+		{
+			tables[levels.load(std::memory_order_acquire) - 1]->Prefetch(k);
+		}
+
+		std::pair<uint64_t*, bool> InsertLock(const tdb::Key32& k, uint64_t v)
+		{
+			std::lock_guard<std::mutex> lck(stripes[Stripe(k)]);
+
+			size_t checked = 0;
+
+			while (true)
+			{
+				size_t n = levels.load(std::memory_order_acquire);
+
+				for (; checked + 1 < n; checked++)
+					if (auto existing = tables[checked]->FindLock(k))
+						return std::make_pair(existing, true);
+
+				auto& newest = *tables[n - 1];
+
+				if (Past(newest, 3) && (ready.load(std::memory_order_acquire) || Past(newest, 4)))
+				{
+					Publish(n);
+					continue;
+				}
+
+				if (Past(newest, 2) && !ready.load(std::memory_order_relaxed))
+					grow.notify_one();
+
+				try
+				{
+					return newest.InsertLock(k, v);
+				}
+				catch (const std::runtime_error&)
+				{
+					Publish(n); //Filled up before its size said so.
+				}
+			}
+		}
+
+		GrowingIndex& Table() { return *this; }
+
+		template < typename F > void Iterate(F&& f)
+		{
+			bool more = true;
+
+			for (size_t i = 0; i < levels.load(std::memory_order_acquire) && more; i++)
+				tables[i]->Iterate([&](auto& v) { return more = f(v); });
+		}
+
+		template < typename F > void IterateKeys(F&& f) requires KeyedIndex<MAP>
+		{
+			bool more = true;
+
+			for (size_t i = 0; i < levels.load(std::memory_order_acquire) && more; i++)
+				tables[i]->IterateKeys([&](auto& k, auto& v) { return more = f(k, v); });
+		}
+
+		size_t Levels() const { return levels.load(std::memory_order_acquire); }
+
+		size_t ResetNodeLocks()
+		{
+			size_t result = 0;
+
+			for (size_t i = 0; i < levels.load(std::memory_order_acquire); i++)
+				result += tables[i]->ResetNodeLocks();
+
+			return result;
+		}
+
+		void Flush()
+		{
+			for (size_t i = 0; i < levels.load(std::memory_order_acquire); i++)
+				tables[i]->Flush();
+		}
+	};
+
+	/*
+		Batched FindLock. Keys are looked up in groups: the filter blocks of a group are prefetched, then the index buckets of
+		the keys the filter lets through, then the group is probed. The cache misses of a group overlap instead of each probe
+		waiting on the last. result[i] is null for a miss, returns how many keys the filter answered on its own.
+
+		The bucket prefetch needs a PrefetchIndex. Over a tdb table only the filter half applies and the probes of a group
+		still miss one after another, use OptimisticIndex or FingerprintIndex where batched lookups matter.
+	*/
+
+	template < typename DB, typename FILTER > size_t FindMany(DB& db, const FILTER& filter, const tdb::Key32* keys, size_t count, uint64_t** result)
+	{
+		static size_t constexpr group_t = 16;
+
+		size_t negatives = 0;
+		bool maybe[group_t];
+
+		for (size_t g = 0; g < count; g += group_t)
+		{
+			size_t end = std::min(count, g + group_t);
+
+			for (size_t i = g; i < end; i++)
+				filter.Prefetch(keys[i]);
+
+			for (size_t i = g; i < end; i++)
+			{
+				maybe[i - g] = filter.Maybe(keys[i]);
+
+				if (!maybe[i - g])
+					negatives++;
+				else if constexpr (PrefetchIndex<DB>)
+					db.Prefetch(keys[i]);
+			}
+
+			for (size_t i = g; i < end; i++)
+				result[i] = (maybe[i - g]) ? db.FindLock(keys[i]) : nullptr;
+		}
+
+		return negatives;
+	}
+
+	struct NoFilter
+	{
+		void Prefetch(const tdb::Key32&) const {}
+		bool Maybe(const tdb::Key32&) const { return true; }
+	};
+
+	template < typename DB > void FindMany(DB& db, const tdb::Key32* keys, size_t count, uint64_t** result)
+	{
+		FindMany(db, NoFilter(), keys, count, result);
+	}
+}
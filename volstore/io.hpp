@@ -0,0 +1,874 @@
+/* Copyright (C) 2020 D8DATAWORKS - All Rights Reserved */
+
+#pragma once
+
+#include <string_view>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <stdexcept>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+#include <thread>
+#include <condition_variable>
+#include <exception>
+#include <algorithm>
+#include <chrono>
+#include <new>
+#include <cstring>
+#include <filesystem>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <climits>
+#include <cstdio>
+#endif
+
+namespace volstore
+{
+	namespace io
+	{
+		using namespace std;
+
+		//Offsets, lengths and buffers of direct I/O are multiples of this, it covers 512 byte and 4K sector drives.
+		//
+		static size_t constexpr direct_block_t = 4096;
+
+		inline uint64_t align(uint64_t n) { return (n + direct_block_t - 1) & ~(uint64_t)(direct_block_t - 1); }
+
+		/*
+			Heap buffer aligned for direct I/O. Reserve grows it without keeping the contents.
+		*/
+
+		class AlignedBuffer
+		{
+			uint8_t* buffer = nullptr;
+			size_t capacity = 0;
+
+			void Free()
+			{
+				if (buffer)
+					::operator delete(buffer, std::align_val_t(direct_block_t));
+
+				buffer = nullptr;
+				capacity = 0;
+			}
+
+		public:
+
+			AlignedBuffer() {}
+
+			AlignedBuffer(const AlignedBuffer&) = delete;
+			AlignedBuffer& operator=(const AlignedBuffer&) = delete;
+
+			~AlignedBuffer()
+			{
+				Free();
+			}
+
+			uint8_t* data() { return buffer; }
+
+			size_t size() const { return capacity; }
+
+			void Reserve(size_t n)
+			{
+				if (n <= capacity)
+					return;
+
+				Free();
+
+				capacity = (size_t)align(n);
+				buffer = (uint8_t*)::operator new(capacity, std::align_val_t(direct_block_t));
+			}
+		};
+
+		/*
+			Positional file access. No shared file pointer is touched, so a single descriptor
+			can be used by any number of threads at once.
+
+			A direct handle bypasses the page cache. Reads of any range still work, unaligned ones go through a staging
+			buffer. Writes must be whole aligned blocks, GroupWriter takes care of that.
+		*/
+
+		class File
+		{
+#ifdef _WIN32
+			HANDLE handle = INVALID_HANDLE_VALUE;
+#else
+			int fd = -1;
+#endif
+			bool direct = false;
+
+			static bool Aligned(uint64_t offset, const void* p, size_t size)
+			{
+				return !(offset % direct_block_t) && !(size % direct_block_t) && !((uintptr_t)p % direct_block_t);
+			}
+
+			//Reads the aligned blocks around [offset, offset + na + nb) and hands out the range, split over a and b.
+			//
+
+			size_t Staged(uint64_t offset, void* a, size_t na, void* b = nullptr, size_t nb = 0) const
+			{
+				static thread_local AlignedBuffer buffer;
+
+				uint64_t start = offset & ~(uint64_t)(direct_block_t - 1);
+				size_t skip = (size_t)(offset - start);
+				size_t length = (size_t)align(offset + na + nb - start);
+
+				buffer.Reserve(length);
+
+				size_t count = Read(start, buffer.data(), length);
+				count = (count > skip) ? std::min(count - skip, na + nb) : 0;
+
+				std::memcpy(a, buffer.data() + skip, std::min(count, na));
+
+				if (count > na)
+					std::memcpy(b, buffer.data() + skip + na, count - na);
+
+				return count;
+			}
+
+		public:
+
+			File() {}
+
+			File(string_view path, bool write = false, bool _direct = false)
+			{
+				Open(path, write, _direct);
+			}
+
+			File(const File&) = delete;
+			File& operator=(const File&) = delete;
+
+			File(File&& r) noexcept
+			{
+				*this = std::move(r);
+			}
+
+			File& operator=(File&& r) noexcept
+			{
+				std::swap(Handle(), r.Handle());
+				std::swap(direct, r.direct);
+				return *this;
+			}
+
+			//False when the file system refused direct I/O and the handle is buffered.
+			//
+
+			bool Direct() const { return direct; }
+
+			~File()
+			{
+				Close();
+			}
+
+#ifdef _WIN32
+			HANDLE& Handle() { return handle; }
+
+			bool IsOpen() const { return handle != INVALID_HANDLE_VALUE; }
+
+			void Open(string_view path, bool write = false, bool _direct = false)
+			{
+				Close();
+
+				handle = CreateFileA(string(path).c_str(), (write) ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ
+					, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, (write) ? OPEN_ALWAYS : OPEN_EXISTING
+					, FILE_ATTRIBUTE_NORMAL | ((_direct) ? FILE_FLAG_NO_BUFFERING : 0), NULL);
+
+				if (handle == INVALID_HANDLE_VALUE)
+					throw runtime_error("Failed to open " + string(path));
+
+				direct = _direct;
+			}
+
+			void Close()
+			{
+				if (handle != INVALID_HANDLE_VALUE)
+					CloseHandle(handle);
+
+				handle = INVALID_HANDLE_VALUE;
+			}
+
+			size_t Read(uint64_t offset, void* dest, size_t size) const
+			{
+				if (direct && !Aligned(offset, dest, size))
+					return Staged(offset, dest, size);
+
+				size_t total = 0;
+
+				while (total < size)
+				{
+					OVERLAPPED o = {};
+					o.Offset = (DWORD)(offset + total);
+					o.OffsetHigh = (DWORD)((offset + total) >> 32);
+
+					DWORD count = 0;
+					DWORD request = (DWORD)std::min(size - total, (size_t)1024 * 1024 * 1024);
+
+					if (!ReadFile(handle, (uint8_t*)dest + total, request, &count, &o) || !count)
+						break;
+
+					total += count;
+				}
+
+				return total;
+			}
+
+			//Scatter read of a contiguous range into two buffers, typically a record header and its payload.
+			//
+
+			size_t Read(uint64_t offset, void* a, size_t na, void* b, size_t nb) const
+			{
+				auto total = Read(offset, a, na);
+
+				if (total < na)
+					return total;
+
+				return total + Read(offset + na, b, nb);
+			}
+
+			size_t Write(uint64_t offset, const void* src, size_t size) const
+			{
+				size_t total = 0;
+
+				while (total < size)
+				{
+					OVERLAPPED o = {};
+					o.Offset = (DWORD)(offset + total);
+					o.OffsetHigh = (DWORD)((offset + total) >> 32);
+
+					DWORD count = 0;
+					DWORD request = (DWORD)std::min(size - total, (size_t)1024 * 1024 * 1024);
+
+					if (!WriteFile(handle, (const uint8_t*)src + total, request, &count, &o) || !count)
+						throw runtime_error("Write failed");
+
+					total += count;
+				}
+
+				return total;
+			}
+
+			//Gather write of consecutive buffers starting at offset.
+			//
+
+			template < typename IT > void Write(uint64_t offset, IT begin, IT end) const
+			{
+				for (auto i = begin; i != end; i++)
+					offset += Write(offset, i->data(), i->size());
+			}
+
+			void Sync() const
+			{
+				if (!FlushFileBuffers(handle))
+					throw runtime_error("Sync failed");
+			}
+
+			uint64_t Size() const
+			{
+				LARGE_INTEGER size;
+
+				if (!GetFileSizeEx(handle, &size))
+					return 0;
+
+				return (uint64_t)size.QuadPart;
+			}
+#else
+			int& Handle() { return fd; }
+
+			bool IsOpen() const { return fd != -1; }
+
+			void Open(string_view path, bool write = false, bool _direct = false)
+			{
+				Close();
+
+				int flags = (write) ? O_RDWR | O_CREAT : O_RDONLY;
+				direct = false;
+
+#ifdef O_DIRECT
+				//File systems without direct I/O refuse the flag, the file is then used buffered:
+				//
+
+				if (_direct)
+				{
+					fd = ::open(string(path).c_str(), flags | O_DIRECT, 0644);
+					direct = fd != -1;
+				}
+#endif
+
+				if (fd == -1)
+					fd = ::open(string(path).c_str(), flags, 0644);
+
+				if (fd == -1)
+					throw runtime_error("Failed to open " + string(path));
+
+#ifdef __APPLE__
+				if (_direct)
+					::fcntl(fd, F_NOCACHE, 1);
+#endif
+			}
+
+			void Close()
+			{
+				if (fd != -1)
+					::close(fd);
+
+				fd = -1;
+			}
+
+			size_t Read(uint64_t offset, void* dest, size_t size) const
+			{
+				if (direct && !Aligned(offset, dest, size))
+					return Staged(offset, dest, size);
+
+				size_t total = 0;
+
+				while (total < size)
+				{
+					auto count = ::pread(fd, (uint8_t*)dest + total, size - total, (off_t)(offset + total));
+
+					if (count <= 0)
+						break;
+
+					total += (size_t)count;
+				}
+
+				return total;
+			}
+
+			//Scatter read of a contiguous range into two buffers, typically a record header and its payload.
+			//One syscall in the common case.
+			//
+
+			size_t Read(uint64_t offset, void* a, size_t na, void* b, size_t nb) const
+			{
+				if (direct)
+					return Staged(offset, a, na, b, nb);
+
+				iovec v[2] = { { a, na }, { b, nb } };
+
+				auto count = ::preadv(fd, v, 2, (off_t)offset);
+
+				if (count <= 0)
+					return 0;
+
+				size_t total = (size_t)count;
+
+				if (total < na)
+					return total + Read(offset + total, (uint8_t*)a + total, na - total);
+
+				if (total < na + nb)
+					return total + Read(offset + total, (uint8_t*)b + (total - na), na + nb - total);
+
+				return total;
+			}
+
+			size_t Write(uint64_t offset, const void* src, size_t size) const
+			{
+				size_t total = 0;
+
+				while (total < size)
+				{
+					auto count = ::pwrite(fd, (const uint8_t*)src + total, size - total, (off_t)(offset + total));
+
+					if (count <= 0)
+						throw runtime_error("Write failed");
+
+					total += (size_t)count;
+				}
+
+				return total;
+			}
+
+			//Gather write of consecutive buffers starting at offset, IOV_MAX buffers per syscall.
+			//
+
+			template < typename IT > void Write(uint64_t offset, IT begin, IT end) const
+			{
+				std::vector<iovec> v;
+				v.reserve(IOV_MAX);
+
+				while (begin != end)
+				{
+					v.clear();
+
+					for (; begin != end && v.size() < IOV_MAX; begin++)
+						v.push_back({ (void*)begin->data(), begin->size() });
+
+					size_t index = 0;
+
+					while (index < v.size())
+					{
+						auto count = ::pwritev(fd, v.data() + index, (int)std::min(v.size() - index, (size_t)IOV_MAX), (off_t)offset);
+
+						if (count <= 0)
+							throw runtime_error("Write failed");
+
+						offset += (uint64_t)count;
+
+						//Partial write, skip what landed and resume mid buffer:
+						//
+
+						while (index < v.size() && (size_t)count >= v[index].iov_len)
+							count -= v[index++].iov_len;
+
+						if (index < v.size())
+						{
+							v[index].iov_base = (uint8_t*)v[index].iov_base + count;
+							v[index].iov_len -= count;
+						}
+					}
+				}
+			}
+
+			void Sync() const
+			{
+#ifdef __APPLE__
+				if (::fsync(fd) == -1)
+#else
+				if (::fdatasync(fd) == -1)
+#endif
+					throw runtime_error("Sync failed");
+			}
+
+			uint64_t Size() const
+			{
+				auto size = ::lseek(fd, 0, SEEK_END);
+
+				return (size < 0) ? 0 : (uint64_t)size;
+			}
+#endif
+		};
+
+		//Moves a synced temp file over path so that the rename survives a crash, the directory is synced after it.
+		//Windows writes the rename through instead.
+		//
+
+		inline void Replace(string_view temp, string_view path)
+		{
+#ifdef _WIN32
+			if (!MoveFileExA(string(temp).c_str(), string(path).c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+				throw runtime_error("Rename failed");
+#else
+			if (::rename(string(temp).c_str(), string(path).c_str()) == -1)
+				throw runtime_error("Rename failed");
+
+			auto directory = std::filesystem::path(path).parent_path();
+			int fd = ::open(directory.empty() ? "." : directory.c_str(), O_RDONLY | O_DIRECTORY);
+
+			if (fd == -1)
+				throw runtime_error("Sync failed");
+
+			auto result = ::fsync(fd);
+			::close(fd);
+
+			if (result == -1)
+				throw runtime_error("Sync failed");
+#endif
+		}
+
+		/*
+			A small set of long lived read descriptors shared by all event threads.
+			On Linux one descriptor does, pread doesn't serialize. Synchronous handles on Windows do, so there it is a set.
+		*/
+
+#ifdef _WIN32
+		static size_t constexpr readers_t = 8;
+#else
+		static size_t constexpr readers_t = 1;
+#endif
+
+		template < size_t N = readers_t > class ReadPool
+		{
+			File files[N];
+			std::atomic<size_t> next = 0;
+
+		public:
+
+			ReadPool(string_view path, bool direct = false)
+			{
+				for (auto& f : files)
+					f.Open(path, false, direct);
+			}
+
+			const File& Get()
+			{
+				return files[next++ % N];
+			}
+		};
+
+		/*
+			Bandwidth cap for background work. Call with the bytes just moved, sleeps whenever the caller is ahead of its budget.
+		*/
+
+		class Throttle
+		{
+			std::atomic<size_t>& rate;
+			std::chrono::steady_clock::time_point start;
+			uint64_t bytes = 0;
+
+		public:
+
+			Throttle(std::atomic<size_t>& _rate)
+				: rate(_rate)
+				, start(std::chrono::steady_clock::now()) { }
+
+			void operator()(size_t count)
+			{
+				bytes += count;
+
+				size_t limit = rate;
+
+				if (!limit)
+					return;
+
+				auto budget = std::chrono::microseconds(bytes * 1000000 / limit);
+				auto elapsed = std::chrono::steady_clock::now() - start;
+
+				if (budget > elapsed)
+					std::this_thread::sleep_for(budget - elapsed);
+
+				//Don't let an idle period bank an unbounded burst:
+				//
+
+				if (elapsed > std::chrono::seconds(10))
+				{
+					start = std::chrono::steady_clock::now();
+					bytes = 0;
+				}
+			}
+		};
+
+		/*
+			Group commit append log.
+
+			Writers reserve their offset with a single atomic add and queue the encoded record.
+			One flusher thread takes everything queued, writes each contiguous run with one gather write and
+			then syncs the file once for the whole batch. Append returns the batch ticket so a writer can
+			Wait for its record to be durable. Writers that arrive while a sync is in flight form the next batch.
+			A failed write or sync is kept and rethrown from Wait and every later Append, the flusher drops what it still holds.
+
+			Until the flusher has written a record it can be read back with Pending, so a block is readable the moment
+			its offset is handed out and not only once its batch lands.
+
+			In direct mode the file bypasses the page cache. Records stay packed: each batch is written as whole aligned
+			blocks, starting with the partial block the previous batch ended in and padded with zeros to the next
+			boundary, which the following batch then overwrites. A batch can only start where the file ends, so records
+			queued past an offset still being filled wait for the next batch. The tail is aligned on open.
+		*/
+
+		class GroupWriter
+		{
+			struct Entry
+			{
+				uint64_t offset;
+				std::vector<uint8_t> record;
+				uint64_t ticket;
+
+				const uint8_t* data() const { return record.data(); }
+				size_t size() const { return record.size(); }
+			};
+
+			File file;
+			std::atomic<uint64_t> tail;
+
+			std::mutex lock;
+			std::condition_variable pending_cv;
+			std::condition_variable durable_cv;
+
+			std::vector<Entry> queue;
+			uint64_t sequence = 0;
+
+			//First write or sync failure, once set nothing more is written and Wait and Append rethrow it.
+			//
+			std::exception_ptr error;
+
+			//Records not yet written by offset, the buffers are owned by queue or the batch being committed.
+			//
+			std::shared_mutex pending_lock;
+			std::unordered_map<uint64_t, std::pair<const uint8_t*, size_t>> pending;
+			std::atomic<size_t> pending_count = 0;
+			uint64_t durable = 0;
+
+			bool running = true;
+			std::thread flusher;
+
+			//Direct mode, flusher only: where the file data ends, the partial block it ends in and records held for the next batch.
+			//
+			bool direct;
+			uint64_t written = 0;
+			std::vector<uint8_t> partial;
+			std::vector<Entry> held;
+			AlignedBuffer stage;
+
+			void Landed(std::vector<Entry>& batch)
+			{
+				std::unique_lock<std::shared_mutex> lck(pending_lock);
+
+				for (auto& e : batch)
+					pending.erase(e.offset);
+
+				pending_count = pending.size();
+			}
+
+			//Returns the ticket of the last batch now wholly on disk.
+			//
+
+			uint64_t CommitDirect(std::vector<Entry>& batch, uint64_t ticket)
+			{
+				for (auto& e : held)
+					batch.push_back(std::move(e));
+
+				held.clear();
+
+				std::sort(batch.begin(), batch.end(), [](auto& l, auto& r) { return l.offset < r.offset; });
+
+				size_t n = 0;
+				uint64_t end = written;
+
+				while (n < batch.size() && batch[n].offset == end)
+					end += batch[n++].size();
+
+				held.assign(std::make_move_iterator(batch.begin() + n), std::make_move_iterator(batch.end()));
+				batch.erase(batch.begin() + n, batch.end());
+
+				if (n)
+				{
+					uint64_t start = written - partial.size();
+					size_t length = (size_t)align(end - start);
+
+					stage.Reserve(length);
+					std::memcpy(stage.data(), partial.data(), partial.size());
+
+					size_t at = partial.size();
+
+					for (auto& e : batch)
+					{
+						std::memcpy(stage.data() + at, e.data(), e.size());
+						at += e.size();
+					}
+
+					std::memset(stage.data() + at, 0, length - at);
+
+					file.Write(start, stage.data(), length);
+
+					size_t last = (size_t)(end % direct_block_t);
+					partial.assign(stage.data() + (end - last - start), stage.data() + (end - start));
+					written = end;
+				}
+
+				Landed(batch);
+				file.Sync();
+
+				for (auto& e : held)
+					ticket = std::min(ticket, e.ticket - 1);
+
+				return ticket;
+			}
+
+			uint64_t Commit(std::vector<Entry>& batch, uint64_t ticket)
+			{
+				if (direct)
+					return CommitDirect(batch, ticket);
+
+				std::sort(batch.begin(), batch.end(), [](auto& l, auto& r) { return l.offset < r.offset; });
+
+				auto run = batch.begin();
+
+				while (run != batch.end())
+				{
+					auto end = run + 1;
+					uint64_t next = run->offset + run->size();
+
+					while (end != batch.end() && end->offset == next)
+						next += (end++)->size();
+
+					file.Write(run->offset, run, end);
+
+					run = end;
+				}
+
+				Landed(batch);
+				file.Sync();
+
+				return ticket;
+			}
+
+		public:
+
+			//reserve: bytes at the start of a new file that are never handed out, so no record lives at offset zero.
+			//direct: bypass the page cache, see above.
+			//
+
+			GroupWriter(string_view path, uint64_t reserve = 0, bool _direct = false)
+				: file(path, true, _direct)
+				, tail(0)
+				, direct(_direct)
+			{
+				tail = std::max(file.Size(), First(reserve, direct));
+
+				if (direct)
+					tail = written = align(tail);
+
+				flusher = std::thread([&]()
+				{
+					std::vector<Entry> batch;
+
+					while (true)
+					{
+						uint64_t ticket;
+
+						{
+							std::unique_lock<std::mutex> lck(lock);
+							pending_cv.wait(lck, [&]() { return queue.size() || !running; });
+
+							if (!queue.size())
+								break;
+
+							std::swap(batch, queue);
+							ticket = ++sequence;
+						}
+
+						bool failed;
+
+						{
+							std::lock_guard<std::mutex> lck(lock);
+							failed = (bool)error;
+						}
+
+						if (!failed)
+						{
+							try
+							{
+								ticket = Commit(batch, ticket);
+							}
+							catch (...)
+							{
+								std::lock_guard<std::mutex> lck(lock);
+								error = std::current_exception();
+								failed = true;
+							}
+						}
+
+						if (failed)
+						{
+							Landed(batch);
+							Landed(held);
+							held.clear();
+						}
+
+						batch.clear();
+
+						{
+							std::lock_guard<std::mutex> lck(lock);
+
+							if (!failed)
+								durable = std::max(durable, ticket);
+						}
+
+						durable_cv.notify_all();
+					}
+				});
+			}
+
+			~GroupWriter()
+			{
+				{
+					std::lock_guard<std::mutex> lck(lock);
+					running = false;
+				}
+
+				pending_cv.notify_one();
+				flusher.join();
+			}
+
+			uint64_t Tail() const { return tail; }
+
+			//Tail of a writer opened on a new file, where its first record goes. A file no longer than this holds no records.
+			//
+
+			static uint64_t First(uint64_t reserve, bool direct) { return (direct) ? align(reserve) : reserve; }
+
+			//Returns the offset of the record and the ticket of the batch that will carry it.
+			//
+
+			std::pair<uint64_t, uint64_t> Append(std::vector<uint8_t>&& record)
+			{
+				{
+					std::lock_guard<std::mutex> lck(lock);
+
+					if (error)
+						std::rethrow_exception(error);
+				}
+
+				uint64_t offset = tail.fetch_add(record.size());
+				uint64_t ticket;
+
+				{
+					std::unique_lock<std::shared_mutex> lck(pending_lock);
+
+					pending.emplace(offset, std::make_pair(record.data(), record.size()));
+					pending_count = pending.size();
+				}
+
+				{
+					std::lock_guard<std::mutex> lck(lock);
+					ticket = sequence + 1;
+					queue.push_back(Entry{ offset, std::move(record), ticket });
+				}
+
+				pending_cv.notify_one();
+
+				return std::make_pair(offset, ticket);
+			}
+
+			//Copy of the record appended at offset if the flusher hasn't written it yet, empty otherwise.
+			//
+
+			std::vector<uint8_t> Pending(uint64_t offset)
+			{
+				if (!pending_count.load(std::memory_order_relaxed))
+					return std::vector<uint8_t>();
+
+				std::shared_lock<std::shared_mutex> lck(pending_lock);
+
+				auto i = pending.find(offset);
+
+				if (i == pending.end())
+					return std::vector<uint8_t>();
+
+				return std::vector<uint8_t>(i->second.first, i->second.first + i->second.second);
+			}
+
+			void Wait(uint64_t ticket)
+			{
+				std::unique_lock<std::mutex> lck(lock);
+				durable_cv.wait(lck, [&]() { return durable >= ticket || error; });
+
+				if (durable < ticket)
+					std::rethrow_exception(error);
+			}
+
+			//Wait for everything appended so far.
+			//
+
+			void Sync()
+			{
+				uint64_t ticket;
+
+				{
+					std::lock_guard<std::mutex> lck(lock);
+					ticket = sequence + ((queue.size()) ? 1 : 0);
+				}
+
+				Wait(ticket);
+			}
+		};
+	}
+}
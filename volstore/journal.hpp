@@ -0,0 +1,202 @@
+/* Copyright (C) 2020 D8DATAWORKS - All Rights Reserved */
+
+#pragma once
+
+#include <string_view>
+#include <string>
+#include <vector>
+#include <memory>
+#include <shared_mutex>
+#include <mutex>
+#include <filesystem>
+#include <algorithm>
+#include <cstring>
+
+#include "io.hpp"
+#include "location.hpp"
+#include "record.hpp"
+
+#include "tdb/legacy.hpp"
+
+namespace volstore
+{
+	/*
+		Index intent log.
+
+		Every index change is appended as a key / value pair once the data it points at has been queued, and the log
+		is group committed like the data. On startup the log left by the last run is replayed into the index, so the
+		hash map itself only has to be flushed at checkpoints. The log and the data files are synced independently, an
+		entry can land while its record didn't, so replay only applies entries whose record checks out.
+
+		A checkpoint switches appends to a new generation file, flushes the index and then deletes the older
+		generations. Changes are applied and logged under a shared Scope, which the switch waits out, so every entry
+		of a retired generation is already in the flushed index.
+	*/
+
+	class Journal
+	{
+#pragma pack(push, 1)
+		struct Entry
+		{
+			uint8_t key[32];
+			uint64_t value;
+			uint32_t crc;
+		};
+#pragma pack(pop)
+
+		std::string root;
+		uint64_t generation = 1;
+		std::unique_ptr<io::GroupWriter> writer;
+		std::shared_mutex lock;
+
+		static uint32_t Checksum(const Entry& e)
+		{
+			return crc32c::extend(0, &e, sizeof(Entry) - sizeof(uint32_t));
+		}
+
+		std::string Path(uint64_t g) const
+		{
+			return root + "/journal." + std::to_string(g) + ".db";
+		}
+
+		std::vector<uint64_t> Generations() const
+		{
+			std::vector<uint64_t> result;
+
+			for (auto& f : std::filesystem::directory_iterator(root))
+			{
+				auto name = f.path().filename().string();
+
+				if (name.size() > 11 && name.rfind("journal.", 0) == 0 && name.substr(name.size() - 3) == ".db")
+					result.push_back(std::stoull(name.substr(8, name.size() - 11)));
+			}
+
+			std::sort(result.begin(), result.end());
+
+			return result;
+		}
+
+	public:
+
+		Journal(std::string_view _root)
+			: root(_root)
+		{
+			auto existing = Generations();
+
+			if (existing.size())
+				generation = existing.back() + 1;
+
+			writer = std::make_unique<io::GroupWriter>(Path(generation));
+		}
+
+		std::shared_lock<std::shared_mutex> Scope()
+		{
+			return std::shared_lock<std::shared_mutex>(lock);
+		}
+
+		//Call inside a Scope, after the index entry has been set.
+		//
+
+		void Append(const void* key, uint64_t value)
+		{
+			std::vector<uint8_t> buffer(sizeof(Entry));
+			auto& e = *((Entry*)buffer.data());
+
+			std::memcpy(e.key, key, sizeof(e.key));
+			e.value = value;
+			e.crc = Checksum(e);
+
+			writer->Append(std::move(buffer));
+		}
+
+		//Wait for everything appended so far.
+		//
+
+		void Sync()
+		{
+			auto scope = Scope();
+			writer->Sync();
+		}
+
+		uint64_t Size()
+		{
+			auto scope = Scope();
+			return writer->Tail();
+		}
+
+		/*
+			Applies the generations left by the last run, oldest first. Where the index already has a value the newer
+			location wins, see record::age, and a delete wins over the write it deletes. durable(key, value) tells
+			whether the record the entry points at is on disk and carries its key, entries pointing into segments that
+			no longer exist or at records lost with a crash are dropped. added(key) sees every key applied.
+		*/
+
+		template < typename DB, typename V, typename A > size_t Replay(DB& db, uint64_t active, V&& durable, A&& added)
+		{
+			size_t count = 0;
+
+			for (auto g : Generations())
+			{
+				if (g >= generation)
+					break;
+
+				io::File file(Path(g));
+				std::vector<uint8_t> data(file.Size());
+				data.resize(file.Read(0, data.data(), data.size()));
+
+				for (size_t i = 0; i + sizeof(Entry) <= data.size(); i += sizeof(Entry))
+				{
+					Entry e;
+					std::memcpy(&e, data.data() + i, sizeof(Entry));
+
+					//Torn or never written, the batch carrying it wasn't synced:
+					//
+
+					if (e.crc != Checksum(e) || !e.value || !durable(*((tdb::Key32*)e.key), e.value))
+						continue;
+
+					auto res = db.InsertLock(*((tdb::Key32*)e.key), e.value);
+					added(*((tdb::Key32*)e.key));
+					count++;
+
+					if (!res.second)
+						continue;
+
+					uint64_t& current = *res.first;
+
+					if (!current || record::age(current, active) < record::age(e.value, active))
+						current = e.value;
+					else if (record::age(current, active) == record::age(e.value, active))
+						current |= e.value & location::tombstone;
+				}
+			}
+
+			return count;
+		}
+
+		//flush() makes the index durable.
+		//
+
+		template < typename F > void Checkpoint(F&& flush)
+		{
+			std::unique_ptr<io::GroupWriter> retired;
+			uint64_t last;
+
+			{
+				std::unique_lock<std::shared_mutex> lck(lock);
+
+				retired = std::move(writer);
+				last = generation++;
+				writer = std::make_unique<io::GroupWriter>(Path(generation));
+			}
+
+			retired.reset();
+
+			flush();
+
+			for (auto g : Generations())
+				if (g <= last)
+					std::filesystem::remove(Path(g));
+		}
+	};
+}
@@ -0,0 +1,64 @@
+/* Copyright (C) 2020 D8DATAWORKS - All Rights Reserved */
+
+#pragma once
+
+#include <cstdint>
+#include <atomic>
+#include <string>
+#include <string_view>
+
+namespace volstore
+{
+	/*
+		Index values are packed block locations:
+
+		[63..60] flags | [59..46] segment | [45..0] byte offset within the segment
+
+		Segment zero is the original image.dat, so values written before segments existed decode unchanged.
+		A value of zero is reserved for "not yet written".
+	*/
+
+	namespace location
+	{
+		static uint64_t constexpr offset_bits = 46;
+		static uint64_t constexpr segment_bits = 14;
+
+		static uint64_t constexpr offset_mask = (uint64_t(1) << offset_bits) - 1;
+		static uint64_t constexpr segment_mask = (uint64_t(1) << segment_bits) - 1;
+		static uint64_t constexpr segments_t = segment_mask + 1;
+
+		//Deleted blocks keep their location so the dead bytes can be accounted for until Flatten drops the entry.
+		//
+		static uint64_t constexpr tombstone = uint64_t(1) << 63;
+
+		//Set with tombstone when the scrubber finds the block damaged, so it reads as missing and the next write replaces it.
+		//
+		static uint64_t constexpr corrupt = uint64_t(1) << 62;
+
+		//Set by reads when the engine tiers its storage, the tiering sweep clears it. Not part of where the block is.
+		//
+		static uint64_t constexpr accessed = uint64_t(1) << 61;
+
+		inline bool live(uint64_t v) { return v && !(v & tombstone); }
+
+		//An index slot as lookups see it, writers store slots through atomic_ref so they are loaded the same way.
+		//
+		inline bool live_slot(uint64_t* slot) { return slot && live(std::atomic_ref<uint64_t>(*slot).load(std::memory_order_acquire)); }
+
+		inline uint64_t where(uint64_t v) { return v & ~accessed; }
+
+		inline uint64_t offset(uint64_t v) { return v & offset_mask; }
+
+		inline uint64_t segment(uint64_t v) { return (v >> offset_bits) & segment_mask; }
+
+		inline uint64_t make(uint64_t segment, uint64_t offset) { return (segment << offset_bits) | offset; }
+
+		inline std::string path(std::string_view root, uint64_t segment)
+		{
+			if (!segment)
+				return std::string(root) + "/image.dat";
+
+			return std::string(root) + "/image." + std::to_string(segment) + ".dat";
+		}
+	}
+}
@@ -0,0 +1,797 @@
+/* Copyright (C) 2020 D8DATAWORKS - All Rights Reserved */
+
+#pragma once
+
+#include <string_view>
+#include <string>
+#include <vector>
+#include <memory>
+#include <filesystem>
+#include <fstream>
+#include <algorithm>
+#include <execution>
+#include <unordered_map>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+
+#include "../mio.hpp"
+#include "io.hpp"
+#include "filter.hpp"
+
+#include "tdb/legacy.hpp"
+
+namespace volstore
+{
+	/*
+		Log structured block index for key counts far beyond memory, a drop in for tdb::LargeHashmapSafe.
+
+		New keys go to an in memory table. Once it holds memtable_t keys a background thread writes it out as a sorted
+		run and merges runs of similar size. A run keeps a fence key per 4K block and a Bloom filter in memory, so a
+		lookup reads at most one block of each run its filter can't rule out, and inserts of new keys rarely read at all.
+
+		Values don't live in the runs: every key owns a fixed slot in index.values.db and runs map keys to slots.
+		Merges only move keys, so the value pointers FindLock and InsertLock hand out stay valid for the life of the
+		index. Slots are handed out in order and keys reach runs in the same order, so the slots of keys that never
+		made it into a run are always the last ones and are handed out again after a crash.
+
+		index.db lists the runs and the slots they cover, it is rewritten whenever the runs change.
+	*/
+
+	class LsmIndex
+	{
+		static uint64_t constexpr magic_t = 0xD8B1F15300000001;
+		static uint64_t constexpr run_magic_t = 0xD8B1F15300000002;
+
+		static size_t constexpr memtable_t = 1024 * 1024;
+		static size_t constexpr ratio_t = 4;
+		static size_t constexpr stripes_t = 64;
+
+		static size_t constexpr chunk_bits_t = 24;
+		static size_t constexpr chunks_t = 65536;
+		static uint64_t constexpr chunk_bytes_t = (uint64_t(1) << chunk_bits_t) * sizeof(uint64_t);
+
+		//Smallest run filter, runs written at checkpoints can be tiny.
+		//
+		static size_t constexpr filter_t = 64 * 1024;
+
+		static size_t constexpr block_t = 4096;
+		static size_t constexpr buffer_t = 4 * 1024 * 1024;
+
+		struct Entry
+		{
+			tdb::Key32 key;
+			uint64_t slot;
+		};
+
+		static size_t constexpr per_block_t = block_t / sizeof(Entry);
+
+		static bool Less(const tdb::Key32& l, const tdb::Key32& r)
+		{
+			return std::memcmp(&l, &r, sizeof(tdb::Key32)) < 0;
+		}
+
+		struct KeyHash
+		{
+			size_t operator()(const tdb::Key32& k) const
+			{
+				size_t h;
+				std::memcpy(&h, &k, sizeof(h));
+
+				return h;
+			}
+		};
+
+		struct KeyEqual
+		{
+			bool operator()(const tdb::Key32& l, const tdb::Key32& r) const
+			{
+				return !std::memcmp(&l, &r, sizeof(tdb::Key32));
+			}
+		};
+
+		using Memtable = std::unordered_map<tdb::Key32, uint64_t, KeyHash, KeyEqual>;
+
+		struct Stripe
+		{
+			std::shared_mutex lock;
+			Memtable keys;
+		};
+
+		struct RunHeader
+		{
+			uint64_t magic;
+			uint64_t count;
+			uint64_t blocks;
+		};
+
+		/*
+			Run file: a header block, then blocks of sorted entries, then the fence keys. The filter is beside it in
+			<run>.filter and rebuilt from the entries when missing.
+		*/
+
+		class Run
+		{
+			std::unique_ptr<io::ReadPool<>> file;
+			std::vector<tdb::Key32> fences;
+			BloomFilter filter;
+
+		public:
+
+			std::string path;
+			uint64_t id;
+			uint64_t count = 0;
+			bool retired = false;	//Merged into another run, the file goes when the last reader lets go.
+
+			Run(std::string_view _path, uint64_t _id)
+				: file(std::make_unique<io::ReadPool<>>(_path))
+				, path(_path)
+				, id(_id)
+			{
+				RunHeader h = {};
+				file->Get().Read(0, &h, sizeof(h));
+
+				if (h.magic != run_magic_t)
+					throw std::runtime_error("Bad index run " + path);
+
+				count = h.count;
+				fences.resize(h.blocks);
+				file->Get().Read(block_t * (1 + h.blocks), fences.data(), fences.size() * sizeof(tdb::Key32));
+
+				if (!filter.Load(path + ".filter"))
+				{
+					filter.Reset(count, filter_t);
+					Scan([&](const Entry& e) { filter.Add(e.key); return true; });
+				}
+			}
+
+			~Run()
+			{
+				file.reset();
+
+				if (retired)
+				{
+					std::filesystem::remove(path);
+					std::filesystem::remove(path + ".filter");
+				}
+			}
+
+			bool Find(const tdb::Key32& k, uint64_t& slot) const
+			{
+				if (!filter.Maybe(k))
+					return false;
+
+				auto fence = std::upper_bound(fences.begin(), fences.end(), k, Less);
+
+				if (fence == fences.begin())
+					return false;
+
+				uint64_t block = (fence - fences.begin()) - 1;
+				size_t n = (size_t)std::min<uint64_t>(per_block_t, count - block * per_block_t);
+
+				Entry entries[per_block_t];
+				file->Get().Read(block_t * (1 + block), entries, n * sizeof(Entry));
+
+				auto e = std::lower_bound(entries, entries + n, k, [](const Entry& e, const tdb::Key32& k) { return Less(e.key, k); });
+
+				if (e == entries + n || std::memcmp(&e->key, &k, sizeof(tdb::Key32)))
+					return false;
+
+				slot = e->slot;
+
+				return true;
+			}
+
+			//Entries of the next buffer_t bytes of blocks from block on, returns the block after them.
+			//
+
+			uint64_t Load(uint64_t block, std::vector<Entry>& entries) const
+			{
+				uint64_t n = std::min<uint64_t>(buffer_t / block_t, fences.size() - block);
+
+				std::vector<uint8_t> buffer(n * block_t);
+				file->Get().Read(block_t * (1 + block), buffer.data(), buffer.size());
+
+				entries.clear();
+
+				for (uint64_t b = 0; b < n; b++)
+				{
+					size_t in_block = (size_t)std::min<uint64_t>(per_block_t, count - (block + b) * per_block_t);
+
+					for (size_t i = 0; i < in_block; i++)
+					{
+						entries.emplace_back();
+						std::memcpy(&entries.back(), buffer.data() + b * block_t + i * sizeof(Entry), sizeof(Entry));
+					}
+				}
+
+				return block + n;
+			}
+
+			uint64_t Blocks() const { return fences.size(); }
+
+			//Streams the entries in key order, f(entry) returns false to stop.
+			//
+
+			template < typename F > bool Scan(F&& f) const
+			{
+				std::vector<Entry> entries;
+
+				for (uint64_t block = 0; block < Blocks();)
+				{
+					block = Load(block, entries);
+
+					for (auto& e : entries)
+						if (!f(e))
+							return false;
+				}
+
+				return true;
+			}
+		};
+
+		class Cursor
+		{
+			const Run& run;
+			std::vector<Entry> entries;
+			size_t at = 0;
+			uint64_t block = 0;
+
+		public:
+
+			Cursor(const Run& _run)
+				: run(_run)
+			{
+				if (run.Blocks())
+					block = run.Load(0, entries);
+			}
+
+			bool Valid() const { return at < entries.size(); }
+
+			const Entry& Get() const { return entries[at]; }
+
+			void Next()
+			{
+				if (++at < entries.size() || block == run.Blocks() && entries.size())
+					return;
+
+				at = 0;
+				entries.clear();
+
+				if (block < run.Blocks())
+					block = run.Load(block, entries);
+			}
+		};
+
+		class RunWriter
+		{
+			std::string path;
+			io::File file;
+			std::vector<uint8_t> buffer;
+			std::vector<tdb::Key32> fences;
+			BloomFilter filter;
+
+			uint64_t offset = block_t;
+			uint64_t count = 0;
+
+			void Write()
+			{
+				file.Write(offset, buffer.data(), buffer.size());
+				offset += buffer.size();
+				buffer.clear();
+			}
+
+		public:
+
+			RunWriter(std::string_view _path, uint64_t expected)
+				: path(_path)
+				, file(_path, true)
+			{
+				filter.Reset(expected, filter_t);
+			}
+
+			void Add(const Entry& e)
+			{
+				size_t at = count++ % per_block_t;
+
+				if (!at)
+				{
+					if (buffer.size() >= buffer_t)
+						Write();
+
+					fences.push_back(e.key);
+					buffer.resize(buffer.size() + block_t);
+				}
+
+				std::memcpy(buffer.data() + buffer.size() - block_t + at * sizeof(Entry), &e, sizeof(Entry));
+				filter.Add(e.key);
+			}
+
+			void Finish()
+			{
+				Write();
+
+				file.Write(offset, fences.data(), fences.size() * sizeof(tdb::Key32));
+
+				RunHeader h = { run_magic_t, count, fences.size() };
+				file.Write(0, &h, sizeof(h));
+				file.Sync();
+
+				filter.Save(path + ".filter");
+			}
+		};
+
+		struct State
+		{
+			std::shared_ptr<const std::vector<Memtable>> frozen;	//Being written out, the stripes of the last memtable.
+			std::vector<std::shared_ptr<Run>> runs;					//Newest first.
+		};
+
+		std::filesystem::path base;
+		std::string values_path;
+
+		std::unique_ptr<Stripe[]> active;
+		std::atomic<size_t> active_count = 0;
+
+		std::atomic<std::shared_ptr<const State>> state;
+
+		//Slots below this are covered by the runs.
+		//
+		uint64_t run_slots = 0;
+		uint64_t frozen_slots = 0;
+		uint64_t next_id = 1;
+
+		std::atomic<uint64_t> slots = 0;
+		std::unique_ptr<std::atomic<uint64_t*>[]> bases;
+		std::vector<std::unique_ptr<mio::mmap_sink>> chunks;
+		std::mutex grow_lock;
+
+		std::mutex work_lock;
+		std::condition_variable work;
+		std::atomic<bool> running = true;
+		std::thread flusher;
+		std::thread merger;
+
+		static size_t StripeOf(const tdb::Key32& k)
+		{
+			return ((const uint8_t*)&k)[8] % stripes_t;
+		}
+
+		std::string RunPath(uint64_t id) const
+		{
+			return (base.parent_path() / (base.stem().string() + ".run." + std::to_string(id) + base.extension().string())).string();
+		}
+
+		std::shared_ptr<const State> Snapshot()
+		{
+			return state.load(std::memory_order_acquire);
+		}
+
+		void Publish(std::shared_ptr<const State> next)
+		{
+			state.store(std::move(next), std::memory_order_release);
+		}
+
+		uint64_t* Value(uint64_t slot)
+		{
+			return bases[slot >> chunk_bits_t].load(std::memory_order_acquire) + (slot & ((uint64_t(1) << chunk_bits_t) - 1));
+		}
+
+		void Map(uint64_t chunk)
+		{
+			std::lock_guard<std::mutex> lck(grow_lock);
+
+			if (bases[chunk].load(std::memory_order_relaxed))
+				return;
+
+			if (chunk >= chunks_t)
+				throw std::runtime_error("Index is full");
+
+			if (!std::filesystem::exists(values_path) || std::filesystem::file_size(values_path) < (chunk + 1) * chunk_bytes_t)
+			{
+				std::ofstream(values_path, std::ios::binary | std::ios::app);
+				std::filesystem::resize_file(values_path, (chunk + 1) * chunk_bytes_t);
+			}
+
+			chunks.resize(std::max(chunks.size(), (size_t)chunk + 1));
+			chunks[chunk] = std::make_unique<mio::mmap_sink>(values_path, chunk * chunk_bytes_t, chunk_bytes_t);
+
+			bases[chunk].store((uint64_t*)chunks[chunk]->data(), std::memory_order_release);
+		}
+
+		uint64_t Allocate()
+		{
+			uint64_t slot = slots++;
+
+			if (!bases[slot >> chunk_bits_t].load(std::memory_order_acquire))
+				Map(slot >> chunk_bits_t);
+
+			return slot;
+		}
+
+		static bool Find(const State& s, const tdb::Key32& k, uint64_t& slot)
+		{
+			if (s.frozen)
+			{
+				auto& table = (*s.frozen)[StripeOf(k)];
+				auto i = table.find(k);
+
+				if (i != table.end())
+				{
+					slot = i->second;
+					return true;
+				}
+			}
+
+			for (auto& r : s.runs)
+				if (r->Find(k, slot))
+					return true;
+
+			return false;
+		}
+
+		void SaveManifest(const State& s)
+		{
+			std::vector<uint64_t> manifest = { magic_t, run_slots, next_id, s.runs.size() };
+
+			for (auto& r : s.runs)
+				manifest.push_back(r->id);
+
+			auto temp = base.string() + ".tmp";
+
+			{
+				io::File file(temp, true);
+				file.Write(0, manifest.data(), manifest.size() * sizeof(uint64_t));
+				file.Sync();
+			}
+
+			std::filesystem::rename(temp, base);
+		}
+
+		//The stripes become the frozen table, lookups keep finding their keys there. Call under work_lock.
+		//
+
+		void Freeze()
+		{
+			auto frozen = std::make_shared<std::vector<Memtable>>(stripes_t);
+
+			for (size_t i = 0; i < stripes_t; i++)
+				active[i].lock.lock();
+
+			for (size_t i = 0; i < stripes_t; i++)
+				(*frozen)[i].swap(active[i].keys);
+
+			frozen_slots = slots;
+			active_count = 0;
+
+			auto next = std::make_shared<State>(*Snapshot());
+			next->frozen = frozen;
+			Publish(next);
+
+			for (size_t i = 0; i < stripes_t; i++)
+				active[i].lock.unlock();
+		}
+
+		//Writes the frozen table as the newest run. Call under work_lock.
+		//
+
+		void WriteFrozen()
+		{
+			auto current = Snapshot();
+
+			if (!current->frozen)
+				return;
+
+			std::vector<Entry> entries;
+
+			for (auto& table : *current->frozen)
+				for (auto& [k, slot] : table)
+					entries.push_back(Entry{ k, slot });
+
+			std::sort(std::execution::par, entries.begin(), entries.end(), [](auto& l, auto& r) { return Less(l.key, r.key); });
+
+			//Values first, a run must never point at slots that didn't reach the disk:
+			//
+
+			SyncValues();
+
+			auto id = next_id++;
+
+			{
+				RunWriter writer(RunPath(id), entries.size());
+
+				for (auto& e : entries)
+					writer.Add(e);
+
+				writer.Finish();
+			}
+
+			auto next = std::make_shared<State>();
+			next->runs.push_back(std::make_shared<Run>(RunPath(id), id));
+			next->runs.insert(next->runs.end(), current->runs.begin(), current->runs.end());
+
+			run_slots = frozen_slots;
+
+			SaveManifest(*next);
+			Publish(next);
+		}
+
+		//Merges the newest run into the one before it while it is at least 1 / ratio_t of its size. The runs stream
+		//without work_lock held, so flushes carry on meanwhile.
+		//
+
+		void Merge(std::unique_lock<std::mutex>& lck)
+		{
+			while (running)
+			{
+				auto current = Snapshot();
+				auto& runs = current->runs;
+
+				size_t i = 0;
+
+				while (i + 1 < runs.size() && runs[i]->count * ratio_t < runs[i + 1]->count)
+					i++;
+
+				if (i + 1 >= runs.size())
+					return;
+
+				auto newer = runs[i], older = runs[i + 1];
+				auto id = next_id++;
+
+				lck.unlock();
+
+				bool complete = true;
+
+				{
+					RunWriter writer(RunPath(id), newer->count + older->count);
+					Cursor l(*newer), r(*older);
+
+					//Keys are unique across runs, this is a plain merge:
+					//
+
+					for (size_t n = 0; l.Valid() || r.Valid(); n++)
+					{
+						if (n % per_block_t == 0 && !running)
+						{
+							complete = false;
+							break;
+						}
+
+						if (!r.Valid() || l.Valid() && Less(l.Get().key, r.Get().key))
+						{
+							writer.Add(l.Get());
+							l.Next();
+						}
+						else
+						{
+							writer.Add(r.Get());
+							r.Next();
+						}
+					}
+
+					if (complete)
+						writer.Finish();
+				}
+
+				lck.lock();
+
+				if (!complete)
+				{
+					std::filesystem::remove(RunPath(id));
+					return;
+				}
+
+				//Newer runs may have been written in the meantime, the merged run takes the place of its inputs:
+				//
+
+				auto next = std::make_shared<State>(*Snapshot());
+
+				auto at = std::find(next->runs.begin(), next->runs.end(), newer);
+				at = next->runs.erase(at, at + 2);
+				next->runs.insert(at, std::make_shared<Run>(RunPath(id), id));
+
+				SaveManifest(*next);
+				Publish(next);
+
+				newer->retired = true;
+				older->retired = true;
+			}
+		}
+
+		void SyncValues()
+		{
+			std::lock_guard<std::mutex> lck(grow_lock);
+			std::error_code error;
+
+			for (auto& c : chunks)
+				if (c) c->sync(error);
+		}
+
+	public:
+
+		LsmIndex(std::string_view path)
+			: base(path)
+			, active(std::make_unique<Stripe[]>(stripes_t))
+			, state(std::make_shared<State>())
+			, bases(std::make_unique<std::atomic<uint64_t*>[]>(chunks_t))
+		{
+			values_path = (base.parent_path() / (base.stem().string() + ".values" + base.extension().string())).string();
+
+			auto initial = std::make_shared<State>();
+
+			if (std::filesystem::exists(base) && std::filesystem::file_size(base))
+			{
+				io::File file(base.string());
+				std::vector<uint64_t> manifest(file.Size() / sizeof(uint64_t));
+				file.Read(0, manifest.data(), manifest.size() * sizeof(uint64_t));
+
+				if (manifest.size() < 4 || manifest[0] != magic_t || manifest.size() != 4 + manifest[3])
+					throw std::runtime_error("Bad index file " + base.string());
+
+				run_slots = manifest[1];
+				next_id = manifest[2];
+
+				for (size_t i = 0; i < manifest[3]; i++)
+					initial->runs.push_back(std::make_shared<Run>(RunPath(manifest[4 + i]), manifest[4 + i]));
+			}
+
+			state.store(initial);
+
+			//Runs written or merged after the last manifest:
+			//
+
+			for (auto& f : std::filesystem::directory_iterator(base.parent_path().empty() ? "." : base.parent_path()))
+			{
+				auto name = f.path().filename().string();
+				auto prefix = base.stem().string() + ".run.";
+
+				if (name.rfind(prefix, 0) != 0)
+					continue;
+
+				auto id = std::stoull(name.substr(prefix.size()));
+
+				if (std::none_of(initial->runs.begin(), initial->runs.end(), [&](auto& r) { return r->id == id; }))
+					std::filesystem::remove(f.path());
+			}
+
+			slots = frozen_slots = run_slots;
+
+			for (uint64_t c = 0; c <= (std::max<uint64_t>(run_slots, 1) - 1) >> chunk_bits_t; c++)
+				Map(c);
+
+			flusher = std::thread([&]()
+			{
+				std::unique_lock<std::mutex> lck(work_lock);
+
+				while (running)
+				{
+					work.wait_for(lck, std::chrono::milliseconds(1000));
+
+					if (running && active_count >= memtable_t)
+					{
+						Freeze();
+						WriteFrozen();
+
+						work.notify_all();
+					}
+				}
+			});
+
+			merger = std::thread([&]()
+			{
+				std::unique_lock<std::mutex> lck(work_lock);
+
+				while (running)
+				{
+					work.wait_for(lck, std::chrono::milliseconds(1000));
+					Merge(lck);
+				}
+			});
+		}
+
+		~LsmIndex()
+		{
+			{
+				std::lock_guard<std::mutex> lck(work_lock);
+				running = false;
+			}
+
+			work.notify_all();
+
+			flusher.join();
+			merger.join();
+
+			Flush();
+		}
+
+		uint64_t* FindLock(const tdb::Key32& k)
+		{
+			{
+				auto& stripe = active[StripeOf(k)];
+				std::shared_lock<std::shared_mutex> lck(stripe.lock);
+
+				auto i = stripe.keys.find(k);
+
+				if (i != stripe.keys.end())
+					return Value(i->second);
+			}
+
+			uint64_t slot;
+
+			if (Find(*Snapshot(), k, slot))
+				return Value(slot);
+
+			return nullptr;
+		}
+
+		std::pair<uint64_t*, bool> InsertLock(const tdb::Key32& k, uint64_t v)
+		{
+			auto& stripe = active[StripeOf(k)];
+			std::unique_lock<std::shared_mutex> lck(stripe.lock);
+
+			auto i = stripe.keys.find(k);
+
+			if (i != stripe.keys.end())
+				return std::make_pair(Value(i->second), true);
+
+			uint64_t slot;
+
+			if (Find(*Snapshot(), k, slot))
+				return std::make_pair(Value(slot), true);
+
+			slot = Allocate();
+			*Value(slot) = v;
+
+			stripe.keys.emplace(k, slot);
+
+			if (++active_count == memtable_t)
+				work.notify_one();
+
+			return std::make_pair(Value(slot), false);
+		}
+
+		LsmIndex& Table() { return *this; }
+
+		template < typename F > void Iterate(F&& f)
+		{
+			uint64_t count = slots;
+
+			for (uint64_t s = 0; s < count; s++)
+			{
+				//The last chunk can be mid mapping by the insert that reached it:
+				//
+
+				if (!(s & ((uint64_t(1) << chunk_bits_t) - 1)) && !bases[s >> chunk_bits_t].load(std::memory_order_acquire))
+					Map(s >> chunk_bits_t);
+
+				if (!f(*Value(s)))
+					return;
+			}
+		}
+
+		size_t ResetNodeLocks() { return 0; }
+
+		//Writes the memtable out as a run, everything inserted or updated in place so far is durable once this returns.
+		//
+
+		void Flush()
+		{
+			std::lock_guard<std::mutex> lck(work_lock);
+
+			WriteFrozen();
+
+			if (active_count)
+			{
+				Freeze();
+				WriteFrozen();
+			}
+
+			SyncValues(); //Tombstones, relocations and access bits change values without a memtable.
+		}
+	};
+}
@@ -0,0 +1,486 @@
+/* Copyright (C) 2020 D8DATAWORKS - All Rights Reserved */
+
+#pragma once
+
+#include <vector>
+#include <string_view>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <concepts>
+#include <string>
+
+#include "io.hpp"
+#include "location.hpp"
+#include "codec.hpp"
+
+#include "tdb/legacy.hpp"
+
+#if defined(_M_X64) || defined(__x86_64__)
+#include <nmmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+namespace volstore
+{
+	/*
+		CRC32C (Castagnoli). SSE4.2 or ARMv8 CRC instructions when the CPU has them, table driven otherwise.
+	*/
+
+	namespace crc32c
+	{
+		struct Table
+		{
+			uint32_t v[256];
+
+			constexpr Table() : v()
+			{
+				for (uint32_t i = 0; i < 256; i++)
+				{
+					uint32_t c = i;
+
+					for (int k = 0; k < 8; k++)
+						c = (c & 1) ? (c >> 1) ^ 0x82F63B78 : c >> 1;
+
+					v[i] = c;
+				}
+			}
+		};
+
+		inline uint32_t software(uint32_t crc, const uint8_t* p, size_t n)
+		{
+			static constexpr Table table;
+
+			for (size_t i = 0; i < n; i++)
+				crc = table.v[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+
+			return crc;
+		}
+
+#if defined(_M_X64) || defined(__x86_64__)
+
+#ifndef _MSC_VER
+		__attribute__((target("sse4.2")))
+#endif
+		inline uint32_t hardware(uint32_t crc, const uint8_t* p, size_t n)
+		{
+			uint64_t c = crc;
+
+			for (; n >= 8; n -= 8, p += 8)
+			{
+				uint64_t word;
+				std::memcpy(&word, p, sizeof(word));
+				c = _mm_crc32_u64(c, word);
+			}
+
+			uint32_t c32 = (uint32_t)c;
+
+			for (; n; n--, p++)
+				c32 = _mm_crc32_u8(c32, *p);
+
+			return c32;
+		}
+
+		inline bool supported()
+		{
+#ifdef _MSC_VER
+			int info[4];
+			__cpuid(info, 1);
+
+			return (info[2] & (1 << 20)) != 0;
+#else
+			return __builtin_cpu_supports("sse4.2");
+#endif
+		}
+
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+
+		inline uint32_t hardware(uint32_t crc, const uint8_t* p, size_t n)
+		{
+			for (; n >= 8; n -= 8, p += 8)
+			{
+				uint64_t word;
+				std::memcpy(&word, p, sizeof(word));
+				crc = __crc32cd(crc, word);
+			}
+
+			for (; n; n--, p++)
+				crc = __crc32cb(crc, *p);
+
+			return crc;
+		}
+
+		inline bool supported() { return true; }
+
+#else
+
+		inline uint32_t hardware(uint32_t crc, const uint8_t* p, size_t n) { return software(crc, p, n); }
+
+		inline bool supported() { return false; }
+
+#endif
+
+		inline uint32_t extend(uint32_t crc, const void* data, size_t n)
+		{
+			static const bool accelerated = supported();
+
+			crc = ~crc;
+			crc = (accelerated) ? hardware(crc, (const uint8_t*)data, n) : software(crc, (const uint8_t*)data, n);
+
+			return ~crc;
+		}
+	}
+
+	/*
+		image.dat record layout.
+
+		Legacy records are a uint32_t size followed by the payload. Versioned records start with a magic that
+		can never be a legal legacy size and carry the key, so the index can be rebuilt from the data file alone.
+		The checksum covers the header, with crc zeroed, and the payload.
+	*/
+
+	namespace record
+	{
+		static uint32_t constexpr magic = 0xD8B10C4B;
+		static uint8_t constexpr version = 1;
+		static uint32_t constexpr max_block_t = 1024 * 1024 * 32;
+		static size_t constexpr legacy_t = sizeof(uint32_t);
+
+		enum Flags : uint8_t
+		{
+			unsealed = 1,	//Payload is still being filled in, no checksum yet.
+			deleted = 2		//Tombstone, header only.
+		};
+
+#pragma pack(push, 1)
+		struct Header
+		{
+			uint32_t magic;
+			uint32_t length;
+			uint8_t version;
+			uint8_t flags;
+			uint8_t codec;
+			uint8_t reserved;
+			uint32_t crc;
+			uint8_t key[32];
+		};
+#pragma pack(pop)
+
+		static_assert(sizeof(Header) == 48, "Record header layout changed");
+
+		inline bool legacy(const void* p)
+		{
+			return *(const uint32_t*)p != magic;
+		}
+
+		inline size_t header_size(const void* p)
+		{
+			return legacy(p) ? legacy_t : sizeof(Header);
+		}
+
+		inline uint32_t length(const void* p)
+		{
+			return legacy(p) ? *(const uint32_t*)p : ((const Header*)p)->length;
+		}
+
+		//Header plus payload, the distance to the next record.
+		//
+
+		inline uint64_t total(const void* p)
+		{
+			return header_size(p) + length(p);
+		}
+
+		inline uint32_t checksum(const Header& h, const uint8_t* payload)
+		{
+			Header copy = h;
+			copy.crc = 0;
+
+			return crc32c::extend(crc32c::extend(0, &copy, sizeof(copy)), payload, h.length);
+		}
+
+		inline Header make(const void* key, uint32_t length, uint8_t flags = 0)
+		{
+			Header h = { magic, length, version, flags, 0, 0, 0 };
+			std::memcpy(h.key, key, sizeof(h.key));
+
+			return h;
+		}
+
+		inline void seal(Header& h, const uint8_t* payload)
+		{
+			h.flags &= ~unsealed;
+			h.crc = checksum(h, payload);
+		}
+
+		inline bool valid(const Header& h)
+		{
+			return h.magic == magic && h.version == version && h.length <= max_block_t;
+		}
+
+		inline bool verify(const Header& h, const uint8_t* payload)
+		{
+			if (!valid(h))
+				return false;
+
+			return (h.flags & unsealed) || checksum(h, payload) == h.crc;
+		}
+
+		//The block as written from the stored payload of a verified record. False when its codec can't be decoded here.
+		//
+
+		template < typename V > bool decode(const Header& h, const uint8_t* stored, V& result)
+		{
+			uint32_t size = codec::length(h.codec, stored, h.length);
+
+			if (size > max_block_t)
+				return false;
+
+			result.resize(size);
+
+			return codec::decompress(h.codec, stored, h.length, result.data());
+		}
+
+		enum class Check
+		{
+			intact,
+			corrupt,
+			incomplete	//The record runs past the bytes available.
+		};
+
+		//Checks the record at p from memory, payload and size are set when it is intact.
+		//
+
+		inline Check check(const uint8_t* p, size_t available, const uint8_t*& payload, uint32_t& size)
+		{
+			if (available < legacy_t || available < header_size(p))
+				return Check::incomplete;
+
+			if (length(p) > max_block_t)
+				return Check::corrupt;
+
+			if (available < total(p))
+				return Check::incomplete;
+
+			size = length(p);
+			payload = p + header_size(p);
+
+			if (legacy(p))
+				return Check::intact;
+
+			Header h;
+			std::memcpy(&h, p, sizeof(Header));
+
+			return verify(h, payload) ? Check::intact : Check::corrupt;
+		}
+
+		//c: codec to try, the record falls back to raw when the block doesn't compress.
+		//
+
+		template < typename K, typename Y > std::vector<uint8_t> encode(const K& key, const Y& payload, uint8_t c = codec::none)
+		{
+			auto compressed = codec::compress(c, (const uint8_t*)payload.data(), payload.size());
+
+			if (compressed.empty())
+				c = codec::none;
+
+			size_t size = (c == codec::none) ? payload.size() : compressed.size();
+			std::vector<uint8_t> result(sizeof(Header) + size);
+
+			auto h = make(key.data(), (uint32_t)size);
+			h.codec = c;
+
+			if (c == codec::none)
+				std::copy(payload.begin(), payload.end(), result.begin() + sizeof(Header));
+			else
+				std::copy(compressed.begin(), compressed.end(), result.begin() + sizeof(Header));
+
+			seal(h, result.data() + sizeof(Header));
+			std::memcpy(result.data(), &h, sizeof(Header));
+
+			return result;
+		}
+
+		template < typename K > std::vector<uint8_t> tombstone(const K& key)
+		{
+			std::vector<uint8_t> result(sizeof(Header));
+
+			auto h = make(key.data(), 0, deleted);
+			seal(h, nullptr);
+			std::memcpy(result.data(), &h, sizeof(Header));
+
+			return result;
+		}
+
+		/*
+			Finds every versioned record in [start, end) of a data file. Sequential reads through a large window,
+			resynchronizing on the magic and checksum after anything it can't parse, legacy records included.
+			f(offset, header, payload)
+		*/
+
+		template < typename F > void scan(const io::File& file, uint64_t start, uint64_t end, uint64_t size, F&& f)
+		{
+			static size_t constexpr window_t = 8 * 1024 * 1024;
+
+			std::vector<uint8_t> window;
+			uint64_t window_start = 0;
+
+			std::vector<uint8_t> large;
+
+			auto view = [&](uint64_t pos, size_t n) -> const uint8_t*
+			{
+				if (pos + n > size)
+					return nullptr;
+
+				if (pos < window_start || pos + n > window_start + window.size())
+				{
+					if (n > window_t / 2)
+					{
+						large.resize(n);
+						return (file.Read(pos, large.data(), n) == n) ? large.data() : nullptr;
+					}
+
+					window.resize((size_t)std::min((uint64_t)window_t, size - pos));
+					window_start = pos;
+					window.resize(file.Read(pos, window.data(), window.size()));
+
+					if (window.size() < n)
+						return nullptr;
+				}
+
+				return window.data() + (pos - window_start);
+			};
+
+			uint64_t pos = start;
+
+			while (pos < end)
+			{
+				auto p = view(pos, sizeof(Header));
+
+				if (!p)
+					break;
+
+				Header h;
+				std::memcpy(&h, p, sizeof(Header));
+
+				if (valid(h))
+				{
+					auto payload = view(pos + sizeof(Header), h.length);
+
+					if (payload && verify(h, payload))
+					{
+						f(pos, h, payload);
+
+						pos += sizeof(Header) + h.length;
+						continue;
+					}
+				}
+
+				//Out of sync, skip ahead to the next possible magic:
+				//
+
+				pos++;
+
+				auto q = view(pos, sizeof(uint32_t));
+
+				while (q && pos < end && *(const uint32_t*)q != magic)
+				{
+					pos++;
+					q = view(pos, sizeof(uint32_t));
+				}
+			}
+		}
+
+		//The file is split into chunks scanned concurrently, each chunk owns the records that start inside it.
+		//
+
+		template < typename F > void scan_parallel(std::string_view path, F&& f)
+		{
+			static uint64_t constexpr chunk_t = 256 * 1024 * 1024;
+
+			io::File file(path);
+			uint64_t size = file.Size();
+			uint64_t chunks = (size + chunk_t - 1) / chunk_t;
+
+			std::atomic<uint64_t> next = 0;
+			std::vector<std::thread> threads(std::max(1u, std::thread::hardware_concurrency()));
+
+			for (auto& t : threads)
+			{
+				t = std::thread([&]()
+				{
+					for (uint64_t c = next++; c < chunks; c = next++)
+						scan(file, c * chunk_t, std::min(size, (c + 1) * chunk_t), size, f);
+				});
+			}
+
+			for (auto& t : threads)
+				t.join();
+		}
+
+		/*
+			Rebuilds index entries from the versioned records of segments [0, segments). When a key appears more than once
+			the newest record wins: the active segment is newer than the others, segments are newer than those with lower
+			numbers and later offsets newer than earlier ones. Legacy records carry no key and are not recovered. added(key)
+			sees every key inserted. path(segment) names the segment file, missing files are skipped.
+		*/
+
+		inline uint64_t age(uint64_t v, uint64_t active)
+		{
+			uint64_t segment = (location::segment(v) == active) ? location::segments_t : location::segment(v);
+
+			return (segment << location::offset_bits) | location::offset(v);
+		}
+
+		template < typename DB, std::invocable<uint64_t> P, typename A > size_t rebuild(DB& db, P&& path, uint64_t segments, uint64_t active, A&& added)
+		{
+			std::atomic<size_t> count = 0;
+
+			for (uint64_t s = 0; s < segments; s++)
+			{
+				std::string file = path(s);
+
+				if (file.empty() || !std::filesystem::exists(file))
+					continue;
+
+				scan_parallel(file, [&](uint64_t offset, const Header& h, const uint8_t*)
+				{
+					uint64_t v = location::make(s, offset) | ((h.flags & deleted) ? location::tombstone : 0);
+
+					auto res = db.InsertLock(*((tdb::Key32*)h.key), v);
+					bool changed = !res.second;
+
+					if (res.second)
+					{
+						std::atomic_ref<uint64_t> slot(*res.first);
+						uint64_t current = slot.load();
+
+						while (!changed && (!current || age(current, active) < age(v, active)))
+							changed = slot.compare_exchange_weak(current, v);
+					}
+
+					if (changed)
+						added(*((tdb::Key32*)h.key));
+
+					count++;
+				});
+			}
+
+			return count;
+		}
+
+		//Segment files in root.
+		//
+
+		template < typename DB, typename A > size_t rebuild(DB& db, std::string_view root, uint64_t segments, uint64_t active, A&& added)
+		{
+			return rebuild(db, [&](uint64_t s) { return location::path(root, s); }, segments, active, std::forward<A>(added));
+		}
+	}
+}
@@ -0,0 +1,228 @@
+/* Copyright (C) 2020 D8DATAWORKS - All Rights Reserved */
+
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <execution>
+#include <future>
+#include <mutex>
+#include <chrono>
+#include <iostream>
+#include <stdexcept>
+
+#include "io.hpp"
+#include "location.hpp"
+#include "record.hpp"
+
+#include "tdb/legacy.hpp"
+#include "d8u/util.hpp"
+
+namespace volstore
+{
+	/*
+		Offline repair shared by the engines.
+
+		Index entries are collected and sorted by location so each segment is streamed front to back in large windows.
+		The next window is read while the blocks of the current one are validated on every core.
+	*/
+
+	namespace repair
+	{
+		static uint64_t constexpr window_t = 64 * 1024 * 1024;
+
+		//Read past the last block of a window so it usually arrives whole.
+		//
+		static uint64_t constexpr readahead_t = 1024 * 1024;
+
+		struct Entry
+		{
+			uint64_t* slot;
+			uint64_t value;
+
+			uint64_t segment() const { return location::segment(value); }
+			uint64_t offset() const { return location::offset(value); }
+
+			bool operator<(const Entry& r) const
+			{
+				return (segment() == r.segment()) ? offset() < r.offset() : segment() < r.segment();
+			}
+		};
+
+		struct Window
+		{
+			size_t begin = 0;
+			size_t end = 0;
+			uint64_t offset = 0;
+			std::vector<uint8_t> data;
+		};
+
+		template < typename DB > std::vector<Entry> collect(DB& db)
+		{
+			std::vector<Entry> entries;
+
+			//Tombstones point at deleted or already damaged records, there is nothing left to check or trim:
+			//
+
+			db.Table().Iterate([&](auto& v)
+			{
+				if (location::live(v))
+					entries.push_back(Entry{ (uint64_t*)&v, (uint64_t)v });
+
+				return true;
+			});
+
+			std::sort(std::execution::par, entries.begin(), entries.end());
+
+			return entries;
+		}
+
+		/*
+			files(segment) returns the io::File of a segment or nullptr, valid(span) is the block validator.
+			Returns the damaged entries.
+		*/
+
+		template < typename FILES, typename V > std::vector<Entry> scan(std::vector<Entry>& entries, FILES&& files, V&& valid)
+		{
+			auto load = [&](size_t begin)
+			{
+				Window w;
+				w.begin = w.end = begin;
+				w.offset = entries[begin].offset();
+
+				auto segment = entries[begin].segment();
+
+				while (w.end < entries.size() && entries[w.end].segment() == segment && entries[w.end].offset() < w.offset + window_t)
+					w.end++;
+
+				auto file = files(segment);
+
+				if (file)
+				{
+					w.data.resize(entries[w.end - 1].offset() - w.offset + readahead_t);
+					w.data.resize(file->Read(w.offset, w.data.data(), w.data.size()));
+				}
+
+				return w;
+			};
+
+			auto check = [&](Window& w, const Entry& e)
+			{
+				const uint8_t* payload = nullptr;
+				uint32_t size = 0;
+
+				auto at = e.offset() - w.offset;
+				auto status = (at < w.data.size()) ? record::check(w.data.data() + at, w.data.size() - at, payload, size) : record::Check::incomplete;
+
+				std::vector<uint8_t> large;
+
+				if (status == record::Check::incomplete)
+				{
+					//Runs past the window, read it on its own:
+					//
+
+					auto file = files(e.segment());
+
+					if (!file)
+						return false;
+
+					uint32_t header[sizeof(record::Header) / sizeof(uint32_t)] = {};
+					file->Read(e.offset(), header, sizeof(header));
+
+					if (record::length(header) > record::max_block_t)
+						return false;
+
+					large.resize(record::total(header));
+					large.resize(file->Read(e.offset(), large.data(), large.size()));
+
+					status = record::check(large.data(), large.size(), payload, size);
+				}
+
+				if (status != record::Check::intact)
+					return false;
+
+				//Compressed blocks are validated as written:
+				//
+
+				auto p = (large.size()) ? large.data() : w.data.data() + at;
+
+				if (!record::legacy(p) && ((const record::Header*)p)->codec != codec::none)
+				{
+					std::vector<uint8_t> block;
+
+					if (!record::decode(*((const record::Header*)p), payload, block))
+						return false;
+
+					return valid(gsl::span<uint8_t>(block.data(), block.size()));
+				}
+
+				return valid(gsl::span<uint8_t>((uint8_t*)payload, size));
+			};
+
+			std::vector<Entry> damaged;
+			std::mutex damaged_lock;
+
+			if (!entries.size())
+				return damaged;
+
+			auto start = std::chrono::steady_clock::now();
+			uint64_t bytes = 0;
+
+			auto next = std::async(std::launch::async, load, 0);
+
+			while (true)
+			{
+				auto w = next.get();
+
+				if (w.end < entries.size())
+					next = std::async(std::launch::async, load, w.end);
+
+				std::for_each(std::execution::par, entries.begin() + w.begin, entries.begin() + w.end, [&](auto& e)
+				{
+					if (check(w, e))
+						return;
+
+					std::lock_guard<std::mutex> lck(damaged_lock);
+					damaged.push_back(e);
+				});
+
+				bytes += w.data.size();
+
+				auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+				std::cout << "Repair: " << w.end << " / " << entries.size() << " blocks, "
+					<< bytes / (1024 * 1024) << " MB, " << (size_t)(bytes / (1024 * 1024) / std::max(seconds, 0.001)) << " MB/s" << std::endl;
+
+				if (w.end == entries.size())
+					break;
+			}
+
+			return damaged;
+		}
+
+		template < typename DB, typename FILES, typename V > size_t run(DB& db, FILES&& files, V&& valid, bool can_write)
+		{
+			auto entries = collect(db);
+			auto damaged = scan(entries, files, valid);
+
+			std::sort(damaged.begin(), damaged.end());
+
+			for (auto& e : damaged)
+			{
+				std::cout << "Corruption at: " << e.value << std::endl;
+
+				if (!can_write)
+					continue;
+
+				std::cout << "Trimming Block: " << e.value << std::endl;
+
+				*e.slot = 0;
+			}
+
+			if (damaged.size() && !can_write)
+				throw std::runtime_error("Database is corrupt but repair prevented");
+
+			return damaged.size();
+		}
+	}
+}
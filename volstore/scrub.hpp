@@ -0,0 +1,41 @@
+/* Copyright (C) 2020 D8DATAWORKS - All Rights Reserved */
+
+#pragma once
+
+#include <string_view>
+#include <string>
+#include <fstream>
+
+namespace volstore
+{
+	/*
+		Position of the background scrubber, persisted in scrub.db so a restart resumes where it left off.
+	*/
+
+	namespace scrub
+	{
+		struct Cursor
+		{
+			uint64_t segment = 0;
+			uint64_t offset = 0;
+		};
+
+		inline std::string path(std::string_view root)
+		{
+			return std::string(root) + "/scrub.db";
+		}
+
+		inline Cursor load(std::string_view root)
+		{
+			Cursor c;
+			std::ifstream(path(root), std::ios::binary).read((char*)&c, sizeof(Cursor));
+
+			return c;
+		}
+
+		inline void save(std::string_view root, const Cursor& c)
+		{
+			std::ofstream(path(root), std::ios::binary | std::ios::trunc).write((const char*)&c, sizeof(Cursor));
+		}
+	}
+}
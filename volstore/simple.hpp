@@ -12,6 +12,8 @@
 #include "../mio.hpp"
 #include "../gsl-lite.hpp"
 
+#include "bitmap.hpp"
+
 #include "tdb/mapping.hpp"
 #include "d8u/util.hpp"
 #include "d8u/string.hpp"
@@ -88,5 +90,38 @@ namespace volstore
 
 			return result.to_ullong();
 		}
+
+		template <size_t U, typename T> std::vector<uint8_t> ManyBitmap(const T& ids) const
+		{
+			auto limit = ids.size() / U;
+
+			std::vector<uint8_t> result(bitmap::bytes(limit));
+
+			for (size_t i = 0; i < limit; i++)
+				if (filesystem::exists(root + "/" + to_hex(span<uint8_t>((uint8_t*)ids.data() + U * i, U))))
+					bitmap::set(result.data(), i);
+
+			return result;
+		}
+
+		template <typename T> bool Delete(const T& id) const
+		{
+			return filesystem::remove(root + "/" + to_hex(id));
+		}
+
+		template <size_t U, typename T> uint64_t DeleteMany(const T& ids) const
+		{
+			std::bitset<64> result;
+
+			auto limit = ids.size() / U;
+
+			if (limit > 64)
+				throw runtime_error("The max limit for DeleteMany is 64");
+
+			for (size_t i = 0; i < limit; i++)
+				result.set(i, Delete(span<uint8_t>((uint8_t*)ids.data() + U * i, U)));
+
+			return result.to_ullong();
+		}
 	};
 }
\ No newline at end of file
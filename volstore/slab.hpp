@@ -0,0 +1,359 @@
+/* Copyright (C) 2020 D8DATAWORKS - All Rights Reserved */
+
+#pragma once
+
+#include <string_view>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <fstream>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <cstring>
+#include <stdexcept>
+#include <limits>
+
+#include "location.hpp"
+
+namespace volstore
+{
+	/*
+		Memory resident copies of tiny blocks, next to the index. A 64 bit index value has no room for a block, so
+		the slab maps the value to the payload instead and Read never reaches the data files for them.
+
+		The records stay in the segment files, replay, rebuild, scrub and flatten see them as before. Entries are keyed
+		by location, a record never changes once written, so an entry is right for as long as the location is in use.
+		The engine moves entries along with their blocks and drops them with deleted blocks and retired segments.
+		Each shard keeps its payloads back to back in one arena, behind a 16 bit length.
+
+		The payloads held are capped at Capacity bytes, split evenly over the shards. A full shard refuses new blocks,
+		they are read from the data files as before.
+	*/
+
+	class Slab
+	{
+		static size_t constexpr shards_t = 64;
+		static uint64_t constexpr magic_t = 0xD8B15AB000000002;
+
+	public:
+
+		static size_t constexpr max_block_t = 1024;
+		static size_t constexpr capacity_t = 256 * 1024 * 1024;
+
+	private:
+
+		struct alignas(64) Shard
+		{
+			std::mutex lock;
+			std::vector<uint8_t> arena;
+			std::unordered_map<uint64_t, uint32_t> at;
+			size_t dead = 0;
+		};
+
+		std::unique_ptr<Shard[]> shards;
+		std::atomic<size_t> limit = 0;
+		std::atomic<size_t> capacity = capacity_t;
+
+		//Locations of neighbouring records differ in a few low bits, mixed so they spread over the shards.
+		//
+
+		Shard& ShardOf(uint64_t v)
+		{
+			return shards[(v * 0x9E3779B97F4A7C15) >> 58];
+		}
+
+		static uint16_t Length(const Shard& s, uint32_t offset)
+		{
+			uint16_t length;
+			std::memcpy(&length, s.arena.data() + offset, sizeof(uint16_t));
+
+			return length;
+		}
+
+		//False when the shard is full, offsets into the arena are 32 bit.
+		//
+
+		static bool Add(Shard& s, uint64_t v, const uint8_t* p, size_t n, size_t budget)
+		{
+			size_t size = sizeof(uint16_t) + n;
+
+			if (s.arena.size() - s.dead + size > budget)
+				return false;
+
+			if (s.arena.size() + size > std::numeric_limits<uint32_t>::max())
+				Pack(s, true);
+
+			if (s.arena.size() + size > std::numeric_limits<uint32_t>::max())
+				return false;
+
+			uint16_t length = (uint16_t)n;
+			uint32_t offset = (uint32_t)s.arena.size();
+
+			s.arena.resize(s.arena.size() + sizeof(uint16_t) + n);
+			std::memcpy(s.arena.data() + offset, &length, sizeof(uint16_t));
+			std::memcpy(s.arena.data() + offset + sizeof(uint16_t), p, n);
+
+			auto [i, added] = s.at.emplace(v, offset);
+
+			if (!added)
+			{
+				s.dead += sizeof(uint16_t) + Length(s, i->second);
+				i->second = offset;
+			}
+
+			return true;
+		}
+
+		static void Remove(Shard& s, std::unordered_map<uint64_t, uint32_t>::iterator i)
+		{
+			s.dead += sizeof(uint16_t) + Length(s, i->second);
+			s.at.erase(i);
+		}
+
+		//Rewrites the arena once more than half of it is dead, or whenever anything is dead with force.
+		//
+
+		static void Pack(Shard& s, bool force = false)
+		{
+			if (s.dead <= ((force) ? 0 : s.arena.size() / 2))
+				return;
+
+			std::vector<uint8_t> arena;
+			arena.reserve(s.arena.size() - s.dead);
+
+			for (auto& e : s.at)
+			{
+				uint32_t offset = (uint32_t)arena.size();
+				size_t n = sizeof(uint16_t) + Length(s, e.second);
+
+				arena.insert(arena.end(), s.arena.begin() + e.second, s.arena.begin() + e.second + n);
+				e.second = offset;
+			}
+
+			s.arena = std::move(arena);
+			s.dead = 0;
+		}
+
+	public:
+
+		Slab()
+			: shards(std::make_unique<Shard[]>(shards_t)) { }
+
+		bool Enabled() const { return limit.load(std::memory_order_relaxed) != 0; }
+
+		size_t Limit() const { return limit.load(std::memory_order_relaxed); }
+
+		//Largest block kept, zero disables the slab and drops what it holds. Lowering it drops the blocks now too large.
+		//
+
+		void Limit(size_t bytes)
+		{
+			if (bytes > max_block_t)
+				throw std::runtime_error("Inline blocks are limited to 1024 bytes");
+
+			limit = bytes;
+
+			for (size_t i = 0; i < shards_t; i++)
+			{
+				auto& s = shards[i];
+				std::lock_guard<std::mutex> lck(s.lock);
+
+				for (auto e = s.at.begin(); e != s.at.end(); )
+				{
+					if (Length(s, e->second) > bytes)
+						Remove(s, e++);
+					else
+						e++;
+				}
+
+				Pack(s);
+			}
+		}
+
+		size_t Capacity() const { return capacity.load(std::memory_order_relaxed); }
+
+		//Bytes of payload held at most, lowering it drops blocks until what is left fits.
+		//
+
+		void Capacity(size_t bytes)
+		{
+			capacity = bytes;
+
+			size_t budget = bytes / shards_t;
+
+			for (size_t i = 0; i < shards_t; i++)
+			{
+				auto& s = shards[i];
+				std::lock_guard<std::mutex> lck(s.lock);
+
+				for (auto e = s.at.begin(); e != s.at.end() && s.arena.size() - s.dead > budget; )
+					Remove(s, e++);
+
+				Pack(s);
+			}
+		}
+
+		size_t Size()
+		{
+			size_t result = 0;
+
+			for (size_t i = 0; i < shards_t; i++)
+			{
+				std::lock_guard<std::mutex> lck(shards[i].lock);
+				result += shards[i].at.size();
+			}
+
+			return result;
+		}
+
+		template < typename V > bool Find(uint64_t v, V& result)
+		{
+			if (!Enabled())
+				return false;
+
+			auto& s = ShardOf(v);
+			std::lock_guard<std::mutex> lck(s.lock);
+
+			auto i = s.at.find(v);
+
+			if (i == s.at.end())
+				return false;
+
+			result.resize(Length(s, i->second));
+			std::memcpy(result.data(), s.arena.data() + i->second + sizeof(uint16_t), result.size());
+
+			return true;
+		}
+
+		//False when the block isn't kept: the slab is off, the block is too large or its shard is full.
+		//
+
+		bool Insert(uint64_t v, const uint8_t* p, size_t n)
+		{
+			if (!Enabled() || n > Limit())
+				return false;
+
+			auto& s = ShardOf(v);
+			std::lock_guard<std::mutex> lck(s.lock);
+
+			return Add(s, v, p, n, Capacity() / shards_t);
+		}
+
+		void Erase(uint64_t v)
+		{
+			if (!Enabled())
+				return;
+
+			auto& s = ShardOf(v);
+			std::lock_guard<std::mutex> lck(s.lock);
+
+			auto i = s.at.find(v);
+
+			if (i == s.at.end())
+				return;
+
+			Remove(s, i);
+			Pack(s);
+		}
+
+		//The block at from was copied to to.
+		//
+
+		void Move(uint64_t from, uint64_t to)
+		{
+			std::vector<uint8_t> block;
+
+			if (!Find(from, block))
+				return;
+
+			Erase(from);
+			Insert(to, block.data(), block.size());
+		}
+
+		//Drops every entry keep(location) is false for.
+		//
+
+		template < typename F > void Retain(F&& keep)
+		{
+			for (size_t i = 0; i < shards_t; i++)
+			{
+				auto& s = shards[i];
+				std::lock_guard<std::mutex> lck(s.lock);
+
+				for (auto e = s.at.begin(); e != s.at.end(); )
+				{
+					if (!keep(e->first))
+						Remove(s, e++);
+					else
+						e++;
+				}
+
+				Pack(s);
+			}
+		}
+
+		void Save(std::string_view path)
+		{
+			if (!Enabled())
+			{
+				std::filesystem::remove(path);
+				return;
+			}
+
+			std::string temp = std::string(path) + ".tmp";
+
+			{
+				std::ofstream file(temp, std::ios::binary | std::ios::trunc);
+
+				uint64_t header[3] = { magic_t, Limit(), Capacity() };
+				file.write((const char*)header, sizeof(header));
+
+				for (size_t i = 0; i < shards_t; i++)
+				{
+					auto& s = shards[i];
+					std::lock_guard<std::mutex> lck(s.lock);
+
+					for (auto& e : s.at)
+					{
+						file.write((const char*)&e.first, sizeof(uint64_t));
+						file.write((const char*)s.arena.data() + e.second, sizeof(uint16_t) + Length(s, e.second));
+					}
+				}
+			}
+
+			std::filesystem::rename(temp, path);
+		}
+
+		//Restores the entries and the limit and capacity they were kept under.
+		//
+
+		bool Load(std::string_view path)
+		{
+			std::ifstream file(std::string(path), std::ios::binary);
+
+			uint64_t header[3] = {};
+
+			if (!file.read((char*)header, sizeof(header)) || header[0] != magic_t || header[1] > max_block_t)
+				return false;
+
+			limit = header[1];
+			capacity = header[2];
+
+			uint64_t v;
+			uint16_t length;
+			uint8_t block[max_block_t];
+
+			while (file.read((char*)&v, sizeof(uint64_t)) && file.read((char*)&length, sizeof(uint16_t)))
+			{
+				if (length > max_block_t || !file.read((char*)block, length))
+					break;
+
+				Insert(v, block, length);
+			}
+
+			return true;
+		}
+	};
+}
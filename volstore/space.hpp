@@ -0,0 +1,96 @@
+/* Copyright (C) 2020 D8DATAWORKS - All Rights Reserved */
+
+#pragma once
+
+#include <string_view>
+#include <string>
+#include <fstream>
+#include <filesystem>
+#include <map>
+#include <mutex>
+
+#include "location.hpp"
+
+namespace volstore
+{
+	/*
+		Dead bytes per region of each segment, fed by deletes and persisted beside the index.
+		Flatten uses the totals to decide when a segment is worth compacting.
+	*/
+
+	class DeadSpace
+	{
+		static uint64_t constexpr region_t = 64 * 1024 * 1024;
+
+		std::map<uint64_t, uint64_t> regions;
+		std::mutex lock;
+		std::string path;
+
+		static uint64_t Region(uint64_t segment, uint64_t offset)
+		{
+			return (segment << 32) | (offset / region_t);
+		}
+
+	public:
+
+		DeadSpace(std::string_view _path)
+			: path(_path)
+		{
+			if (!std::filesystem::exists(path))
+				return;
+
+			std::ifstream file(path, std::ios::binary);
+
+			uint64_t pair[2];
+			while (file.read((char*)pair, sizeof(pair)))
+				regions[pair[0]] = pair[1];
+		}
+
+		void Flush()
+		{
+			std::lock_guard<std::mutex> lck(lock);
+			std::ofstream file(path, std::ios::binary | std::ios::trunc);
+
+			for (auto& r : regions)
+			{
+				uint64_t pair[2] = { r.first, r.second };
+				file.write((const char*)pair, sizeof(pair));
+			}
+		}
+
+		void Add(uint64_t v, uint64_t bytes)
+		{
+			std::lock_guard<std::mutex> lck(lock);
+			regions[Region(location::segment(v), location::offset(v))] += bytes;
+		}
+
+		uint64_t Segment(uint64_t segment)
+		{
+			std::lock_guard<std::mutex> lck(lock);
+
+			uint64_t total = 0;
+			for (auto i = regions.lower_bound(Region(segment, 0)); i != regions.end() && (i->first >> 32) == segment; i++)
+				total += i->second;
+
+			return total;
+		}
+
+		//f(segment, region start offset, dead bytes)
+		//
+
+		template <typename F> void Enumerate(F&& f)
+		{
+			std::lock_guard<std::mutex> lck(lock);
+
+			for (auto& r : regions)
+				f(r.first >> 32, (r.first & 0xffffffff) * region_t, r.second);
+		}
+
+		void Clear(uint64_t segment)
+		{
+			std::lock_guard<std::mutex> lck(lock);
+
+			regions.erase(regions.lower_bound(Region(segment, 0)), regions.lower_bound(Region(segment + 1, 0)));
+		}
+	};
+}
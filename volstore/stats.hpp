@@ -0,0 +1,48 @@
+/* Copyright (C) 2020 D8DATAWORKS - All Rights Reserved */
+
+#pragma once
+
+#include <atomic>
+
+#include "d8u/util.hpp"
+
+namespace volstore
+{
+	/*
+		Engine statistics, the d8u counters plus what the background work reports.
+	*/
+
+	struct Statistics : public d8u::util::Statistics
+	{
+		struct
+		{
+			std::atomic<uint64_t> blocks = 0;
+			std::atomic<uint64_t> bytes = 0;
+			std::atomic<uint64_t> errors = 0;
+			std::atomic<uint64_t> passes = 0;
+		} scrub;
+
+		struct
+		{
+			std::atomic<uint64_t> negatives = 0;	//Queries answered by the filter alone.
+		} filter;
+
+		struct
+		{
+			std::atomic<uint64_t> hits = 0;
+			std::atomic<uint64_t> misses = 0;
+		} cache;
+
+		struct
+		{
+			std::atomic<uint64_t> blocks = 0;	//Moved to the capacity tier.
+			std::atomic<uint64_t> bytes = 0;
+			std::atomic<uint64_t> sweeps = 0;
+		} tier;
+
+		struct
+		{
+			std::atomic<uint64_t> hits = 0;	//Reads served from the inline slab.
+		} slab;
+	};
+}
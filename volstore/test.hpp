@@ -12,15 +12,19 @@
 #include "http.hpp"
 #include "simple.hpp"
 #include "image.hpp"
+#include "uring.hpp"
 #include "api.hpp"
 
 #include "d8u/util.hpp"
+#include "d8u/crypto.hpp"
 
 using namespace volstore;
 using namespace httplib;
 using namespace d8u::util;
 using namespace api;
 
+using TestHash = d8u::crypto::DefaultHash;
+
 TEST_CASE("API Test", "[volstore::]")
 {
     constexpr auto lim = 100;
@@ -458,5 +462,1878 @@ TEST_CASE("Threaded Image 100,000 Blocks", "[volstore::]")
     std::filesystem::remove_all("testimage");
 }
 
+TEST_CASE("Image Flatten waits for held mappings", "[volstore::]")
+{
+    constexpr auto lim = 10000;
+
+    std::filesystem::remove_all("testimage");
+    filesystem::create_directories("testimage");
+
+    {
+        Image img("testimage");
+
+        auto& bk = singleton<std::array<tdb::RandomKeyT<tdb::Key32>, lim>>(); // Heap
+
+        for (auto& k : bk)
+            img.Write(k, k);
+
+        auto held = img.Map(bk[lim - 1]);
+        REQUIRE(held.size() == 32);
+
+        img.FlattenRate(0);
+        img.Flatten();
+
+        //Past the grace period the old segment is still mapped for the held span:
+        //
+
+        std::this_thread::sleep_for(std::chrono::seconds(15));
+
+        CHECK(img.Flattening());
+        CHECK(std::filesystem::exists("testimage/image.dat"));
+        CHECK(std::equal(held.begin(), held.end(), (uint8_t*)&bk[lim - 1]));
+
+        held = {};
+
+        while (img.Flattening())
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+        CHECK(!std::filesystem::exists("testimage/image.dat"));
+
+        size_t reads = 0;
+
+        for (auto& k : bk)
+        {
+            auto res = img.Read(k);
+
+            if (res.size() == 32 && std::equal(res.begin(), res.end(), (uint8_t*)&k)) reads++;
+        }
+
+        CHECK(lim == reads);
+    }
+
+    std::filesystem::remove_all("testimage");
+}
+
+TEST_CASE("Image2 group commit 10,000 Blocks", "[volstore::]")
+{
+    constexpr auto lim = 10000;
+
+    std::filesystem::remove_all("testimage");
+    filesystem::create_directories("testimage");
+
+    {
+        Image2<TestHash> img("testimage", 0, true);
+
+        auto& bk = singleton<std::array<tdb::RandomKeyT<tdb::Key32>, lim>>(); // Heap
+
+        std::for_each(std::execution::par, bk.begin(), bk.end(), [&](auto k)
+        {
+            img.Write(k, k);
+        });
+
+        CHECK(sizeof(uint64_t) + lim * (32 + sizeof(record::Header)) == d8u::util::GetFileSize("testimage/image.dat"));
+
+        std::atomic<size_t> reads = 0;
+
+        std::for_each(std::execution::par, bk.begin(), bk.end(), [&](auto k)
+        {
+            auto res = img.Read(k);
+
+            if (res.size() == 32 && std::equal(res.begin(), res.end(), (uint8_t*)&k)) reads++;
+        });
+
+        CHECK(lim == reads.load());
+    }
+
+    std::filesystem::remove_all("testimage");
+}
+
+TEST_CASE("Image2 Flatten", "[volstore::]")
+{
+    constexpr auto lim = 10000;
+
+    std::filesystem::remove_all("testimage");
+    filesystem::create_directories("testimage");
+
+    {
+        Image2<TestHash> img("testimage", 0, true);
+
+        auto& bk = singleton<std::array<tdb::RandomKeyT<tdb::Key32>, lim>>(); // Heap
+
+        std::for_each(std::execution::par, bk.begin(), bk.end(), [&](auto k)
+        {
+            img.Write(k, k);
+        });
+
+        img.FlattenRate(0);
+        img.Flatten();
+
+        while (img.Flattening())
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+        CHECK(!std::filesystem::exists("testimage/image.dat"));
+        CHECK(std::filesystem::exists("testimage/image.1.dat"));
+
+        std::atomic<size_t> reads = 0;
+
+        std::for_each(std::execution::par, bk.begin(), bk.end(), [&](auto k)
+        {
+            auto res = img.Read(k);
+
+            if (res.size() == 32 && std::equal(res.begin(), res.end(), (uint8_t*)&k)) reads++;
+        });
+
+        CHECK(lim == reads.load());
+    }
+
+    std::filesystem::remove_all("testimage");
+}
+
+TEST_CASE("Image2 Delete", "[volstore::]")
+{
+    constexpr auto lim = 1000;
+
+    std::filesystem::remove_all("testimage");
+    filesystem::create_directories("testimage");
+
+    {
+        Image2<TestHash> img("testimage", 0, true);
+
+        auto& bk = singleton<std::array<tdb::RandomKeyT<tdb::Key32>, lim>>(); // Heap
+
+        for (auto& k : bk)
+            img.Write(k, k);
+
+        size_t deletes = 0;
+
+        for (size_t i = 0; i < lim; i += 2)
+            if (img.Delete(bk[i])) deletes++;
+
+        CHECK(lim / 2 == deletes);
+        CHECK(lim / 2 * (32 + sizeof(record::Header) * 2) == img.Dead().Segment(0)); //Block and its tombstone record
+
+        size_t finds = 0;
+
+        for (auto& k : bk)
+            if (img.Is(k)) finds++;
+
+        CHECK(lim / 2 == finds);
+        CHECK(!img.Read(bk[0]).size());
+        CHECK(!img.Delete(bk[0]));
+    }
+
+    std::filesystem::remove_all("testimage");
+}
+
+TEST_CASE("CRC32C", "[volstore::]")
+{
+    std::string_view check = "123456789";
+
+    CHECK(0xE3069283 == crc32c::extend(0, check.data(), check.size()));
+    CHECK(0xE3069283 == ~crc32c::software(~uint32_t(0), (const uint8_t*)check.data(), check.size()));
+}
+
+TEST_CASE("Image2 Rebuild index", "[volstore::]")
+{
+    constexpr auto lim = 10000;
+
+    std::filesystem::remove_all("testimage");
+    filesystem::create_directories("testimage");
+
+    auto& bk = singleton<std::array<tdb::RandomKeyT<tdb::Key32>, lim>>(); // Heap
+
+    {
+        Image2<TestHash> img("testimage", 0, true);
+
+        std::for_each(std::execution::par, bk.begin(), bk.end(), [&](auto k)
+        {
+            img.Write(k, k);
+        });
+
+        for (size_t i = 0; i < lim; i += 2)
+            img.Delete(bk[i]);
+
+        img.Sync();
+    }
+
+    std::filesystem::remove("testimage/index.db");
+
+    {
+        Image2<TestHash> img("testimage", 4);
+
+        std::atomic<size_t> reads = 0, finds = 0;
+
+        std::for_each(std::execution::par, bk.begin(), bk.end(), [&](auto k)
+        {
+            if (img.Is(k)) finds++;
+
+            auto res = img.Read(k);
+
+            if (res.size() == 32 && std::equal(res.begin(), res.end(), (uint8_t*)&k)) reads++;
+        });
+
+        CHECK(lim / 2 == finds.load());
+        CHECK(lim / 2 == reads.load());
+    }
+
+    //Without filter.db too, the filter starts empty and only the rebuild can fill it:
+    //
+
+    std::filesystem::remove("testimage/index.db");
+    std::filesystem::remove("testimage/filter.db");
+
+    {
+        Image2<TestHash> img("testimage", 4);
+
+        size_t finds = 0;
+
+        for (auto& k : bk)
+            if (img.Is(k)) finds++;
+
+        CHECK(lim / 2 == finds);
+    }
+
+    std::filesystem::remove_all("testimage");
+}
+
+TEST_CASE("Image2 index of another type", "[volstore::]")
+{
+    constexpr auto lim = 1000;
+
+    std::filesystem::remove_all("testimage");
+    filesystem::create_directories("testimage");
+
+    auto& bk = singleton<std::array<tdb::RandomKeyT<tdb::Key32>, lim>>(); // Heap
+
+    {
+        Image2Compact<TestHash> img("testimage");
+
+        for (auto& k : bk)
+            img.Write(k, k);
+    }
+
+    //Refused rather than misread, the segments rebuild it once it is out of the way:
+    //
+
+    CHECK_THROWS(Image2<TestHash, OptimisticIndex>("testimage"));
+    CHECK(!std::filesystem::exists("testimage/lock.db"));
+
+    std::filesystem::rename("testimage/index.db", "testimage/index.compact.db");
+
+    {
+        Image2<TestHash, OptimisticIndex> img("testimage", 4);
+
+        size_t finds = 0;
+
+        for (auto& k : bk)
+            if (img.Is(k)) finds++;
+
+        CHECK(lim == finds);
+    }
+
+    std::filesystem::remove_all("testimage");
+}
+
+TEST_CASE("Image2 journal replay", "[volstore::]")
+{
+    constexpr auto lim = 1000;
+
+    std::filesystem::remove_all("testimage");
+    std::filesystem::remove_all("testimage2");
+    filesystem::create_directories("testimage");
+
+    auto& bk = singleton<std::array<tdb::RandomKeyT<tdb::Key32>, lim>>(); // Heap
+
+    {
+        Image2<TestHash> img("testimage", 0, true);
+
+        for (auto& k : bk)
+            img.Write(k, k);
+
+        for (size_t i = 0; i < lim; i += 2)
+            img.Delete(bk[i]);
+
+        img.Sync();
+
+        //Snapshot of a running image, as a crash would leave it:
+        //
+
+        std::filesystem::copy("testimage", "testimage2");
+    }
+
+    {
+        Image2<TestHash> img("testimage2", 1);
+
+        size_t finds = 0;
+
+        for (auto& k : bk)
+            if (img.Is(k)) finds++;
+
+        CHECK(lim / 2 == finds);
+    }
+
+    std::filesystem::remove_all("testimage");
+    std::filesystem::remove_all("testimage2");
+}
+
+TEST_CASE("Image2 locked open", "[volstore::]")
+{
+    constexpr auto lim = 1000;
+
+    std::filesystem::remove_all("testimage");
+    filesystem::create_directories("testimage");
+
+    auto& bk = singleton<std::array<tdb::RandomKeyT<tdb::Key32>, lim>>(); // Heap
+
+    auto finds = [&](auto& img)
+    {
+        size_t result = 0;
+
+        for (auto& k : bk)
+            if (img.Is(k)) result++;
+
+        return result;
+    };
+
+    {
+        Image2<TestHash> img("testimage", 0, true);
+
+        for (auto& k : bk)
+            img.Write(k, k);
+
+        img.Sync();
+
+        //A second open fails before it replays or checkpoints anything, and leaves the holder's lock alone:
+        //
+
+        CHECK_THROWS(Image2<TestHash>("testimage"));
+        CHECK(std::filesystem::exists("testimage/lock.db"));
+        CHECK(lim == finds(img));
+    }
+
+    CHECK(!std::filesystem::exists("testimage/lock.db"));
+
+    {
+        Image2<TestHash> img("testimage");
+
+        CHECK(lim == finds(img));
+    }
+
+    std::filesystem::remove_all("testimage");
+}
 
+TEST_CASE("Image2 journal replay drops lost records", "[volstore::]")
+{
+    constexpr auto lim = 1000;
+
+    std::filesystem::remove_all("testimage");
+    std::filesystem::remove_all("testimage2");
+    std::filesystem::remove_all("testimage3");
+    filesystem::create_directories("testimage");
+
+    auto& bk = singleton<std::array<tdb::RandomKeyT<tdb::Key32>, lim>>(); // Heap
+
+    uint64_t size = 0;
+
+    {
+        Image2<TestHash> img("testimage", 0, true);
+
+        for (size_t i = 0; i < lim / 2; i++)
+            img.Write(bk[i], bk[i]);
+    }
+
+    //The index as checkpointed and how far the data file got by then:
+    //
+
+    std::filesystem::copy("testimage", "testimage3");
+    size = std::filesystem::file_size("testimage/image.dat");
+
+    {
+        Image2<TestHash> img("testimage", 0, true);
+
+        for (size_t i = lim / 2; i < lim; i++)
+            img.Write(bk[i], bk[i]);
+
+        img.Sync();
+
+        std::filesystem::copy("testimage", "testimage2");
+    }
+
+    //A crash where the journal was synced but the data of the second half wasn't:
+    //
+
+    std::filesystem::copy("testimage3/index.db", "testimage2/index.db", std::filesystem::copy_options::overwrite_existing);
+    std::filesystem::resize_file("testimage2/image.dat", size);
+
+    {
+        Image2<TestHash> img("testimage2", 1);
+
+        size_t first = 0, second = 0;
+
+        for (size_t i = 0; i < lim; i++)
+        {
+            auto res = img.Read(bk[i]);
+            bool found = img.Is(bk[i]) && res.size() == 32 && std::equal(res.begin(), res.end(), (uint8_t*)&bk[i]);
+
+            ((i < lim / 2) ? first : second) += found;
+        }
+
+        CHECK(lim / 2 == first);
+        CHECK(0 == second);
+    }
+
+    std::filesystem::remove_all("testimage");
+    std::filesystem::remove_all("testimage2");
+    std::filesystem::remove_all("testimage3");
+}
+
+TEST_CASE("Image2 sharded index 100,000 Blocks", "[volstore::]")
+{
+    constexpr auto lim = 100000;
+
+    std::filesystem::remove_all("testimage");
+    filesystem::create_directories("testimage");
+
+    {
+        Image2Sharded<TestHash> img("testimage");
+
+        auto& bk = singleton<std::array<tdb::RandomKeyT<tdb::Key32>, lim>>(); // Heap
+
+        std::for_each(std::execution::par, bk.begin(), bk.end(), [&](auto k)
+        {
+            img.Write(k, k);
+        });
+
+        img.Sync();
+
+        CHECK(std::filesystem::exists("testimage/index.15.db"));
+
+        std::atomic<size_t> reads = 0;
+
+        std::for_each(std::execution::par, bk.begin(), bk.end(), [&](auto k)
+        {
+            auto res = img.Read(k);
+
+            if (res.size() == 32 && std::equal(res.begin(), res.end(), (uint8_t*)&k)) reads++;
+        });
+
+        CHECK(lim == reads.load());
+    }
+
+    std::filesystem::remove_all("testimage");
+}
+
+TEST_CASE("Image2 optimistic index mixed IO", "[volstore::]")
+{
+    constexpr auto lim = 100000;
+
+    std::filesystem::remove_all("testimage");
+    filesystem::create_directories("testimage");
+
+    {
+        Image2<TestHash, OptimisticIndex> img("testimage");
+
+        auto& bk = singleton<std::array<tdb::RandomKeyT<tdb::Key32>, lim>>(); // Heap
+
+        std::atomic<size_t> bad = 0;
+
+        //Readers race the inserts, a key is either missing or complete:
+        //
+
+        std::thread reader([&]()
+        {
+            for (auto& k : bk)
+            {
+                auto res = img.Read(k);
+
+                if (res.size() && !std::equal(res.begin(), res.end(), (uint8_t*)&k)) bad++;
+            }
+        });
+
+        std::for_each(std::execution::par, bk.begin(), bk.end(), [&](auto k)
+        {
+            img.Write(k, k);
+        });
+
+        reader.join();
+
+        size_t finds = 0;
+
+        for (auto& k : bk)
+            if (img.Is(k)) finds++;
+
+        CHECK(0 == bad.load());
+        CHECK(lim == finds);
+    }
+
+    std::filesystem::remove_all("testimage");
+}
+
+TEST_CASE("Image2 negative lookup filter", "[volstore::]")
+{
+    constexpr auto lim = 10000;
+
+    std::filesystem::remove_all("testimage");
+    filesystem::create_directories("testimage");
+
+    auto& bk = singleton<std::array<tdb::RandomKeyT<tdb::Key32>, lim>>(); // Heap
+    std::vector<tdb::RandomKeyT<tdb::Key32>> unknown(lim);
+
+    {
+        Image2<TestHash, OptimisticIndex> img("testimage");
+
+        for (auto& k : bk)
+            img.Write(k, k);
+
+        size_t finds = 0, false_finds = 0;
+
+        for (auto& k : bk)
+            if (img.Is(k)) finds++;
+
+        for (auto& k : unknown)
+            if (img.Is(k)) false_finds++;
+
+        CHECK(lim == finds);
+        CHECK(0 == false_finds);
+        CHECK(img.Stats()->filter.negatives > lim * 9 / 10);
+    }
+
+    //Rebuilt from the index on open:
+    //
+
+    {
+        Image2<TestHash, OptimisticIndex> img("testimage");
+
+        size_t finds = 0;
+
+        for (auto& k : bk)
+            if (img.Is(k)) finds++;
+
+        for (auto& k : unknown)
+            img.Is(k);
+
+        CHECK(lim == finds);
+        CHECK(img.Stats()->filter.negatives > lim * 9 / 10);
+    }
+
+    std::filesystem::remove_all("testimage");
+}
+
+TEST_CASE("Negative lookup filter growth", "[volstore::]")
+{
+    constexpr auto lim = 100000;
+
+    std::vector<tdb::RandomKeyT<tdb::Key32>> keys(lim), unknown(lim);
+
+    auto misses = [&](auto& filter, size_t count)
+    {
+        size_t result = 0;
+
+        for (size_t i = 0; i < count; i++)
+            if (!filter.Maybe(keys[i])) result++;
+
+        return result;
+    };
+
+    auto false_positives = [&](auto& filter)
+    {
+        size_t result = 0;
+
+        for (auto& k : unknown)
+            if (filter.Maybe(k)) result++;
+
+        return result;
+    };
+
+    //Sized for a tenth of the keys, grows as they go in:
+    //
+
+    {
+        BloomFilter filter;
+        filter.Reset(lim / 10, 0);
+
+        std::vector<std::thread> adds;
+
+        for (size_t t = 0; t < 4; t++)
+            adds.emplace_back([&, t]()
+            {
+                for (size_t i = t; i < lim; i += 4)
+                    filter.Add(keys[i]);
+            });
+
+        for (auto& t : adds)
+            t.join();
+
+        CHECK(filter.Depth() >= 3);
+        CHECK(0 == misses(filter, lim));
+        CHECK(false_positives(filter) < lim / 20);
+    }
+
+    //Saved and loaded with every table and the key count:
+    //
+
+    {
+        BloomFilter filter;
+        filter.Reset(lim / 10, 0);
+
+        for (size_t i = 0; i < lim / 2; i++)
+            filter.Add(keys[i]);
+
+        filter.Save("filter.db");
+
+        BloomFilter loaded;
+
+        CHECK(loaded.Load("filter.db"));
+        CHECK(filter.Depth() == loaded.Depth());
+        CHECK(0 == misses(loaded, lim / 2));
+
+        for (size_t i = lim / 2; i < lim; i++)
+            loaded.Add(keys[i]);
+
+        CHECK(filter.Depth() < loaded.Depth());
+        CHECK(0 == misses(loaded, lim));
+    }
+
+    std::filesystem::remove("filter.db");
+}
+
+TEST_CASE("Image2 batched Many", "[volstore::]")
+{
+    constexpr auto lim = 64 * 1000;
+
+    std::filesystem::remove_all("testimage");
+    filesystem::create_directories("testimage");
+
+    {
+        Image2<TestHash, ShardedIndex<4, OptimisticIndex>> img("testimage");
+
+        auto& bk = singleton<std::array<tdb::RandomKeyT<tdb::Key32>, lim>>(); // Heap
+
+        for (size_t i = 0; i < lim; i += 2)
+            img.Write(bk[i], bk[i]);
+
+        size_t mismatches = 0;
+
+        for (size_t i = 0; i < lim; i += 64)
+        {
+            auto found = img.Many<32>(gsl::span<uint8_t>((uint8_t*)&bk[i], 64 * 32));
+
+            for (size_t j = 0; j < 64; j++)
+                if (((found >> j) & 1) != img.Is(bk[i + j])) mismatches++;
+
+            if (found != 0x5555555555555555) mismatches++;
+        }
+
+        CHECK(0 == mismatches);
+    }
+
+    std::filesystem::remove_all("testimage");
+}
+
+TEST_CASE("ManyBitmap 100,000 keys", "[volstore::]")
+{
+    constexpr auto lim = 100000;
+
+    std::filesystem::remove_all("testimage");
+    filesystem::create_directories("testimage");
+
+    {
+        Image2<TestHash> backend("testimage");
+        HttpStore<Image2<TestHash>> srv(backend);
+
+        HttpStoreClient img;
+
+        auto& bk = singleton<std::array<tdb::RandomKeyT<tdb::Key32>, lim>>(); // Heap
+
+        for (size_t i = 0; i < lim; i += 3)
+            backend.Write(bk[i], bk[i]);
+
+        auto ids = span<uint8_t>((uint8_t*)bk.data(), lim * 32);
+
+        auto local = backend.ManyBitmap<32>(ids);
+        auto remote = img.ManyBitmap<32>(ids);
+
+        size_t mismatches = 0;
+
+        for (size_t i = 0; i < lim; i++)
+            if (bitmap::get(local.data(), i) != (i % 3 == 0)) mismatches++;
+
+        CHECK(0 == mismatches);
+        CHECK(local == remote);
+        CHECK((lim + 2) / 3 == bitmap::count(remote));
+    }
+
+    std::filesystem::remove_all("testimage");
+}
+
+TEST_CASE("Binary ManyBitmap 100,000 keys", "[volstore::]")
+{
+    constexpr auto lim = 100000;
+
+    std::filesystem::remove_all("testimage");
+    filesystem::create_directories("testimage");
+
+    {
+        Image2<TestHash> backend("testimage");
+        BinaryStore<Image2<TestHash>> srv(backend);
+
+        BinaryStoreClient bin;
+
+        auto& bk = singleton<std::array<tdb::RandomKeyT<tdb::Key32>, lim>>(); // Heap
+
+        for (size_t i = 0; i < lim; i += 3)
+            backend.Write(bk[i], bk[i]);
+
+        auto ids = span<uint8_t>((uint8_t*)bk.data(), lim * 32);
+
+        auto local = backend.ManyBitmap<32>(ids);
+        auto remote = bin.ManyBitmap<32>(ids);
+
+        CHECK(local == remote);
+        CHECK((lim + 2) / 3 == bitmap::count(remote));
+
+        //Again with the client cache warm from the first pass:
+        //
+
+        CHECK(local == bin.ManyBitmap<32>(ids));
+    }
+
+    std::filesystem::remove_all("testimage");
+}
+
+TEST_CASE("Protocol Delete", "[volstore::]")
+{
+    constexpr auto lim = 256;
+
+    std::filesystem::remove_all("testimage");
+    filesystem::create_directories("testimage");
+
+    {
+        Image2<TestHash> backend("testimage");
+        HttpStore<Image2<TestHash>> srv(backend);
+        BinaryStore<Image2<TestHash>> bsrv(backend);
+
+        HttpStoreClient img;
+        BinaryStoreClient bin;
+
+        auto& bk = singleton<std::array<tdb::RandomKeyT<tdb::Key32>, lim>>(); // Heap
+
+        for (auto& k : bk)
+            backend.Write(k, k);
+
+        //Single deletes, then the same keys again in a batch with the rest of their half:
+        //
+
+        auto many = [&](auto& client, size_t first)
+        {
+            size_t deleted = 0;
+
+            for (size_t i = first; i < first + lim / 2; i += 64)
+                deleted += std::bitset<64>(client.template DeleteMany<32>(span<uint8_t>((uint8_t*)&bk[i], 32 * 64))).count();
+
+            return deleted;
+        };
+
+        size_t deleted = 0;
+
+        for (size_t i = 0; i < 64; i++)
+            if (img.Delete(bk[i])) deleted++;
+
+        CHECK(64 == deleted);
+        CHECK(64 == many(img, 0));
+
+        deleted = 0;
+
+        for (size_t i = lim / 2; i < lim / 2 + 64; i++)
+            if (bin.Delete(bk[i])) deleted++;
+
+        CHECK(64 == deleted);
+        CHECK(64 == many(bin, lim / 2));
+
+        size_t finds = 0, remote = 0;
+
+        for (auto& k : bk)
+        {
+            if (backend.Is(k)) finds++;
+            if (bin.Is(k)) remote++;
+        }
+
+        CHECK(0 == finds);
+        CHECK(0 == remote);
+        CHECK(0 == many(img, 0));
+        CHECK(0 == many(bin, lim / 2));
+    }
+
+    std::filesystem::remove_all("testimage");
+}
+
+TEST_CASE("Protocol stored reads", "[volstore::]")
+{
+    constexpr auto lim = 100;
+
+    std::filesystem::remove_all("testimage");
+    filesystem::create_directories("testimage");
+
+    {
+        Image2<TestHash> backend("testimage");
+        HttpStore<Image2<TestHash>> srv(backend);
+        BinaryStore<Image2<TestHash>> bsrv(backend);
+
+        HttpStoreClient img;
+        BinaryStoreClient bin;
+
+        //Compressible blocks under the first codec built in, raw without one:
+        //
+
+        uint8_t used = codec::none;
+
+        for (uint8_t c : { codec::lz4, codec::zstd })
+            if (used == codec::none && codec::supported(c))
+                used = c;
+
+        if (used != codec::none)
+            backend.Compression(used);
+
+        auto& bk = singleton<std::array<tdb::RandomKeyT<tdb::Key32>, lim>>(); // Heap
+
+        auto block = [&](size_t i) { return std::vector<uint8_t>(4096, (uint8_t)i); };
+
+        for (size_t i = 0; i < lim; i++)
+            backend.Write(bk[i], block(i));
+
+        auto decoded = [&](auto& client)
+        {
+            size_t result = 0;
+
+            for (size_t i = 0; i < lim; i++)
+            {
+                uint8_t c = 0xFF;
+                auto res = client.ReadStored(bk[i], c);
+
+                std::vector<uint8_t> out(codec::length(c, res.data(), res.size()));
+
+                if (c == used && codec::decompress(c, res.data(), res.size(), out.data()) && out == block(i))
+                    result++;
+            }
+
+            return result;
+        };
+
+        CHECK(lim == decoded(img));
+        CHECK(lim == decoded(bin));
+    }
+
+    std::filesystem::remove_all("testimage");
+}
+
+TEST_CASE("Image2 fingerprint index reopen", "[volstore::]")
+{
+    constexpr auto lim = 100000;
+
+    std::filesystem::remove_all("testimage");
+    filesystem::create_directories("testimage");
+
+    auto& bk = singleton<std::array<tdb::RandomKeyT<tdb::Key32>, lim>>(); // Heap
+
+    {
+        Image2Compact<TestHash> img("testimage");
+
+        std::for_each(std::execution::par, bk.begin(), bk.end(), [&](auto k)
+        {
+            img.Write(k, k);
+        });
+    }
+
+    {
+        Image2Compact<TestHash> img("testimage");
+
+        size_t finds = 0, reads = 0;
+
+        for (auto& k : bk)
+        {
+            if (img.Is(k)) finds++;
+
+            auto res = img.Read(k);
+
+            if (res.size() == 32 && std::equal(res.begin(), res.end(), (uint8_t*)&k))
+                reads++;
+        }
+
+        CHECK(lim == finds);
+        CHECK(lim == reads);
+        CHECK(std::filesystem::exists("testimage/index.keys.db"));
+    }
+
+    std::filesystem::remove_all("testimage");
+}
+
+TEST_CASE("Image2 lsm index reopen", "[volstore::]")
+{
+    constexpr auto lim = 100000;
+
+    std::filesystem::remove_all("testimage");
+    filesystem::create_directories("testimage");
+
+    auto& bk = singleton<std::array<tdb::RandomKeyT<tdb::Key32>, lim>>(); // Heap
+
+    {
+        Image2Lsm<TestHash> img("testimage");
+
+        std::for_each(std::execution::par, bk.begin(), bk.end(), [&](auto k)
+        {
+            img.Write(k, k);
+        });
+    }
+
+    {
+        Image2Lsm<TestHash> img("testimage");
+
+        size_t finds = 0, reads = 0, misses = 0;
+
+        for (auto& k : bk)
+        {
+            if (img.Is(k)) finds++;
+
+            auto res = img.Read(k);
+
+            if (res.size() == 32 && std::equal(res.begin(), res.end(), (uint8_t*)&k))
+                reads++;
+
+            tdb::RandomKeyT<tdb::Key32> unknown;
+
+            if (img.Is(unknown)) misses++;
+        }
+
+        CHECK(lim == finds);
+        CHECK(lim == reads);
+        CHECK(0 == misses);
+    }
+
+    std::filesystem::remove_all("testimage");
+}
+
+TEST_CASE("Growing index", "[volstore::]")
+{
+    constexpr auto lim = 200000;
+
+    std::filesystem::remove_all("testindex");
+    filesystem::create_directories("testindex");
+
+    auto& bk = singleton<std::array<tdb::RandomKeyT<tdb::Key32>, lim>>(); // Heap
+
+    {
+        GrowingIndex<> db("testindex/index.db", 1024);
+
+        std::for_each(std::execution::par, bk.begin(), bk.end(), [&](auto& k)
+        {
+            db.InsertLock(k, *((uint64_t*)&k));
+        });
+
+        size_t finds = 0;
+
+        for (auto& k : bk)
+        {
+            auto v = db.FindLock(k);
+
+            if (v && *v == *((uint64_t*)&k))
+                finds++;
+        }
+
+        CHECK(lim == finds);
+        CHECK(db.Levels() > 1);
+        CHECK(db.InsertLock(bk[0], 0).second);
+    }
+
+    {
+        GrowingIndex<> db("testindex/index.db");
+
+        size_t finds = 0;
+
+        for (auto& k : bk)
+            if (db.FindLock(k))
+                finds++;
+
+        CHECK(lim == finds);
+    }
+
+    std::filesystem::remove_all("testindex");
+}
+
+TEST_CASE("Image2 read after write", "[volstore::]")
+{
+    constexpr auto lim = 100000;
+
+    std::filesystem::remove_all("testimage");
+    filesystem::create_directories("testimage");
+
+    auto& bk = singleton<std::array<tdb::RandomKeyT<tdb::Key32>, lim>>(); // Heap
+
+    {
+        Image2<TestHash, OptimisticIndex> img("testimage");
+
+        std::atomic<size_t> reads = 0;
+
+        std::for_each(std::execution::par, bk.begin(), bk.end(), [&](auto k)
+        {
+            img.Write(k, k);
+
+            auto res = img.Read(k);
+
+            if (res.size() == 32 && std::equal(res.begin(), res.end(), (uint8_t*)&k))
+                reads++;
+        });
+
+        CHECK(lim == reads);
+    }
+
+    std::filesystem::remove_all("testimage");
+}
+
+TEST_CASE("Image2 block cache", "[volstore::]")
+{
+    constexpr auto lim = 20000;
+    constexpr auto hot = 500;
+
+    std::filesystem::remove_all("testimage");
+    filesystem::create_directories("testimage");
+
+    auto& bk = singleton<std::array<tdb::RandomKeyT<tdb::Key32>, lim>>(); // Heap
+
+    {
+        Image2<TestHash, OptimisticIndex> img("testimage");
+
+        for (auto& k : bk)
+            img.Write(k, k);
+
+        img.CacheSize(64 * 1024);
+
+        //The hot blocks stay cached through a scan of everything else:
+        //
+
+        for (size_t round = 0; round < 4; round++)
+            for (size_t i = 0; i < hot; i++)
+                img.Read(bk[i]);
+
+        auto hits = img.Stats()->cache.hits.load();
+
+        for (auto& k : bk)
+            img.Read(k);
+
+        for (size_t i = 0; i < hot; i++)
+        {
+            auto res = img.Read(bk[i]);
+            CHECK(32 == res.size());
+            CHECK(std::equal(res.begin(), res.end(), (uint8_t*)&bk[i]));
+        }
+
+        CHECK(hits >= hot * 2);
+        CHECK(img.Stats()->cache.hits.load() >= hits + hot);
+
+        img.Delete(bk[0]);
+        CHECK(0 == img.Read(bk[0]).size());
+    }
+
+    std::filesystem::remove_all("testimage");
+}
+
+TEST_CASE("Image2 compressed blocks", "[volstore::]")
+{
+    constexpr auto lim = 10000;
+
+    auto& bk = singleton<std::array<tdb::RandomKeyT<tdb::Key32>, lim>>(); // Heap
+
+    for (uint8_t c : { codec::lz4, codec::zstd })
+    {
+        std::filesystem::remove_all("testimage");
+        filesystem::create_directories("testimage");
+
+        if (!codec::supported(c))
+        {
+            WARN("Codec " << (int)c << " not built in, define VOLSTORE_LZ4 / VOLSTORE_ZSTD to test it");
+            CHECK_THROWS(Image2<TestHash, OptimisticIndex>("testimage").Compression(c));
+            continue;
+        }
+
+        //Even blocks compress, odd ones are made of random keys and stay raw:
+        //
+
+        auto block = [&](size_t i)
+        {
+            std::vector<uint8_t> result(4096, (uint8_t)i);
+
+            if (i % 2)
+                for (size_t j = 0; j < result.size(); j++)
+                    result[j] = ((uint8_t*)&bk[(i + j / 32) % lim])[j % 32];
+
+            return result;
+        };
+
+        {
+            Image2<TestHash, OptimisticIndex> img("testimage");
+            img.Compression(c);
+
+            for (size_t i = 0; i < lim; i++)
+                img.Write(bk[i], block(i));
+
+            uint8_t even = codec::none, odd = codec::none;
+
+            img.ReadStored(bk[0], even);
+            img.ReadStored(bk[1], odd);
+
+            CHECK(c == even);
+            CHECK(codec::none == odd);
+        }
+
+        {
+            Image2<TestHash, OptimisticIndex> img("testimage");
+
+            size_t reads = 0;
+
+            for (size_t i = 0; i < lim; i++)
+            {
+                auto res = img.Read(bk[i]);
+                auto expected = block(i);
+
+                if (res.size() == expected.size() && std::equal(res.begin(), res.end(), expected.begin()))
+                    reads++;
+            }
+
+            CHECK(lim == reads);
+        }
+    }
+
+    std::filesystem::remove_all("testimage");
+}
+
+TEST_CASE("Image2 segment files", "[volstore::]")
+{
+    constexpr auto lim = 10000;
+
+    std::filesystem::remove_all("testimage");
+    filesystem::create_directories("testimage");
+
+    auto& bk = singleton<std::array<tdb::RandomKeyT<tdb::Key32>, lim>>(); // Heap
+
+    auto block = [&](size_t i) { return std::vector<uint8_t>(1024 + i % 1024, (uint8_t)i); };
+
+    auto reads = [&](auto& img, size_t from)
+    {
+        size_t result = 0;
+
+        for (size_t i = from; i < lim; i++)
+        {
+            auto res = img.Read(bk[i]);
+            auto expected = block(i);
+
+            if (res.size() == expected.size() && std::equal(res.begin(), res.end(), expected.begin()))
+                result++;
+        }
+
+        return result;
+    };
+
+    auto segments = [&]()
+    {
+        size_t result = 0;
+
+        for (uint64_t s = 0; s < location::segments_t; s++)
+            result += std::filesystem::exists(location::path("testimage", s));
+
+        return result;
+    };
+
+    {
+        Image2<TestHash, OptimisticIndex> img("testimage");
+        img.SegmentSize(1024 * 1024);
+
+        //The manager seals a full segment once a second:
+        //
+
+        for (size_t i = 0; i < lim; i++)
+        {
+            img.Write(bk[i], block(i));
+
+            if (i % 2000 == 1999)
+                std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+        }
+
+        CHECK(segments() > 2);
+        CHECK(lim == reads(img, 0));
+    }
+
+    {
+        Image2<TestHash, OptimisticIndex> img("testimage");
+
+        CHECK(lim == reads(img, 0));
+
+        for (size_t i = 0; i < lim / 2; i++)
+            img.Delete(bk[i]);
+
+        img.FlattenRate(0);
+        img.Flatten();
+
+        while (img.Flattening())
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+        CHECK(1 == segments());
+        CHECK(lim - lim / 2 == reads(img, lim / 2));
+    }
+
+    std::filesystem::remove_all("testimage");
+}
+
+TEST_CASE("Image2 striped devices", "[volstore::]")
+{
+    constexpr auto lim = 10000;
+
+    std::filesystem::remove_all("testimage");
+    filesystem::create_directories("testimage/d0");
+    filesystem::create_directories("testimage/d1");
+
+    std::vector<std::string> devices = { "testimage/d0", "testimage/d1" };
+
+    auto& bk = singleton<std::array<tdb::RandomKeyT<tdb::Key32>, lim>>(); // Heap
+
+    auto reads = [&](auto& img)
+    {
+        std::atomic<size_t> result = 0;
+
+        std::for_each(std::execution::par, bk.begin(), bk.end(), [&](auto k)
+        {
+            auto res = img.Read(k);
+
+            if (res.size() == 32 && std::equal(res.begin(), res.end(), (uint8_t*)&k)) result++;
+        });
+
+        return result.load();
+    };
+
+    {
+        Image2<TestHash, OptimisticIndex> img("testimage", devices);
+
+        std::for_each(std::execution::par, bk.begin(), bk.end(), [&](auto k)
+        {
+            img.Write(k, k);
+        });
+
+        CHECK(lim == reads(img));
+    }
+
+    CHECK(!std::filesystem::exists("testimage/image.dat"));
+    CHECK(std::filesystem::file_size(location::path("testimage/d0", 0)) > lim / 4 * 32);
+    CHECK(std::filesystem::file_size(location::path("testimage/d1", 1)) > lim / 4 * 32);
+
+    {
+        Image2<TestHash, OptimisticIndex> img("testimage", devices);
+
+        CHECK(lim == reads(img));
+    }
+
+    std::filesystem::remove_all("testimage");
+}
+
+TEST_CASE("Image2 tiered storage", "[volstore::]")
+{
+    constexpr auto lim = 10000;
+    constexpr auto hot = 100;
+
+    std::filesystem::remove_all("testimage");
+    filesystem::create_directories("testimage/fast");
+    filesystem::create_directories("testimage/cold");
+
+    std::vector<std::string> fast = { "testimage/fast" }, cold = { "testimage/cold" };
+
+    auto& bk = singleton<std::array<tdb::RandomKeyT<tdb::Key32>, lim>>(); // Heap
+
+    auto reads = [&](auto& img)
+    {
+        size_t result = 0;
+
+        for (auto& k : bk)
+        {
+            auto res = img.Read(k);
+
+            if (res.size() == 32 && std::equal(res.begin(), res.end(), (uint8_t*)&k)) result++;
+        }
+
+        return result;
+    };
+
+    {
+        Image2<TestHash, OptimisticIndex> img("testimage", fast, cold);
+        img.SegmentSize(1024);
+        img.FlattenRate(0);
+
+        for (auto& k : bk)
+            img.Write(k, k);
+
+        //Sealed on the next manager tick, then only the hot blocks keep being read:
+        //
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+        img.TierAge(1);
+
+        for (size_t i = 0; i < 300 && img.Stats()->tier.blocks < lim - hot; i++)
+        {
+            for (size_t j = 0; j < hot; j++)
+                img.Read(bk[j]);
+
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+
+        CHECK(lim - hot == img.Stats()->tier.blocks.load());
+        CHECK(lim == reads(img));
+    }
+
+    uint64_t moved = 0;
+
+    for (auto& f : std::filesystem::directory_iterator("testimage/cold"))
+        moved += f.file_size();
+
+    CHECK(moved > (lim - hot) * 32);
+
+    {
+        Image2<TestHash, OptimisticIndex> img("testimage", fast, cold);
+
+        CHECK(lim == reads(img));
+    }
+
+    std::filesystem::remove_all("testimage");
+}
+
+TEST_CASE("Image2 inline tiny blocks", "[volstore::]")
+{
+    constexpr auto lim = 10000;
+
+    std::filesystem::remove_all("testimage");
+    filesystem::create_directories("testimage");
+
+    auto& bk = singleton<std::array<tdb::RandomKeyT<tdb::Key32>, lim>>(); // Heap
+
+    auto reads = [&](auto& img)
+    {
+        size_t result = 0;
+
+        for (auto& k : bk)
+        {
+            auto res = img.Read(k);
+
+            if (res.size() == 32 && std::equal(res.begin(), res.end(), (uint8_t*)&k)) result++;
+        }
+
+        return result;
+    };
+
+    {
+        Image2<TestHash, OptimisticIndex> img("testimage");
+        img.InlineSize(64);
+
+        for (auto& k : bk)
+            img.Write(k, k);
+
+        CHECK(lim == reads(img));
+        CHECK(lim == img.Stats()->slab.hits.load());
+    }
+
+    //slab.db keeps the blocks and the setting:
+    //
+
+    {
+        Image2<TestHash, OptimisticIndex> img("testimage");
+
+        CHECK(lim == reads(img));
+        CHECK(lim == img.Stats()->slab.hits.load());
+
+        img.InlineSize(0);
+
+        CHECK(lim == reads(img));
+        CHECK(lim == img.Stats()->slab.hits.load());
+    }
+
+    CHECK(!std::filesystem::exists("testimage/slab.db"));
+
+    //Past its capacity the slab refuses blocks, they are read from the data files:
+    //
+
+    {
+        Image2<TestHash, OptimisticIndex> img("testimage");
+        img.InlineSize(64);
+        img.InlineCapacity(lim / 4 * (32 + sizeof(uint16_t)));
+
+        CHECK(lim == reads(img));
+
+        auto hits = img.Stats()->slab.hits.load();
+
+        CHECK(lim == reads(img));
+        CHECK(img.Stats()->slab.hits.load() - hits > 0);
+        CHECK(img.Stats()->slab.hits.load() - hits <= lim / 4);
+
+        img.InlineCapacity(0);
+
+        hits = img.Stats()->slab.hits.load();
+
+        CHECK(lim == reads(img));
+        CHECK(img.Stats()->slab.hits.load() == hits);
+    }
+
+    std::filesystem::remove_all("testimage");
+}
+
+TEST_CASE("Image2 direct io", "[volstore::]")
+{
+    constexpr auto lim = 10000;
+
+    std::filesystem::remove_all("testimage");
+    filesystem::create_directories("testimage");
+
+    auto& bk = singleton<std::array<tdb::RandomKeyT<tdb::Key32>, lim>>(); // Heap
+
+    //Sizes that leave records straddling block boundaries:
+    //
+
+    auto block = [&](size_t i) { return std::vector<uint8_t>(1 + i * 37 % 9000, (uint8_t)i); };
+
+    auto reads = [&](auto& img, size_t from)
+    {
+        size_t result = 0;
+
+        for (size_t i = from; i < lim; i++)
+        {
+            auto res = img.Read(bk[i]);
+            auto expected = block(i);
+
+            if (res.size() == expected.size() && std::equal(res.begin(), res.end(), expected.begin()))
+                result++;
+        }
+
+        return result;
+    };
+
+    auto aligned = [&]()
+    {
+        bool result = true;
+
+        for (uint64_t s = 0; s < location::segments_t; s++)
+        {
+            auto path = location::path("testimage", s);
+
+            if (std::filesystem::exists(path))
+                result = result && !(std::filesystem::file_size(path) % io::direct_block_t);
+        }
+
+        return result;
+    };
+
+    {
+        Image2<TestHash, OptimisticIndex> img("testimage", 0, false, true);
+
+        for (size_t i = 0; i < lim; i++)
+            img.Write(bk[i], block(i));
+
+        CHECK(lim == reads(img, 0));
+    }
+
+    CHECK(aligned());
+
+    //The files stay readable buffered:
+    //
+
+    {
+        Image2<TestHash, OptimisticIndex> img("testimage");
+
+        CHECK(lim == reads(img, 0));
+    }
+
+    {
+        Image2<TestHash, OptimisticIndex> img("testimage", 0, false, true);
+
+        CHECK(lim == reads(img, 0));
+
+        for (size_t i = 0; i < lim / 2; i++)
+            img.Delete(bk[i]);
+
+        img.FlattenRate(0);
+        img.Flatten();
+
+        while (img.Flattening())
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+        CHECK(lim - lim / 2 == reads(img, lim / 2));
+    }
+
+    CHECK(aligned());
+
+    {
+        Image2<TestHash, OptimisticIndex> img("testimage", 0, false, true);
+
+        CHECK(lim - lim / 2 == reads(img, lim / 2));
+    }
+
+    //A new segment starts a whole block in, flatten still sees it as empty and leaves it active:
+    //
+
+    std::filesystem::remove_all("testimage");
+    filesystem::create_directories("testimage");
+
+    {
+        Image2<TestHash, OptimisticIndex> img("testimage", 0, false, true);
+
+        img.FlattenRate(0);
+        img.Flatten();
+
+        while (img.Flattening())
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+
+    CHECK(std::filesystem::exists(location::path("testimage", 0)));
+    CHECK(!std::filesystem::exists(location::path("testimage", 1)));
+
+    std::filesystem::remove_all("testimage");
+}
+
+//Index values repair::run walks, in place of an index table.
+//
+
+struct RepairSlots
+{
+    std::vector<uint64_t> values;
+
+    RepairSlots& Table() { return *this; }
+
+    template <typename F> void Iterate(F&& f)
+    {
+        for (auto& v : values)
+            if (!f(v))
+                return;
+    }
+};
+
+TEST_CASE("Repair reports and trims damaged entries", "[volstore::]")
+{
+    constexpr auto lim = 1000;
+
+    std::filesystem::remove("testrepair.dat");
+
+    std::vector<tdb::RandomKeyT<tdb::Key32>> bk(lim);
+    RepairSlots slots;
+
+    {
+        io::File file("testrepair.dat", true);
+        uint64_t offset = sizeof(uint64_t);
+
+        for (size_t i = 0; i < lim; i++)
+        {
+            auto record = record::encode(bk[i], std::vector<uint8_t>(32 + i % 97, (uint8_t)i));
+
+            file.Write(offset, record.data(), record.size());
+            slots.values.push_back(location::make(0, offset));
+
+            offset += record.size();
+        }
+    }
+
+    //A flipped payload byte, a block the validator rejects, an entry past the end of the file and one in a missing segment:
+    //
+
+    constexpr size_t corrupt = 100, invalid = 500, lost = 900, missing = 950, deleted = 700;
+
+    {
+        std::fstream file("testrepair.dat", std::ios::binary | std::ios::in | std::ios::out);
+        file.seekp(location::offset(slots.values[corrupt]) + sizeof(record::Header));
+        file.put((char)(corrupt ^ 0x5A));
+    }
+
+    slots.values[lost] = location::make(0, std::filesystem::file_size("testrepair.dat") + 4096);
+    slots.values[missing] = location::make(1, sizeof(uint64_t));
+
+    //A tombstone isn't checked, even where its record is gone:
+    //
+
+    slots.values[deleted] = location::make(0, std::filesystem::file_size("testrepair.dat") + 8192) | location::tombstone;
+
+    auto expected = slots.values;
+
+    io::File file("testrepair.dat");
+
+    auto files = [&](uint64_t segment) -> const io::File* { return (segment == 0) ? &file : nullptr; };
+    auto valid = [&](auto block) { return !(block.size() == 32 + invalid % 97 && block[0] == (uint8_t)invalid); };
+
+    //start_code 2 reports and leaves the index alone:
+    //
+
+    CHECK_THROWS(repair::run(slots, files, valid, false));
+    CHECK(expected == slots.values);
+
+    //start_code 3 trims exactly the damaged entries:
+    //
+
+    CHECK(4 == repair::run(slots, files, valid, true));
+
+    for (size_t i = 0; i < lim; i++)
+    {
+        if (i == corrupt || i == invalid || i == lost || i == missing)
+            CHECK(0 == slots.values[i]);
+        else
+            CHECK(expected[i] == slots.values[i]);
+    }
+
+    CHECK(0 == repair::run(slots, files, valid, false));
+
+    std::filesystem::remove("testrepair.dat");
+}
+
+TEST_CASE("Image2 repair start codes", "[volstore::]")
+{
+    constexpr auto lim = 1000;
+    constexpr auto record_size = 32 + sizeof(record::Header);
+
+    std::filesystem::remove_all("testimage");
+    filesystem::create_directories("testimage");
+
+    auto& bk = singleton<std::array<tdb::RandomKeyT<tdb::Key32>, lim>>(); // Heap
+
+    {
+        Image2<TestHash, OptimisticIndex> img("testimage");
+
+        for (auto& k : bk)
+            img.Write(k, k);
+    }
+
+    //Blocks were written in order, block i is the i-th record:
+    //
+
+    std::vector<size_t> damaged = { 10, lim / 2, lim - 1 };
+
+    {
+        std::fstream file(location::path("testimage", 0), std::ios::binary | std::ios::in | std::ios::out);
+
+        for (auto i : damaged)
+        {
+            file.seekp(sizeof(uint64_t) + i * record_size + sizeof(record::Header));
+            file.put(0x5A ^ ((uint8_t*)&bk[i])[0]);
+        }
+    }
+
+    //Verify only, the open fails and the damaged entries stay:
+    //
+
+    CHECK_THROWS(Image2<TestHash, OptimisticIndex>("testimage", 2));
+
+    {
+        Image2<TestHash, OptimisticIndex> img("testimage");
+
+        for (auto i : damaged)
+            CHECK_THROWS(img.Read(bk[i]));
+    }
+
+    //Repair trims them, they read as missing:
+    //
+
+    {
+        Image2<TestHash, OptimisticIndex> img("testimage", 3);
+
+        for (auto i : damaged)
+        {
+            CHECK(!img.Is(bk[i]));
+            CHECK(0 == img.Read(bk[i]).size());
+        }
+    }
+
+    std::filesystem::remove_all("testimage");
+}
+
+TEST_CASE("Image2 scrub", "[volstore::]")
+{
+    constexpr auto lim = 10000;
+    constexpr auto damaged = lim / 2;
+    constexpr auto record_size = 32 + sizeof(record::Header);
+
+    std::filesystem::remove_all("testimage");
+    filesystem::create_directories("testimage");
+
+    auto& bk = singleton<std::array<tdb::RandomKeyT<tdb::Key32>, lim>>(); // Heap
+
+    auto wait = [&](auto&& done)
+    {
+        for (size_t i = 0; i < 300 && !done(); i++)
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    };
+
+    //Written in order and sealed, so block i is the i-th record of segment 0:
+    //
+
+    {
+        Image2<TestHash, OptimisticIndex> img("testimage");
+
+        for (auto& k : bk)
+            img.Write(k, k);
+
+        img.SegmentSize(1);
+
+        wait([&]() { return std::filesystem::exists(location::path("testimage", 1)); });
+    }
+
+    CHECK(std::filesystem::exists(location::path("testimage", 1)));
+
+    {
+        std::fstream file(location::path("testimage", 0), std::ios::binary | std::ios::in | std::ios::out);
+        file.seekp(sizeof(uint64_t) + damaged * record_size + sizeof(record::Header));
+        file.put(0x5A ^ ((uint8_t*)&bk[damaged])[0]);
+    }
+
+    //A quarter of the blocks a second, the cursor is kept in scrub.db across a restart:
+    //
+
+    auto scrubbed = [&]()
+    {
+        Image2<TestHash, OptimisticIndex> img("testimage");
+        img.ScrubRate(lim / 4 * record_size);
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(1500));
+    };
+
+    scrubbed();
+    auto first = scrub::load("testimage");
+
+    scrubbed();
+    auto second = scrub::load("testimage");
+
+    CHECK(0 == first.segment);
+    CHECK(first.offset > 0);
+    CHECK(0 == second.segment);
+    CHECK(second.offset > first.offset * 3 / 2);
+
+    {
+        Image2<TestHash, OptimisticIndex> img("testimage");
+        img.ScrubRate(1024 * 1024 * 1024);
+
+        wait([&]() { return img.Stats()->scrub.passes.load() > 0; });
+
+        CHECK(img.Stats()->scrub.passes.load() > 0);
+        CHECK(img.Stats()->scrub.errors.load() > 0);
+        CHECK(0 == img.Read(bk[damaged]).size());
+    }
+
+    std::filesystem::remove_all("testimage");
+}
+
+#ifdef __linux__
+
+TEST_CASE("Group commit write failure", "[volstore::]")
+{
+    //Every write to /dev/full fails with ENOSPC:
+    //
+
+    for (bool direct : { false, true })
+    {
+        io::GroupWriter writer("/dev/full", sizeof(uint64_t), direct);
+
+        auto [offset, ticket] = writer.Append(std::vector<uint8_t>(100, 1));
+
+        CHECK_THROWS(writer.Wait(ticket));
+        CHECK_THROWS(writer.Append(std::vector<uint8_t>(100, 1)));
+        CHECK_THROWS(writer.Sync());
+        CHECK(0 == writer.Pending(offset).size());
+    }
+}
+
+#endif
+
+#ifdef VOLSTORE_URING
+
+TEST_CASE("ImageUring write read reopen", "[volstore::]")
+{
+    constexpr auto lim = 10000;
+
+    std::filesystem::remove_all("testimage");
+    filesystem::create_directories("testimage");
+
+    auto& bk = singleton<std::array<tdb::RandomKeyT<tdb::Key32>, lim>>(); // Heap
+
+    auto block = [&](size_t i) { return std::vector<uint8_t>(1 + i * 37 % 100000, (uint8_t)i); };
+
+    auto reads = [&](auto& img)
+    {
+        size_t result = 0;
+
+        for (size_t i = 0; i < lim; i++)
+        {
+            auto res = img.Read(bk[i]);
+            auto expected = block(i);
+
+            if (res.size() == expected.size() && std::equal(res.begin(), res.end(), expected.begin()))
+                result++;
+        }
+
+        return result;
+    };
+
+    {
+        ImageUring<TestHash> img("testimage");
+
+        std::atomic<size_t> written = 0, failed = 0;
+
+        for (size_t i = 0; i < lim; i++)
+            img.WriteAsync(bk[i], block(i), [&](bool ok) { (ok) ? written++ : failed++; });
+
+        while (written + failed < lim)
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+        CHECK(0 == failed);
+        CHECK(lim == reads(img));
+
+        std::atomic<size_t> async_reads = 0, done = 0;
+
+        for (size_t i = 0; i < lim; i++)
+        {
+            img.ReadAsync(bk[i], [&, i](d8u::sse_vector res)
+            {
+                auto expected = block(i);
+
+                if (res.size() == expected.size() && std::equal(res.begin(), res.end(), expected.begin()))
+                    async_reads++;
+
+                done++;
+            });
+        }
+
+        while (done < lim)
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+        CHECK(lim == async_reads.load());
+
+        for (size_t i = 0; i < lim; i += 2)
+            img.Delete(bk[i]);
+
+        size_t finds = 0;
+
+        for (auto& k : bk)
+            if (img.Is(k) && img.Read(k).size()) finds++;
+
+        CHECK(lim / 2 == finds);
+
+        img.Sync();
+    }
+
+    {
+        ImageUring<TestHash> img("testimage");
+
+        size_t finds = 0;
+
+        for (size_t i = 1; i < lim; i += 2)
+        {
+            auto res = img.Read(bk[i]);
+            auto expected = block(i);
+
+            if (res.size() == expected.size() && std::equal(res.begin(), res.end(), expected.begin()))
+                finds++;
+        }
+
+        CHECK(lim / 2 == finds);
+        CHECK(!img.Read(bk[0]).size());
+    }
+
+    std::filesystem::remove_all("testimage");
+}
 
+#endif
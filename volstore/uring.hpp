@@ -0,0 +1,875 @@
+/* Copyright (C) 2020 D8DATAWORKS - All Rights Reserved */
+
+#pragma once
+
+//Opt in, define VOLSTORE_URING and link liburing (-luring):
+//
+
+#ifdef VOLSTORE_URING
+
+#if !__has_include(<liburing.h>)
+#error "VOLSTORE_URING is defined but liburing.h is missing"
+#endif
+
+#include <string_view>
+#include <string>
+#include <filesystem>
+#include <bitset>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <future>
+#include <functional>
+#include <deque>
+
+#include <liburing.h>
+#include <sys/eventfd.h>
+
+#include "io.hpp"
+#include "location.hpp"
+#include "space.hpp"
+#include "record.hpp"
+#include "repair.hpp"
+#include "index.hpp"
+#include "bitmap.hpp"
+#include "cache.hpp"
+#include "stats.hpp"
+
+#include "tdb/legacy.hpp"
+#include "d8u/util.hpp"
+#include "d8u/memory.hpp"
+#include "d8u/transform.hpp"
+
+namespace volstore
+{
+	using namespace std;
+	using namespace gsl;
+
+	/*
+		Same image.dat layout as Image2, but all data file I/O goes through one io_uring.
+
+		Callers queue operations, the ring thread submits everything queued with a single io_uring_submit
+		and completes operations as their CQEs arrive. The data file and a pool of staging buffers are
+		registered with the ring. Any number of requests can be outstanding without a thread each,
+		ReadAsync / WriteAsync keep the device queue deep from a single thread.
+	*/
+
+	template < typename TH, typename INDEX = tdb::LargeHashmapSafe > class ImageUring
+	{
+		static unsigned constexpr depth_t = 256;
+		static size_t constexpr buffers_t = 128;
+		static size_t constexpr buffer_size_t = 64 * 1024;
+
+		enum Code : uint8_t
+		{
+			read,
+			write,
+			fsync
+		};
+
+		struct Op
+		{
+			Code code;
+			uint64_t offset;
+			uint8_t* data;
+			uint32_t size;
+			int buffer;
+
+			std::vector<uint8_t> storage;
+			std::function<void(int)> done;
+		};
+
+		INDEX db;
+
+		Statistics stats;
+		BlockCache<d8u::sse_vector> cache;
+		std::atomic<uint8_t> compression = codec::none;
+
+		bool running = true;
+		std::thread manager_thread;
+
+		std::string root;
+
+		io::File file;
+		std::atomic<uint64_t> tail;
+
+		DeadSpace dead;
+
+		//The ring and the eventfd that wakes it, released however the constructor leaves:
+		//
+
+		struct Uring
+		{
+			io_uring ring;
+			int wake = -1;
+
+			Uring()
+			{
+				if (io_uring_queue_init(depth_t, &ring, 0) < 0)
+					throw std::runtime_error("Failed to create io_uring");
+
+				wake = eventfd(0, EFD_CLOEXEC);
+
+				if (wake < 0)
+				{
+					io_uring_queue_exit(&ring);
+					throw std::runtime_error("Failed to create eventfd");
+				}
+			}
+
+			~Uring()
+			{
+				io_uring_queue_exit(&ring);
+				::close(wake);
+			}
+		};
+
+		Uring uring;
+		uint64_t wake_value = 0;
+
+		std::vector<uint8_t> buffer_memory;
+		std::vector<int> free_buffers;
+		std::mutex buffer_lock;
+
+		std::mutex queue_lock;
+		std::vector<Op*> queue;
+		bool ring_running = true;
+		std::thread ring_thread;
+
+		int AcquireBuffer()
+		{
+			std::lock_guard<std::mutex> lck(buffer_lock);
+
+			if (!free_buffers.size())
+				return -1;
+
+			auto b = free_buffers.back();
+			free_buffers.pop_back();
+
+			return b;
+		}
+
+		void ReleaseBuffer(int b)
+		{
+			if (b == -1)
+				return;
+
+			std::lock_guard<std::mutex> lck(buffer_lock);
+			free_buffers.push_back(b);
+		}
+
+		uint8_t* Buffer(int b)
+		{
+			return buffer_memory.data() + b * buffer_size_t;
+		}
+
+		void Enqueue(Op* op)
+		{
+			bool was_empty;
+
+			{
+				std::lock_guard<std::mutex> lck(queue_lock);
+				was_empty = !queue.size();
+				queue.push_back(op);
+			}
+
+			if (was_empty)
+				eventfd_write(uring.wake, 1);
+		}
+
+		int Wait(Op* op)
+		{
+			std::promise<int> p;
+			auto f = p.get_future();
+
+			op->done = [&p](int res) { p.set_value(res); };
+
+			Enqueue(op);
+
+			return f.get();
+		}
+
+		void ArmWake()
+		{
+			auto sqe = io_uring_get_sqe(&uring.ring);
+			io_uring_prep_read(sqe, uring.wake, &wake_value, sizeof(wake_value), 0);
+			io_uring_sqe_set_data(sqe, nullptr);
+		}
+
+		void Prepare(io_uring_sqe* sqe, Op* op)
+		{
+			switch (op->code)
+			{
+			case read:
+				if (op->buffer != -1)
+					io_uring_prep_read_fixed(sqe, 0, op->data, op->size, op->offset, op->buffer);
+				else
+					io_uring_prep_read(sqe, 0, op->data, op->size, op->offset);
+				break;
+			case write:
+				if (op->buffer != -1)
+					io_uring_prep_write_fixed(sqe, 0, op->data, op->size, op->offset, op->buffer);
+				else
+					io_uring_prep_write(sqe, 0, op->data, op->size, op->offset);
+				break;
+			case fsync:
+				io_uring_prep_fsync(sqe, 0, IORING_FSYNC_DATASYNC);
+				break;
+			}
+
+			sqe->flags |= IOSQE_FIXED_FILE;
+			io_uring_sqe_set_data(sqe, op);
+		}
+
+		void Ring()
+		{
+			std::deque<Op*> pending;
+			std::vector<Op*> incoming;
+			size_t inflight = 0;
+			size_t writing = 0;
+
+			ArmWake();
+			io_uring_submit(&uring.ring);
+
+			while (true)
+			{
+				{
+					std::lock_guard<std::mutex> lck(queue_lock);
+					std::swap(incoming, queue);
+
+					if (!ring_running && !incoming.size() && !pending.size() && !inflight)
+						break;
+				}
+
+				pending.insert(pending.end(), incoming.begin(), incoming.end());
+				incoming.clear();
+
+				//The whole backlog goes out in one submit, bounded by the ring depth:
+				//
+
+				size_t prepared = 0;
+				while (pending.size() && inflight < depth_t - 1)
+				{
+					//The kernel may complete an fsync before writes submitted ahead of it, it is held back until they are
+					//done. IOSQE_IO_DRAIN would also wait for the wake read, which stays armed until the next Enqueue:
+					//
+
+					if (pending.front()->code == fsync && writing)
+						break;
+
+					auto sqe = io_uring_get_sqe(&uring.ring);
+
+					if (!sqe)
+						break;
+
+					if (pending.front()->code == write)
+						writing++;
+
+					Prepare(sqe, pending.front());
+					pending.pop_front();
+
+					inflight++;
+					prepared++;
+				}
+
+				if (prepared)
+					io_uring_submit(&uring.ring);
+
+				io_uring_cqe* cqe;
+				if (io_uring_wait_cqe(&uring.ring, &cqe) < 0)
+					continue;
+
+				unsigned head, seen = 0;
+				bool rearm = false;
+
+				io_uring_for_each_cqe(&uring.ring, head, cqe)
+				{
+					auto op = (Op*)io_uring_cqe_get_data(cqe);
+					seen++;
+
+					if (!op)
+					{
+						rearm = true;
+						continue;
+					}
+
+					inflight--;
+
+					if (op->code == write)
+						writing--;
+
+					op->done(cqe->res);
+					delete op;
+				}
+
+				io_uring_cq_advance(&uring.ring, seen);
+
+				if (rearm)
+				{
+					ArmWake();
+					io_uring_submit(&uring.ring);
+				}
+			}
+		}
+
+		Op* ReadOp(uint64_t offset, uint8_t* dest = nullptr, uint32_t size = buffer_size_t)
+		{
+			auto op = new Op{ read, offset, dest, size, -1 };
+
+			if (!dest)
+			{
+				op->buffer = AcquireBuffer();
+
+				if (op->buffer != -1)
+					op->data = Buffer(op->buffer);
+				else
+				{
+					op->storage.resize(size);
+					op->data = op->storage.data();
+				}
+			}
+
+			return op;
+		}
+
+		Op* WriteOp(uint64_t offset, const void* key, gsl::span<const uint8_t> payload, uint8_t flags = 0, uint8_t c = codec::none)
+		{
+			uint32_t length = (uint32_t)(payload.size() + sizeof(record::Header));
+			auto op = new Op{ write, offset, nullptr, length, -1 };
+
+			if (length <= buffer_size_t)
+				op->buffer = AcquireBuffer();
+
+			if (op->buffer != -1)
+				op->data = Buffer(op->buffer);
+			else
+			{
+				op->storage.resize(length);
+				op->data = op->storage.data();
+			}
+
+			auto header = record::make(key, (uint32_t)payload.size(), flags);
+			header.codec = c;
+			std::copy(payload.begin(), payload.end(), op->data + sizeof(record::Header));
+
+			record::seal(header, op->data + sizeof(record::Header));
+			std::memcpy(op->data, &header, sizeof(record::Header));
+
+			return op;
+		}
+
+		std::shared_ptr<const d8u::sse_vector> Cached(const tdb::Key32& key, uint64_t v)
+		{
+			if (!cache.Enabled())
+				return nullptr;
+
+			auto hit = cache.Find(key, v);
+
+			if (!hit)
+			{
+				stats.cache.misses++;
+				return nullptr;
+			}
+
+			stats.cache.hits++;
+			stats.atomic.items++;
+			stats.atomic.read += hit->size();
+
+			return hit;
+		}
+
+		//Header and the first buffer of payload arrive in the first read, the remainder of large blocks goes straight into the result.
+		//
+
+		template <typename F> void ReadOffset(uint64_t offset, F&& f)
+		{
+			auto op = ReadOp(offset);
+
+			op->done = [this, op, offset, f = std::move(f)](int res) mutable
+			{
+				if (res < (int)record::legacy_t || res < (int)record::header_size(op->data) || record::length(op->data) > record::max_block_t)
+				{
+					ReleaseBuffer(op->buffer);
+					return f(d8u::sse_vector(), false);
+				}
+
+				bool legacy = record::legacy(op->data);
+				size_t header_size = record::header_size(op->data);
+				uint32_t size = record::length(op->data);
+
+				record::Header header = {};
+
+				if (!legacy)
+					std::memcpy(&header, op->data, sizeof(record::Header));
+
+				d8u::sse_vector result(size);
+
+				size_t count = std::min((size_t)size, (size_t)res - header_size);
+				std::copy(op->data + header_size, op->data + header_size + count, result.begin());
+
+				ReleaseBuffer(op->buffer);
+
+				stats.atomic.items++;
+				stats.atomic.read += size;
+
+				//Checks the stored bytes and decompresses them in place:
+				//
+
+				auto finish = [legacy, header](d8u::sse_vector& block)
+				{
+					if (legacy)
+						return true;
+
+					if (!record::verify(header, block.data()))
+						return false;
+
+					if (header.codec == codec::none)
+						return true;
+
+					d8u::sse_vector decoded;
+
+					if (!record::decode(header, block.data(), decoded))
+						return false;
+
+					block = std::move(decoded);
+
+					return true;
+				};
+
+				if (count == size)
+				{
+					bool ok = finish(result);
+					return f(std::move(result), ok);
+				}
+
+				auto shared = std::make_shared<d8u::sse_vector>(std::move(result));
+				auto rest = ReadOp(offset + header_size + count, shared->data() + count, (uint32_t)(size - count));
+
+				rest->done = [shared, finish, remaining = size - count, f = std::move(f)](int res) mutable
+				{
+					if (res != (int)remaining)
+						return f(d8u::sse_vector(), false);
+
+					bool ok = finish(*shared);
+					f(std::move(*shared), ok);
+				};
+
+				Enqueue(rest);
+			};
+
+			Enqueue(op);
+		}
+
+	public:
+
+		Statistics* Stats() { return &stats; }
+
+		//Bytes of blocks kept in memory for Read and ReadAsync, zero (the default) disables.
+		//
+
+		void CacheSize(size_t bytes) { cache.Capacity(bytes); }
+
+		//As Image2::Compression.
+		//
+
+		void Compression(uint8_t c)
+		{
+			if (!codec::supported(c))
+				throw std::runtime_error("Codec not supported");
+
+			compression = c;
+		}
+
+		ImageUring(string_view _root, int start_code = 0)
+			: db(string(_root) + "/index.db")
+			, root(_root)
+			, file(string(_root) + "/image.dat", true)
+			, tail(0)
+			, dead(string(_root) + "/dead.db")
+		{
+			if (start_code)
+				std::filesystem::remove(string(root) + "/lock.db");
+
+			if (std::filesystem::exists(string(_root) + "/lock.db"))
+				throw std::runtime_error("Image is locked, is a backup running? Did a backup fail to complete gracefully? If the second is true please delete the lock file.");
+
+			//Offset zero is the unwritten index value, no record is placed there:
+			//
+
+			tail = std::max(file.Size(), (uint64_t)sizeof(uint64_t));
+
+			int files[1] = { file.Handle() };
+			if (io_uring_register_files(&uring.ring, files, 1) < 0)
+				throw std::runtime_error("Failed to register image file");
+
+			buffer_memory.resize(buffers_t * buffer_size_t);
+
+			std::vector<iovec> iov(buffers_t);
+			for (size_t i = 0; i < buffers_t; i++)
+			{
+				iov[i] = { Buffer((int)i), buffer_size_t };
+				free_buffers.push_back((int)i);
+			}
+
+			if (io_uring_register_buffers(&uring.ring, iov.data(), (unsigned)iov.size()) < 0)
+				throw std::runtime_error("Failed to register io buffers");
+
+			if (start_code == 1)
+				RepairQuick();
+			else if (start_code == 2)
+				Repair(false);
+			else if (start_code == 3)
+				Repair(true);
+			else if (start_code == 4)
+				Rebuild();
+
+			d8u::util::empty_file(string(_root) + "/lock.db");
+
+			//Threads start last, nothing has to be stopped when the open fails:
+			//
+
+			ring_thread = std::thread([&]() { Ring(); });
+
+			manager_thread = std::thread([&]()
+			{
+				size_t counter = 0;
+				while (running)
+				{
+					std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+
+					if (counter++ % 10 == 0)
+					{
+						db.Flush();
+						dead.Flush();
+						Sync();
+					}
+				}
+			});
+		}
+
+		~ImageUring()
+		{
+			running = false;
+			manager_thread.join();
+
+			Sync();
+			db.Flush();
+			dead.Flush();
+
+			{
+				std::lock_guard<std::mutex> lck(queue_lock);
+				ring_running = false;
+			}
+
+			eventfd_write(uring.wake, 1);
+			ring_thread.join();
+
+			std::filesystem::remove(string(root) + "/lock.db");
+		}
+
+		//Durability point for every write queued before the call.
+		//
+
+		void Sync()
+		{
+			Wait(new Op{ fsync, 0, nullptr, 0, -1 });
+		}
+
+		//Recovers index entries from the records in image.dat, start_code 4 runs this before the image opens.
+		//
+
+		size_t Rebuild()
+		{
+			auto count = record::rebuild(db, root, 1, 0, [](const tdb::Key32&) {});
+
+			std::cout << "Rebuilt index entries: " << count << std::endl;
+
+			return count;
+		}
+
+		void RepairQuick()
+		{
+			auto& table = db.Table();
+
+			std::cout << "Lock reset count: " << table.ResetNodeLocks() << std::endl;
+
+			size_t count = 0;
+			table.Iterate([&](auto v)
+			{
+				if (!v)
+					count++;
+
+				return true;
+			});
+
+			std::cout << "Null block pointer count: " << count << std::endl;
+		}
+
+		//Sequential windows through the same descriptor the ring uses, see repair.hpp.
+		//
+
+		void Repair(bool can_write)
+		{
+			repair::run(db, [&](uint64_t segment) -> const io::File*
+			{
+				return (segment) ? nullptr : &file;
+			}, [](auto block)
+			{
+				return d8u::transform::validate_block<TH>(block);
+			}, can_write);
+		}
+
+		template <typename T> bool ValidateStandard(const T& id)
+		{
+			auto block = Read(id);
+
+			return d8u::transform::validate_block<TH>(block);
+		}
+
+		template <typename T, typename V> bool Validate(const T& id, V v)
+		{
+			auto block = Read(id);
+
+			return v(block);
+		}
+
+		//Completion runs on the ring thread, keep it short.
+		//
+
+		template <typename T, typename F> void ReadAsync(const T& id, F&& f)
+		{
+			auto& key = *((tdb::Key32*) id.data());
+			auto addr = db.FindLock(key);
+			uint64_t v = (addr) ? std::atomic_ref<uint64_t>(*addr).load() : 0;
+
+			if (!location::live(v))
+				return f(d8u::sse_vector());
+
+			if (auto hit = Cached(key, v))
+				return f(d8u::sse_vector(*hit));
+
+			ReadOffset(v, [this, key, v, f = std::move(f)](d8u::sse_vector result, bool ok) mutable
+			{
+				if (!ok)
+					return f(d8u::sse_vector());
+
+				cache.Insert(key, v, result);
+
+				f(std::move(result));
+			});
+		}
+
+		template <typename T> d8u::sse_vector Read(const T& id)
+		{
+			auto& key = *((tdb::Key32*) id.data());
+			auto addr = db.FindLock(key);
+			uint64_t v = (addr) ? std::atomic_ref<uint64_t>(*addr).load() : 0;
+
+			//Unwritten and deleted entries read as missing, the value is loaded once so a concurrent Delete can't slip in between:
+			//
+
+			if (!location::live(v)) return d8u::sse_vector();
+
+			if (auto hit = Cached(key, v))
+				return *hit;
+
+			std::promise<std::pair<d8u::sse_vector, bool>> p;
+			auto f = p.get_future();
+
+			ReadOffset(v, [&p](d8u::sse_vector result, bool ok)
+			{
+				p.set_value(std::make_pair(std::move(result), ok));
+			});
+
+			auto [result, ok] = f.get();
+
+			if (!ok)
+				throw std::runtime_error("Bad block");
+
+			cache.Insert(key, v, result);
+
+			return result;
+		}
+
+		void _Write2() {} //No Op
+
+		template <typename T, typename Y> void _Write1(const T& id, const Y& payload)
+		{
+			Write(id, payload); //Passthrough
+		}
+
+		//The index entry is published once the record has reached the file, so readers never see an unwritten offset.
+		//f(bool) is false when the write failed, the slot then stays unwritten and reads as missing until a retry.
+		//
+
+		template <typename T, typename Y, typename F> void WriteAsync(const T& id, const Y& payload, F&& f)
+		{
+			uint32_t size = (uint32_t)payload.size();
+
+			stats.atomic.blocks++;
+			stats.atomic.write += size;
+
+			auto res = db.InsertLock(*((tdb::Key32*) id.data()), uint64_t(0));
+
+			if (res.second && location::live(*res.first))
+				return f(true); //Block has already been written.
+
+			uint8_t c = compression;
+			auto compressed = codec::compress(c, (const uint8_t*)payload.data(), payload.size());
+
+			auto stored = (compressed.size()) ? gsl::span<const uint8_t>(compressed.data(), compressed.size())
+				: gsl::span<const uint8_t>((const uint8_t*)payload.data(), payload.size());
+
+			uint64_t o = tail.fetch_add(stored.size() + sizeof(record::Header));
+
+			auto op = WriteOp(o, id.data(), stored, 0, (compressed.size()) ? c : codec::none);
+
+			op->done = [this, op, o, slot = res.first, f = std::move(f)](int res) mutable
+			{
+				ReleaseBuffer(op->buffer);
+
+				bool written = res == (int)op->size;
+
+				if (written)
+					std::atomic_ref<uint64_t>(*slot).store(o);
+
+				f(written);
+			};
+
+			Enqueue(op);
+		}
+
+		template <typename T, typename Y> void Write(const T& id, const Y& payload)
+		{
+			std::promise<bool> p;
+			auto f = p.get_future();
+
+			WriteAsync(id, payload, [&p](bool written) { p.set_value(written); });
+
+			if (!f.get())
+				throw std::runtime_error("Write failed");
+		}
+
+		template < typename T > int _IsLocal(const T& id)
+		{
+			stats.atomic.queries++;
+
+			auto* i = db.FindLock(*((tdb::Key32*) id.data()));
+
+			return (i != nullptr && location::live(*i)) ? 1 : -1;
+		}
+
+		template <size_t U, typename T> void _Many1(const T& ids) {} //No Op
+
+		uint64_t _Many2()
+		{
+			return 0; //No Op
+		}
+
+		template <typename T> bool Is(const T& id)
+		{
+			stats.atomic.queries++;
+
+			auto* i = db.FindLock(*((tdb::Key32*) id.data()));
+
+			return i != nullptr && location::live(*i);
+		}
+
+		template <size_t U, typename T> uint64_t Many(const T& ids)
+		{
+			std::bitset<64> result;
+
+			auto limit = ids.size() / U;
+
+			stats.atomic.queries += limit;
+
+			if (limit > 64)
+				throw runtime_error("The max limit for Many is 64");
+
+			uint64_t* found[64];
+			FindMany(db, (const tdb::Key32*)ids.data(), limit, found);
+
+			for (size_t i = 0; i < limit; i++)
+				result.set(i, (found[i] != nullptr && location::live(*found[i])));
+
+			return result.to_ullong();
+		}
+
+		//Existence of any number of keys as a bitmap, see bitmap.hpp.
+		//
+
+		template <size_t U, typename T> std::vector<uint8_t> ManyBitmap(const T& ids)
+		{
+			auto limit = ids.size() / U;
+
+			stats.atomic.queries += limit;
+
+			std::vector<uint8_t> result(bitmap::bytes(limit));
+			std::vector<uint64_t*> found(std::min(limit, bitmap::frame_t));
+
+			bitmap::frames(limit, [&](size_t first, size_t count)
+			{
+				FindMany(db, (const tdb::Key32*)ids.data() + first, count, found.data());
+
+				for (size_t i = 0; i < count; i++)
+					if (found[i] != nullptr && location::live(*found[i]))
+						bitmap::set(result.data(), first + i);
+			});
+
+			return result;
+		}
+
+		//Tombstones only, this engine has no Flatten yet so the dead bytes are just accounted for.
+		//
+
+		template <typename T> bool Delete(const T& id)
+		{
+			auto addr = db.FindLock(*((tdb::Key32*) id.data()));
+
+			if (!addr)
+				return false;
+
+			std::atomic_ref<uint64_t> slot(*addr);
+			uint64_t current = slot.load();
+
+			if (!location::live(current) || !slot.compare_exchange_strong(current, current | location::tombstone))
+				return false;
+
+			record::Header header = {};
+			file.Read(location::offset(current), &header, sizeof(record::Header));
+
+			dead.Add(current, record::total(&header));
+
+			//The tombstone record lets an index rebuilt from the data file see the delete:
+			//
+
+			uint64_t o = tail.fetch_add(sizeof(record::Header));
+			auto op = WriteOp(o, id.data(), gsl::span<const uint8_t>(), record::deleted);
+
+			op->done = [this, op](int) { ReleaseBuffer(op->buffer); };
+
+			Enqueue(op);
+
+			dead.Add(o, sizeof(record::Header));
+
+			return true;
+		}
+
+		template <size_t U, typename T> uint64_t DeleteMany(const T& ids)
+		{
+			std::bitset<64> result;
+
+			auto limit = ids.size() / U;
+
+			if (limit > 64)
+				throw runtime_error("The max limit for DeleteMany is 64");
+
+			for (size_t i = 0; i < limit; i++)
+				result.set(i, Delete(gsl::span<uint8_t>((uint8_t*)ids.data() + U * i, U)));
+
+			return result.to_ullong();
+		}
+	};
+}
+
+#endif //VOLSTORE_URING